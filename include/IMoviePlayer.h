@@ -16,6 +16,15 @@ public:
     virtual size_t Size() const = 0;
 };
 
+// 位置指定読み込みを持つ stream 用の拡張インターフェース (任意)。
+//   ReadAt は Tell/Seek の位置を変更せず、ReadAt と Size は複数スレッドから
+//   同時に呼べること。
+//   これを実装した stream は、複数の reader で共有してもロックで直列化されない。
+class IMovieReadStream2 : public IMovieReadStream {
+public:
+    virtual size_t ReadAt(int64_t offset, void *buf, size_t size) = 0;
+};
+
 
 class IMoviePlayer
 {
@@ -72,6 +81,47 @@ public:
     PcmEncoding encoding;
   };
 
+  // オーディオトラックの情報 (GetAudioTrackInfo)
+  struct AudioTrackInfo
+  {
+    int32_t trackIndex; // ファイル内のトラック番号 (0 起点)
+    const char *codec;  // "vorbis" / "opus"
+    int32_t sampleRate;
+    int32_t channels;
+  };
+
+  // I/O statistics (Open からの累積。Windows/nestegg 版のみ、Android は全て 0)
+  //   demux 側: demuxer (nestegg) からの読み込み要求。blockedUs は demux が
+  //             読み込みで待たされた累計時間で、I/O 由来のカクつきの目安になる。
+  //   storage 側: 実際のファイル/stream/fd への I/O。demux 側との差が
+  //             バッファ・先読みで吸収できた分。
+  struct IOStats
+  {
+    uint64_t readCalls;
+    uint64_t readBytes;
+    uint64_t seekCalls;
+    uint64_t backwardSeeks;
+    int64_t blockedUs;
+
+    uint64_t storageReadCalls;
+    uint64_t storageReadBytes;
+    uint64_t storageSeekCalls;
+    uint64_t storageBackwardSeeks;
+    int64_t storageReadUs;
+  };
+
+  // Probe で取得するムービー情報
+  struct ProbeInfo
+  {
+    bool hasVideo;
+    VideoFormat video;      // colorFormat は COLOR_UNKNOWN (再生時の指定で決まる)
+    const char *videoCodec; // "vp8" / "vp9" / "av1" (無ければ nullptr)
+    bool hasAudio;
+    AudioFormat audio;      // 再生時に IAudioSink へ渡されるフォーマット
+    const char *audioCodec; // "vorbis" / "opus" (無ければ nullptr)
+    int64_t durationUs;     // 不明なら -1
+  };
+
   enum ColorRange
   {
     COLOR_RANGE_UNDEF = 0,
@@ -112,16 +162,110 @@ public:
     STATE_FINISH, // Playback finished
   };
 
+  // 暗号化されたトラック (WebM ContentEncryption / AES-CTR) の鍵を返す callback。
+  // keyId はトラックの ContentEncKeyID。key に 16 byte (AES-128) を書いて true を返す。
+  typedef std::function<bool(const uint8_t *keyId, size_t keyIdLength, uint8_t *key)>
+    OnContentKey;
+
   // Creation parameters
   struct InitParam
   {
     ColorFormat videoColorFormat;
-    // audio 出力先。host が用意して渡す。nullptr の場合は audio 無しで再生。
+    // audio 出力先。host が用意して渡す。nullptr の場合は audio 無しで再生
+    // (オーディオトラックはデマックスもデコードもしない。Windows/nestegg 版)。
     IAudioSink *audioSink;
+    // IMovieReadStream から読む場合のまとめ読みサイズ(byte)。
+    // 小さな Read/Seek を host に直接流さずバッファで吸収する。0 でバッファ無し。
+    // (Windows/nestegg 版のみ有効。Android は AMediaExtractor 側で管理される)
+    size_t streamBufferSize;
+    // 先読みスレッドの読み込み窓。prefetchSeconds > 0 なら平均ビットレートから
+    // 換算した秒数分、そうでなければ prefetchSize(byte) 分を別スレッドで先読みする。
+    // 両方 0 (既定) なら先読みスレッド無し。(Windows/nestegg 版のみ有効)
+    size_t prefetchSize;
+    float prefetchSeconds;
+    // ループ再生用のパケットキャッシュの上限(byte)。0 (既定) なら無効。
+    // 1 周目にデマックスしたパケットをメモリに保持し、2 周目以降はファイルを
+    // 読まずにそこからデコーダへ渡す。ムービーが上限に収まらなければ使われない。
+    // 上限はパケットのデータとパケットごとの管理情報 (数十 byte) の合計で数える。
+    // (Windows/nestegg 版のみ有効)
+    size_t loopCacheSize;
+    // Cluster 単位まとめ読みの Cluster 最大サイズ(byte)。0 (既定) なら無効。
+    // Cluster 全体を 1 回の読み込みで取得してメモリ上で解析し、細かい Read を減らす。
+    // これより大きな Cluster は通常どおり読む。先読み有効時は使われない。
+    // (Windows/nestegg 版のみ有効)
+    size_t maxClusterReadSize;
+    // IMovieReadStream を先頭から順に読むだけで再生する (パイプやネットワーク等)。
+    // stream は Read だけが呼ばれ (Seek/Size/Tell は呼ばれない)、開いた時点の位置を
+    // ムービーの先頭として読む。
+    // サイズ不明の Segment/Cluster、尺の無いムービーも再生できるが、シークはできない
+    // (IsSeekable が false、Seek は無視、ループはキャッシュ無しでは終端で停止)。
+    // (Windows/nestegg 版のみ有効)
+    bool streamForwardOnly;
+    // ファイルパス版で、他プロセスが書き込み中のファイルを追いかけて再生する
+    // (録画中のプレビュー等)。終端に達したら followLatencyMs(ms) 間隔でファイル
+    // サイズを確認し、書き足されていれば最後に読み切ったブロックの後ろから再開する。
+    // followTimeoutMs(ms) > 0 ならその間書き足されなければ終端として再生終了する
+    // (0 なら待ち続ける)。ヘッダ (最初の Cluster の手前まで) は書き込み済みであること。
+    // シークはできない (IsSeekable が false)。(Windows/nestegg 版のみ有効)
+    bool followFile;
+    int32_t followLatencyMs;
+    int32_t followTimeoutMs;
+    // ファイルパス版/fd 版でファイルをメモリマップして読む (既定 false)。
+    // 読み込みがコピー 1 回になるが、再生中にファイルが切り詰められたり置き換え
+    // られたりすると SIGBUS でプロセスが落ちる (Windows では例外) ので、再生中に
+    // 変更されないファイルにのみ使うこと。マップできなければ通常の読み込みになる。
+    // followFile と同時に指定した場合は followFile が優先。(Windows/nestegg 版のみ有効)
+    bool memoryMappedFile;
+    // 暗号化トラックの鍵の取得。Open 中に暗号化トラックごとに 1 回呼ばれ、
+    // 鍵が得られなければ生成に失敗する。ブロックはデマックス時に復号される。
+    // (Windows/nestegg 版のみ有効)
+    OnContentKey contentKeyCallback;
+    // デマックス (ファイルの読み込みとブロックの解析) を専用スレッドで行い、
+    // ビデオ/オーディオそれぞれのパケットキューに先読みしておく (既定 true)。
+    // 読み込みが一時的に詰まっても、キューが尽きるまではフレームの切り替えや
+    // 音声の供給が止まらない。false なら再生ループのスレッドで都度読む。
+    // (Windows/nestegg 版のみ有効)
+    bool demuxThread;
+    // demuxThread 有効時に、ビデオとオーディオを同じソースを別に開いた reader で
+    // それぞれ独立に読み進める (既定 false)。ビデオとオーディオの並びが偏った
+    // ファイルで、片方のキューが埋まってもう片方が読めずに途切れるのを防ぐ。
+    // ソースを 2 回開く (鍵のコールバックも 2 回呼ばれる)。IMovieReadStream 版は
+    // IMovieReadStream2 の場合のみ有効。(Windows/nestegg 版のみ有効)
+    bool demuxPerTrack;
+    // デコーダの入出力キューのスロット数 (0 なら既定値: ビデオ 4、オーディオ 16)。
+    // decodeQueueBytes はデコード済みフレームの合計バイト数の上限 (0 なら無制限) で、
+    // 4K RGBA のように 1 フレームが大きい場合にスロット数より優先して絞る (最低 2)。
+    // adaptiveDecodeQueue はビデオのデコード時間の揺らぎが大きいと先読みを増やし
+    // (スロット数未指定なら最大 8)、システムのメモリ使用率が 90% 以上なら最低限まで
+    // 減らす。(Windows/nestegg 版のみ有効)
+    size_t videoDecodeQueueSize;
+    size_t audioDecodeQueueSize;
+    size_t videoDecodeQueueBytes;
+    size_t audioDecodeQueueBytes;
+    bool adaptiveDecodeQueue;
     void Init()
     {
-      videoColorFormat = COLOR_UNKNOWN;
-      audioSink        = nullptr;
+      videoColorFormat   = COLOR_UNKNOWN;
+      audioSink          = nullptr;
+      streamBufferSize   = 256 * 1024;
+      prefetchSize       = 0;
+      prefetchSeconds    = 0.0f;
+      loopCacheSize      = 0;
+      maxClusterReadSize = 0;
+      streamForwardOnly  = false;
+      followFile         = false;
+      followLatencyMs    = 100;
+      followTimeoutMs    = 0;
+      memoryMappedFile   = false;
+      contentKeyCallback = nullptr;
+      demuxThread        = true;
+      demuxPerTrack      = false;
+
+      videoDecodeQueueSize  = 0;
+      audioDecodeQueueSize  = 0;
+      videoDecodeQueueBytes = 0;
+      audioDecodeQueueBytes = 0;
+      adaptiveDecodeQueue   = false;
     }
   };
 
@@ -149,15 +293,35 @@ public:
   virtual bool IsAudioAvailable() const                  = 0;
   virtual void GetAudioFormat(AudioFormat *format) const = 0;
 
+  // audio track
+  //   再生できるオーディオトラックの数と情報 (index は 0 .. GetAudioTrackCount()-1)。
+  //   SelectAudioTrack は再生を止めずに、今の位置から指定のトラックへ音声を切り替える。
+  //   切り替えは非同期で、受け付けた時点で true を返す。IAudioSink のフォーマットは
+  //   Open 時に決まるので、サンプルレートとチャンネル数が同じトラックのみ切り替えられる。
+  //   シークできない入力では切り替えられない。(Windows/nestegg 版のみ。Android は 0/false)
+  virtual int32_t GetAudioTrackCount() const                                = 0;
+  virtual bool GetAudioTrackInfo(int32_t index, AudioTrackInfo *info) const = 0;
+  virtual int32_t GetAudioTrack() const                                     = 0;
+  virtual bool SelectAudioTrack(int32_t index)                              = 0;
+  // 再生中にオーディオのデコードを止める/再開する (非同期、受け付けたら true)。
+  //   止めている間は IsAudioAvailable が false になり、ビデオのフレーム時刻で再生が進む。
+  //   再開は今の位置からオーディオを読み直すので、シークできない入力では false。
+  //   (Windows/nestegg 版のみ。Android は false)
+  virtual bool SetAudioEnabled(bool enabled) = 0;
+
   // audio volume
   virtual void SetVolume(float volume) = 0;
   virtual float Volume() const         = 0;
 
   // info
+  // 尺が分からない場合は -1
   virtual int64_t Duration() const = 0;
   virtual int64_t Position() const = 0;
   virtual bool IsPlaying() const   = 0;
   virtual bool Loop() const        = 0;
+  // 前方読みのみの stream や書き込み中のファイルを開いた場合は false (Seek は無視される)
+  virtual bool IsSeekable() const  = 0;
+  virtual void GetIOStats(IOStats *stats) const = 0;
 
   // Video decoder callback (旧型・ARGB 系専用、 高速経路)。
   //   host は updater(dest, pitch) を 1 回呼ぶことで、 decoder 側の packed RGBA バッファを
@@ -207,4 +371,28 @@ public:
   static IMoviePlayer *CreateMoviePlayer(const char *filename, InitParam &param);
 
   static IMoviePlayer *CreateMoviePlayer(IMovieReadStream *stream, InitParam &param);
+
+  // メモリ上の WebM から生成する。data はプレイヤーを破棄するまで有効にしておくこと。
+  // (Windows 版はフレームデータをコピーせず data から直接参照する)
+  static IMoviePlayer *CreateMoviePlayer(const void *data, size_t size, InitParam &param);
+
+  // fd の [offset, offset+length) の範囲から生成する (length <= 0 なら末尾まで)。
+  // アーカイブ内に無圧縮で格納されたムービーをそのまま再生する用途。
+  // fd は内部で複製するので生成後に閉じてもよく、同じ fd から複数生成してもよい。
+  static IMoviePlayer *CreateMoviePlayer(int fd, int64_t offset, int64_t length,
+                                         InitParam &param);
+
+  // DASH 形式 (初期化セグメント + メディアセグメント) のファイル群を連結して
+  // 1 つのムービーとして再生する。segmentPaths[0] が初期化セグメントで、
+  // 以降のメディアセグメントは Cluster から始まっていること。
+  // 各セグメントはファイルごと読み込まれ、次のセグメントは再生中に先読みされる。
+  // シークは対象時刻を含むセグメントの先頭へ飛ぶ。(Windows/nestegg 版のみ。Android は nullptr)
+  static IMoviePlayer *CreateSegmentedMoviePlayer(const char *const *segmentPaths,
+                                                  size_t segmentCount, InitParam &param);
+
+  // ヘッダ (と尺が無ければ末尾) だけを読んでムービー情報を取得する。
+  // デコーダ・スレッド・フレームバッファは作らないので、大量のファイルの一覧表示等に使う。
+  // 再生時と同じく最初のビデオ/オーディオトラックが対象。(Windows/nestegg 版のみ。Android は false)
+  static bool Probe(const char *filename, ProbeInfo *info);
+  static bool Probe(IMovieReadStream *stream, ProbeInfo *info);
 };
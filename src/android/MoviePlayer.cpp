@@ -16,6 +16,8 @@
 #include "media/NdkMediaExtractor.h"
 #include "media/NdkMediaDataSource.h"
 #include <android/asset_manager.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <android/log.h>
 #define TAG       "MoviePlayer"
@@ -152,6 +154,14 @@ MoviePlayer::Open(IMovieReadStream *stream)
   return mPlayer->Open(stream);
 }
 
+bool
+MoviePlayer::Open(const void *data, size_t size)
+{
+  mPlayer = new MoviePlayerCore(mInitParam.audioSink);
+  mPlayer->SetPixelFormat(conv_color_format(mInitParam.videoColorFormat));
+  return mPlayer->Open(data, size);
+}
+
 bool
 MoviePlayer::Open(int fd, off_t offset, off_t length)
 {
@@ -382,6 +392,51 @@ MoviePlayer::Loop() const
   }
 }
 
+// オーディオトラックの切り替えは未対応 (最初のトラックのみ再生する)
+int32_t
+MoviePlayer::GetAudioTrackCount() const
+{
+  return 0;
+}
+
+bool
+MoviePlayer::GetAudioTrackInfo(int32_t index, AudioTrackInfo *info) const
+{
+  return false;
+}
+
+int32_t
+MoviePlayer::GetAudioTrack() const
+{
+  return -1;
+}
+
+bool
+MoviePlayer::SelectAudioTrack(int32_t index)
+{
+  return false;
+}
+
+bool
+MoviePlayer::SetAudioEnabled(bool enabled)
+{
+  return false;
+}
+
+bool
+MoviePlayer::IsSeekable() const
+{
+  // AMediaExtractor は常にシーク可能な入力から読む
+  return (mPlayer != nullptr);
+}
+
+void
+MoviePlayer::GetIOStats(IOStats *stats) const
+{
+  // AMediaExtractor 内部の I/O は観測できないので未対応
+  *stats = IOStats();
+}
+
 void
 MoviePlayer::SetOnVideoDecoded(OnVideoDecoded func)
 {
@@ -420,3 +475,58 @@ IMoviePlayer::CreateMoviePlayer(IMovieReadStream *stream, InitParam &param)
   delete player;
   return nullptr;
 }
+
+IMoviePlayer *
+IMoviePlayer::CreateMoviePlayer(const void *data, size_t size, InitParam &param)
+{
+  MoviePlayer *player = new MoviePlayer(param);
+  if (player->Open(data, size)) {
+    return player;
+  }
+  delete player;
+  return nullptr;
+}
+
+IMoviePlayer *
+IMoviePlayer::CreateMoviePlayer(int fd, int64_t offset, int64_t length, InitParam &param)
+{
+  // Open(fd) は fd の所有権を取って Done で閉じるので、呼び出し側の fd は dup して渡す
+  int ownFd = (fd >= 0) ? dup(fd) : -1;
+  if (ownFd < 0) {
+    return nullptr;
+  }
+  if (length <= 0) {
+    struct stat st;
+    length = (fstat(ownFd, &st) == 0) ? st.st_size - offset : 0;
+  }
+  MoviePlayer *player = new MoviePlayer(param);
+  if (player->Open(ownFd, (off_t)offset, (off_t)length)) {
+    return player;
+  }
+  delete player;
+  return nullptr;
+}
+
+IMoviePlayer *
+IMoviePlayer::CreateSegmentedMoviePlayer(const char *const *segmentPaths, size_t segmentCount,
+                                         InitParam &param)
+{
+  // AMediaExtractor に複数ファイルを連結して渡す手段が無いので未対応
+  LOGE("segmented movie is not supported\n");
+  return nullptr;
+}
+
+bool
+IMoviePlayer::Probe(const char *filename, ProbeInfo *info)
+{
+  // AMediaExtractor 版は未対応 (プレイヤーを生成して GetVideoFormat 等で取得すること)
+  LOGE("probe is not supported\n");
+  return false;
+}
+
+bool
+IMoviePlayer::Probe(IMovieReadStream *stream, ProbeInfo *info)
+{
+  LOGE("probe is not supported\n");
+  return false;
+}
@@ -13,6 +13,7 @@ public:
 
   bool Open(const char *filepath);
   bool Open(IMovieReadStream *stream);
+  bool Open(const void *data, size_t size);
 
   bool Open(int fd, off_t offset, off_t length);
   bool Open(AAssetManager *mgr, const char *filepath);
@@ -40,6 +41,11 @@ public:
   // audio info
   virtual bool IsAudioAvailable() const override;
   virtual void GetAudioFormat(AudioFormat *format) const override;
+  virtual int32_t GetAudioTrackCount() const override;
+  virtual bool GetAudioTrackInfo(int32_t index, AudioTrackInfo *info) const override;
+  virtual int32_t GetAudioTrack() const override;
+  virtual bool SelectAudioTrack(int32_t index) override;
+  virtual bool SetAudioEnabled(bool enabled) override;
 
   // audio volume
   virtual void SetVolume(float volume) override;
@@ -49,6 +55,8 @@ public:
   virtual int64_t Position() const override;
   virtual bool IsPlaying() const override;
   virtual bool Loop() const override;
+  virtual bool IsSeekable() const override;
+  virtual void GetIOStats(IOStats *stats) const override;
 
   virtual void SetOnVideoDecoded(OnVideoDecoded func) override;
   virtual void SetOnVideoDecodedPlanes(OnVideoDecodedPlanes func) override;
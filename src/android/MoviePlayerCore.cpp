@@ -13,6 +13,9 @@
 
 #include <unistd.h>
 
+#include <algorithm>
+#include <cstring>
+
 #include "media/NdkMediaCrypto.h"
 #include "media/NdkMediaCodec.h"
 #include "media/NdkMediaError.h"
@@ -114,6 +117,23 @@ MoviePlayerCore::Open(IMovieReadStream *stream)
   return false;
 }
 
+bool
+MoviePlayerCore::Open(const void *data, size_t size)
+{
+  if (data && size > 0) {
+    AMediaExtractor *vEx = CreateExtractor(data, size);
+    AMediaExtractor *aEx = CreateExtractor(data, size);
+    bool isVideoFound    = vEx && SetupVideoTrackPlayer(vEx);
+    bool isAudioFound    = aEx && SetupAudioTrackPlayer(aEx);
+    if (isVideoFound || isAudioFound) {
+      PropagateSyncMode();
+      Start();
+      return true;
+    }
+  }
+  return false;
+}
+
 bool
 MoviePlayerCore::Open(int fd, off_t offset, off_t length)
 {
@@ -164,9 +184,11 @@ MoviePlayerCore::CreateExtractor(const char *filepath)
 //   extractor が同一ストリームを共有すると並行 Seek+Read でレースする。
 //   lock は MoviePlayerCore が所有し 2 つの data source で共有することで、
 //   各 readAt の Seek+Read を atomic にする。
+//   stream が IMovieReadStream2 (ReadAt 対応) ならロック無しで直接読む。
 struct StreamReadCtx {
-  IMovieReadStream* stream;
-  std::mutex*       lock;
+  IMovieReadStream*  stream;
+  IMovieReadStream2* stream2;
+  std::mutex*        lock;
 };
 
 static AMediaDataSource* CreateDataSource(IMovieReadStream* stream, std::mutex* lock) {
@@ -179,10 +201,14 @@ static AMediaDataSource* CreateDataSource(IMovieReadStream* stream, std::mutex*
     return nullptr;
   }
   stream->AddRef(); // Ensure the stream is kept alive while used by AMediaDataSource
-  StreamReadCtx* ctx = new StreamReadCtx{ stream, lock };
+  StreamReadCtx* ctx = new StreamReadCtx{ stream, dynamic_cast<IMovieReadStream2*>(stream), lock };
   AMediaDataSource_setUserdata(dataSource, (void*)ctx);
   AMediaDataSource_setReadAt(dataSource, [](void* userdata, off64_t offset, void* buffer, size_t size) -> ssize_t {
     StreamReadCtx* ctx = static_cast<StreamReadCtx*>(userdata);
+    if (ctx && ctx->stream2) {
+      size_t bytesRead = ctx->stream2->ReadAt(offset, buffer, size);
+      return bytesRead > 0 ? (ssize_t)bytesRead : -1;
+    }
     if (ctx && ctx->stream) {
       // Seek+Read を atomic に (共有ストリームのレース防止)
       std::lock_guard<std::mutex> lk(*ctx->lock);
@@ -201,6 +227,9 @@ static AMediaDataSource* CreateDataSource(IMovieReadStream* stream, std::mutex*
   });
   AMediaDataSource_setGetSize(dataSource, [](void* userdata) -> ssize_t {
     StreamReadCtx* ctx = static_cast<StreamReadCtx*>(userdata);
+    if (ctx && ctx->stream2) {
+      return (ssize_t)ctx->stream2->Size();
+    }
     if (ctx && ctx->stream) {
       std::lock_guard<std::mutex> lk(*ctx->lock);
       return (ssize_t)ctx->stream->Size();
@@ -231,6 +260,60 @@ MoviePlayerCore::CreateExtractor(IMovieReadStream *stream)
   return nullptr;
 }
 
+// メモリ上のデータを読む custom data source 用コンテキスト。
+//   読み込みは memcpy だけで位置も持たないので、2 つの extractor で共有してもロック不要。
+//   (AMediaExtractor は readAt の先にコピーするので、Windows 版のような
+//   フレームデータの直接参照はできない)
+struct MemoryReadCtx {
+  const uint8_t* data;
+  size_t         size;
+};
+
+static AMediaDataSource* CreateDataSource(const void* data, size_t size) {
+  AMediaDataSource* dataSource = AMediaDataSource_new();
+  if (!dataSource) {
+    LOGE("Failed to create AMediaDataSource");
+    return nullptr;
+  }
+  MemoryReadCtx* ctx = new MemoryReadCtx{ static_cast<const uint8_t*>(data), size };
+  AMediaDataSource_setUserdata(dataSource, (void*)ctx);
+  AMediaDataSource_setReadAt(dataSource, [](void* userdata, off64_t offset, void* buffer, size_t size) -> ssize_t {
+    MemoryReadCtx* ctx = static_cast<MemoryReadCtx*>(userdata);
+    if (ctx && offset >= 0 && (uint64_t)offset < ctx->size) {
+      size_t bytesRead = std::min(size, ctx->size - (size_t)offset);
+      memcpy(buffer, ctx->data + offset, bytesRead);
+      return (ssize_t)bytesRead;
+    }
+    return -1;
+  });
+  AMediaDataSource_setClose(dataSource, [](void* userdata) {
+    delete static_cast<MemoryReadCtx*>(userdata);
+  });
+  AMediaDataSource_setGetSize(dataSource, [](void* userdata) -> ssize_t {
+    MemoryReadCtx* ctx = static_cast<MemoryReadCtx*>(userdata);
+    return ctx ? (ssize_t)ctx->size : 0;
+  });
+  return dataSource;
+}
+
+AMediaExtractor *
+MoviePlayerCore::CreateExtractor(const void *data, size_t size)
+{
+  AMediaExtractor *ex = AMediaExtractor_new();
+  AMediaDataSource *dataSource = CreateDataSource(data, size);
+  media_status_t err  = AMediaExtractor_setDataSourceCustom(ex, dataSource);
+  if (err != AMEDIA_OK) {
+    LOGE("setDataSource error: %d", err);
+    AMediaExtractor_delete(ex);
+#if __ANDROID_API__ >= 29
+    AMediaDataSource_close(dataSource); // 失敗時にデータソースを開放
+#endif
+    AMediaDataSource_delete(dataSource); // メモリ解放
+    return nullptr;
+  }
+  return ex;
+}
+
 AMediaExtractor *
 MoviePlayerCore::CreateExtractor(int fd, off_t offset, off_t length)
 {
@@ -20,6 +20,7 @@ public:
   bool Open(const char *filepath);
   bool Open(int fd, off_t offset, off_t length);
   bool Open(IMovieReadStream *stream);
+  bool Open(const void *data, size_t size);
 
   void Start();
 
@@ -70,6 +71,7 @@ private:
   AMediaExtractor *CreateExtractor(const char *filepath);
   AMediaExtractor *CreateExtractor(int fd, off_t offset, off_t length);
   AMediaExtractor *CreateExtractor(IMovieReadStream *stream);
+  AMediaExtractor *CreateExtractor(const void *data, size_t size);
 
   bool SetupVideoTrackPlayer(AMediaExtractor *ex);
   bool SetupAudioTrackPlayer(AMediaExtractor *ex);
@@ -97,6 +99,7 @@ private:
   // IMovieReadStream を共有する custom data source 経路で、video/audio の
   // 2 つの extractor が同一ストリームへ並行に Seek+Read してレースするのを
   // 防ぐためのロック (2 つの data source で共有する)。
+  // IMovieReadStream2 (ReadAt 対応) の stream では使わない。
   std::mutex mStreamLock;
 
   bool mIsLoop;
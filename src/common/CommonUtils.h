@@ -390,6 +390,16 @@ public:
     mQueue.push(t);
   }
 
+  // 複数の要素を 1 回のロックで追加する
+  void EnqueueAll(const T *items, size_t count)
+  {
+    std::lock_guard<std::recursive_mutex> lock(mMutex);
+
+    for (size_t i = 0; i < count; i++) {
+      mQueue.push(items[i]);
+    }
+  }
+
   bool Dequeue(T &result)
   {
     std::lock_guard<std::recursive_mutex> lock(mMutex);
@@ -404,6 +414,19 @@ public:
     return true;
   }
 
+  // 最大 maxCount 個を 1 回のロックで取り出す。戻り値は取り出した数
+  size_t DequeueAll(T *results, size_t maxCount)
+  {
+    std::lock_guard<std::recursive_mutex> lock(mMutex);
+
+    size_t count = 0;
+    while (count < maxCount && !mQueue.empty()) {
+      results[count++] = mQueue.front();
+      mQueue.pop();
+    }
+    return count;
+  }
+
   size_t Size() const
   {
     std::lock_guard<std::recursive_mutex> lock(mMutex);
@@ -71,7 +71,7 @@ MediaClock::SetPresentationTime(int64_t ptsUs)
 {
   std::lock_guard<std::mutex> lock(mLock);
 
-  if (ptsUs >= mDurationUs) {
+  if (mDurationUs >= 0 && ptsUs >= mDurationUs) {
     // LOGV("presentation time exceeds the duration: %" PRId64 " / %" PRId64 "\n", ptsUs,
     // mDurationUs);
     ptsUs = mDurationUs;
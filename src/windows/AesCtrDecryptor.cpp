@@ -0,0 +1,391 @@
+#define MYLOG_TAG "AesCtrDecryptor"
+#include "BasicLog.h"
+#include "AesCtrDecryptor.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define AESCTR_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <emmintrin.h>
+#include <wmmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define AESCTR_TARGET __attribute__((target("aes,sse2")))
+#else
+#define AESCTR_TARGET
+#endif
+#elif defined(_M_ARM64) || \
+  (defined(__aarch64__) && (defined(__ARM_FEATURE_CRYPTO) || defined(__ARM_FEATURE_AES)))
+// ARM はコンパイル時に Crypto Extension が有効な場合のみ (それ以外は C 実装)
+#define AESCTR_ARM 1
+#if defined(_MSC_VER)
+#include <arm64_neon.h>
+#else
+#include <arm_neon.h>
+#endif
+#endif
+
+namespace {
+
+const uint8_t SBOX[256] = {
+  0x63, 0x7c, 0x77, 0x7b, 0xf2, 0x6b, 0x6f, 0xc5, 0x30, 0x01, 0x67, 0x2b, 0xfe, 0xd7, 0xab, 0x76,
+  0xca, 0x82, 0xc9, 0x7d, 0xfa, 0x59, 0x47, 0xf0, 0xad, 0xd4, 0xa2, 0xaf, 0x9c, 0xa4, 0x72, 0xc0,
+  0xb7, 0xfd, 0x93, 0x26, 0x36, 0x3f, 0xf7, 0xcc, 0x34, 0xa5, 0xe5, 0xf1, 0x71, 0xd8, 0x31, 0x15,
+  0x04, 0xc7, 0x23, 0xc3, 0x18, 0x96, 0x05, 0x9a, 0x07, 0x12, 0x80, 0xe2, 0xeb, 0x27, 0xb2, 0x75,
+  0x09, 0x83, 0x2c, 0x1a, 0x1b, 0x6e, 0x5a, 0xa0, 0x52, 0x3b, 0xd6, 0xb3, 0x29, 0xe3, 0x2f, 0x84,
+  0x53, 0xd1, 0x00, 0xed, 0x20, 0xfc, 0xb1, 0x5b, 0x6a, 0xcb, 0xbe, 0x39, 0x4a, 0x4c, 0x58, 0xcf,
+  0xd0, 0xef, 0xaa, 0xfb, 0x43, 0x4d, 0x33, 0x85, 0x45, 0xf9, 0x02, 0x7f, 0x50, 0x3c, 0x9f, 0xa8,
+  0x51, 0xa3, 0x40, 0x8f, 0x92, 0x9d, 0x38, 0xf5, 0xbc, 0xb6, 0xda, 0x21, 0x10, 0xff, 0xf3, 0xd2,
+  0xcd, 0x0c, 0x13, 0xec, 0x5f, 0x97, 0x44, 0x17, 0xc4, 0xa7, 0x7e, 0x3d, 0x64, 0x5d, 0x19, 0x73,
+  0x60, 0x81, 0x4f, 0xdc, 0x22, 0x2a, 0x90, 0x88, 0x46, 0xee, 0xb8, 0x14, 0xde, 0x5e, 0x0b, 0xdb,
+  0xe0, 0x32, 0x3a, 0x0a, 0x49, 0x06, 0x24, 0x5c, 0xc2, 0xd3, 0xac, 0x62, 0x91, 0x95, 0xe4, 0x79,
+  0xe7, 0xc8, 0x37, 0x6d, 0x8d, 0xd5, 0x4e, 0xa9, 0x6c, 0x56, 0xf4, 0xea, 0x65, 0x7a, 0xae, 0x08,
+  0xba, 0x78, 0x25, 0x2e, 0x1c, 0xa6, 0xb4, 0xc6, 0xe8, 0xdd, 0x74, 0x1f, 0x4b, 0xbd, 0x8b, 0x8a,
+  0x70, 0x3e, 0xb5, 0x66, 0x48, 0x03, 0xf6, 0x0e, 0x61, 0x35, 0x57, 0xb9, 0x86, 0xc1, 0x1d, 0x9e,
+  0xe1, 0xf8, 0x98, 0x11, 0x69, 0xd9, 0x8e, 0x94, 0x9b, 0x1e, 0x87, 0xe9, 0xce, 0x55, 0x28, 0xdf,
+  0x8c, 0xa1, 0x89, 0x0d, 0xbf, 0xe6, 0x42, 0x68, 0x41, 0x99, 0x2d, 0x0f, 0xb0, 0x54, 0xbb, 0x16,
+};
+
+const uint8_t RCON[10] = { 0x01, 0x02, 0x04, 0x08, 0x10, 0x20, 0x40, 0x80, 0x1b, 0x36 };
+
+inline uint8_t
+xtime(uint8_t x)
+{
+  return (uint8_t)((x << 1) ^ ((x >> 7) * 0x1b));
+}
+
+inline uint32_t
+load_be32(const uint8_t *p)
+{
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+inline void
+store_be32(uint8_t *p, uint32_t v)
+{
+  p[0] = (uint8_t)(v >> 24);
+  p[1] = (uint8_t)(v >> 16);
+  p[2] = (uint8_t)(v >> 8);
+  p[3] = (uint8_t)v;
+}
+
+} // namespace
+
+AesCtrDecryptor::AesCtrDecryptor()
+: mIsHardware(false)
+, mBlockIndex(0)
+, mKeyStreamUsed(BLOCK_SIZE)
+{
+  memset(mRoundKeys, 0, sizeof(mRoundKeys));
+  memset(mIv, 0, sizeof(mIv));
+  memset(mKeyStream, 0, sizeof(mKeyStream));
+}
+
+bool
+AesCtrDecryptor::IsHardwareSupported()
+{
+#if defined(AESCTR_X86)
+  // CPUID.1:ECX.AES[bit 25], EDX.SSE2[bit 26]
+  static const bool supported = [] {
+#if defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    unsigned int ecx = (unsigned int)info[2], edx = (unsigned int)info[3];
+#else
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+      return false;
+    }
+#endif
+    return (ecx & (1u << 25)) != 0 && (edx & (1u << 26)) != 0;
+  }();
+  return supported;
+#elif defined(AESCTR_ARM)
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool
+AesCtrDecryptor::SetKey(const uint8_t *key, size_t keyLength, bool useHardware)
+{
+  if (key == nullptr || keyLength != KEY_SIZE) {
+    LOGE("unsupported key length: %zu\n", keyLength);
+    return false;
+  }
+
+  // AES-128 の鍵拡張 (ハードウェア版も同じ並びのラウンド鍵を使う)
+  memcpy(mRoundKeys, key, KEY_SIZE);
+  for (size_t i = KEY_SIZE; i < sizeof(mRoundKeys); i += 4) {
+    uint8_t t[4];
+    memcpy(t, mRoundKeys + i - 4, 4);
+    if (i % KEY_SIZE == 0) {
+      uint8_t t0 = t[0];
+      t[0]       = SBOX[t[1]] ^ RCON[i / KEY_SIZE - 1];
+      t[1]       = SBOX[t[2]];
+      t[2]       = SBOX[t[3]];
+      t[3]       = SBOX[t0];
+    }
+    for (int j = 0; j < 4; j++) {
+      mRoundKeys[i + j] = mRoundKeys[i - KEY_SIZE + j] ^ t[j];
+    }
+  }
+  mIsHardware = useHardware && IsHardwareSupported();
+  return true;
+}
+
+void
+AesCtrDecryptor::Start(const uint8_t *iv, size_t ivLength)
+{
+  memset(mIv, 0, sizeof(mIv));
+  if (iv) {
+    memcpy(mIv, iv, std::min(ivLength, IV_SIZE));
+  }
+  mBlockIndex    = 0;
+  mKeyStreamUsed = BLOCK_SIZE;
+}
+
+void
+AesCtrDecryptor::Apply(uint8_t *data, size_t size)
+{
+  // 前回の端数ブロックの残り
+  while (size > 0 && mKeyStreamUsed < BLOCK_SIZE) {
+    *data++ ^= mKeyStream[mKeyStreamUsed++];
+    size--;
+  }
+
+  size_t blocks = size / BLOCK_SIZE;
+  if (blocks > 0) {
+    XorKeyStream(data, blocks);
+    data += blocks * BLOCK_SIZE;
+    size -= blocks * BLOCK_SIZE;
+  }
+
+  if (size > 0) {
+    memset(mKeyStream, 0, sizeof(mKeyStream));
+    XorKeyStream(mKeyStream, 1);
+    for (size_t i = 0; i < size; i++) {
+      data[i] ^= mKeyStream[i];
+    }
+    mKeyStreamUsed = size;
+  }
+}
+
+void
+AesCtrDecryptor::XorKeyStream(uint8_t *data, size_t blocks)
+{
+  if (mIsHardware) {
+    XorKeyStreamHard(data, blocks);
+  } else {
+    XorKeyStreamSoft(data, blocks);
+  }
+}
+
+void
+AesCtrDecryptor::XorKeyStreamSoft(uint8_t *data, size_t blocks)
+{
+  alignas(16) uint8_t counters[BATCH_BLOCKS * BLOCK_SIZE];
+  alignas(16) uint8_t stream[BATCH_BLOCKS * BLOCK_SIZE];
+  while (blocks > 0) {
+    size_t count = std::min(blocks, BATCH_BLOCKS);
+    for (size_t i = 0; i < count; i++) {
+      uint8_t *counter = counters + i * BLOCK_SIZE;
+      memcpy(counter, mIv, IV_SIZE);
+      store_be32(counter + 8, (uint32_t)(mBlockIndex >> 32));
+      store_be32(counter + 12, (uint32_t)mBlockIndex);
+      mBlockIndex++;
+    }
+    EncryptBlocksSoft(counters, stream, count);
+
+    size_t length = count * BLOCK_SIZE;
+    for (size_t i = 0; i < length; i++) {
+      data[i] ^= stream[i];
+    }
+    data += length;
+    blocks -= count;
+  }
+}
+
+void
+AesCtrDecryptor::EncryptBlocksSoft(const uint8_t *in, uint8_t *out, size_t blocks) const
+{
+  // SubBytes + MixColumns を 1 つの表引きにまとめた T テーブル実装。
+  // TE[1..3] は TE[0] を 8bit ずつ回したもの
+  static const struct Tables
+  {
+    uint32_t te[4][256];
+    Tables()
+    {
+      for (int x = 0; x < 256; x++) {
+        uint8_t s  = SBOX[x];
+        uint8_t s2 = xtime(s);
+        uint32_t t = ((uint32_t)s2 << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) | (s2 ^ s);
+        for (int i = 0; i < 4; i++) {
+          te[i][x] = t;
+          t        = (t >> 8) | (t << 24);
+        }
+      }
+    }
+  } tables;
+  const uint32_t(*te)[256] = tables.te;
+
+  uint32_t rk[(ROUNDS + 1) * 4];
+  for (size_t i = 0; i < (ROUNDS + 1) * 4; i++) {
+    rk[i] = load_be32(mRoundKeys + i * 4);
+  }
+
+  for (size_t n = 0; n < blocks; n++, in += BLOCK_SIZE, out += BLOCK_SIZE) {
+    uint32_t s0 = load_be32(in + 0) ^ rk[0];
+    uint32_t s1 = load_be32(in + 4) ^ rk[1];
+    uint32_t s2 = load_be32(in + 8) ^ rk[2];
+    uint32_t s3 = load_be32(in + 12) ^ rk[3];
+    for (int round = 1; round < ROUNDS; round++) {
+      const uint32_t *k = rk + round * 4;
+      uint32_t t0 = te[0][s0 >> 24] ^ te[1][(s1 >> 16) & 0xff] ^ te[2][(s2 >> 8) & 0xff] ^
+                    te[3][s3 & 0xff] ^ k[0];
+      uint32_t t1 = te[0][s1 >> 24] ^ te[1][(s2 >> 16) & 0xff] ^ te[2][(s3 >> 8) & 0xff] ^
+                    te[3][s0 & 0xff] ^ k[1];
+      uint32_t t2 = te[0][s2 >> 24] ^ te[1][(s3 >> 16) & 0xff] ^ te[2][(s0 >> 8) & 0xff] ^
+                    te[3][s1 & 0xff] ^ k[2];
+      uint32_t t3 = te[0][s3 >> 24] ^ te[1][(s0 >> 16) & 0xff] ^ te[2][(s1 >> 8) & 0xff] ^
+                    te[3][s2 & 0xff] ^ k[3];
+      s0 = t0;
+      s1 = t1;
+      s2 = t2;
+      s3 = t3;
+    }
+
+    // 最終ラウンドは MixColumns 無し
+    const uint32_t *k = rk + ROUNDS * 4;
+    uint32_t s[4]     = { s0, s1, s2, s3 };
+    for (int col = 0; col < 4; col++) {
+      uint32_t t = ((uint32_t)SBOX[s[col] >> 24] << 24) |
+                   ((uint32_t)SBOX[(s[(col + 1) & 3] >> 16) & 0xff] << 16) |
+                   ((uint32_t)SBOX[(s[(col + 2) & 3] >> 8) & 0xff] << 8) |
+                   (uint32_t)SBOX[s[(col + 3) & 3] & 0xff];
+      store_be32(out + col * 4, t ^ k[col]);
+    }
+  }
+}
+
+#if defined(AESCTR_X86)
+
+// カウンタブロックはレジスタ上で作り、鍵ストリームはそのまま data に XOR する。
+// 命令のレイテンシを隠すため 4 ブロックずつ並べて処理する
+AESCTR_TARGET void
+AesCtrDecryptor::XorKeyStreamHard(uint8_t *data, size_t blocks)
+{
+  __m128i k[ROUNDS + 1];
+  for (int i = 0; i <= ROUNDS; i++) {
+    k[i] = _mm_load_si128((const __m128i *)(mRoundKeys + i * BLOCK_SIZE));
+  }
+  int64_t iv;
+  memcpy(&iv, mIv, IV_SIZE);
+  // 下位 8 byte が IV、上位 8 byte がブロック番号 (BE)
+  auto counter = [iv](uint64_t index) {
+    uint8_t be[8];
+    store_be32(be, (uint32_t)(index >> 32));
+    store_be32(be + 4, (uint32_t)index);
+    int64_t high;
+    memcpy(&high, be, sizeof(high));
+    return _mm_set_epi64x(high, iv);
+  };
+
+  __m128i *p = (__m128i *)data;
+  for (; blocks >= 4; blocks -= 4, p += 4) {
+    __m128i b0 = _mm_xor_si128(counter(mBlockIndex + 0), k[0]);
+    __m128i b1 = _mm_xor_si128(counter(mBlockIndex + 1), k[0]);
+    __m128i b2 = _mm_xor_si128(counter(mBlockIndex + 2), k[0]);
+    __m128i b3 = _mm_xor_si128(counter(mBlockIndex + 3), k[0]);
+    mBlockIndex += 4;
+    for (int i = 1; i < ROUNDS; i++) {
+      b0 = _mm_aesenc_si128(b0, k[i]);
+      b1 = _mm_aesenc_si128(b1, k[i]);
+      b2 = _mm_aesenc_si128(b2, k[i]);
+      b3 = _mm_aesenc_si128(b3, k[i]);
+    }
+    b0 = _mm_aesenclast_si128(b0, k[ROUNDS]);
+    b1 = _mm_aesenclast_si128(b1, k[ROUNDS]);
+    b2 = _mm_aesenclast_si128(b2, k[ROUNDS]);
+    b3 = _mm_aesenclast_si128(b3, k[ROUNDS]);
+    _mm_storeu_si128(p + 0, _mm_xor_si128(_mm_loadu_si128(p + 0), b0));
+    _mm_storeu_si128(p + 1, _mm_xor_si128(_mm_loadu_si128(p + 1), b1));
+    _mm_storeu_si128(p + 2, _mm_xor_si128(_mm_loadu_si128(p + 2), b2));
+    _mm_storeu_si128(p + 3, _mm_xor_si128(_mm_loadu_si128(p + 3), b3));
+  }
+  for (; blocks > 0; blocks--, p++) {
+    __m128i b = _mm_xor_si128(counter(mBlockIndex++), k[0]);
+    for (int i = 1; i < ROUNDS; i++) {
+      b = _mm_aesenc_si128(b, k[i]);
+    }
+    b = _mm_aesenclast_si128(b, k[ROUNDS]);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), b));
+  }
+}
+
+#elif defined(AESCTR_ARM)
+
+// AESE は AddRoundKey を先に行うので、最後のラウンド鍵だけ別に XOR する
+void
+AesCtrDecryptor::XorKeyStreamHard(uint8_t *data, size_t blocks)
+{
+  uint8x16_t k[ROUNDS + 1];
+  for (int i = 0; i <= ROUNDS; i++) {
+    k[i] = vld1q_u8(mRoundKeys + i * BLOCK_SIZE);
+  }
+  uint8x8_t iv = vld1_u8(mIv);
+  auto counter = [iv](uint64_t index) {
+    uint8_t be[8];
+    store_be32(be, (uint32_t)(index >> 32));
+    store_be32(be + 4, (uint32_t)index);
+    return vcombine_u8(iv, vld1_u8(be));
+  };
+  auto encrypt = [&k](uint8x16_t b) {
+    for (int i = 0; i < ROUNDS - 1; i++) {
+      b = vaesmcq_u8(vaeseq_u8(b, k[i]));
+    }
+    return veorq_u8(vaeseq_u8(b, k[ROUNDS - 1]), k[ROUNDS]);
+  };
+
+  for (; blocks >= 4; blocks -= 4, data += 4 * BLOCK_SIZE) {
+    uint8x16_t b0 = counter(mBlockIndex + 0);
+    uint8x16_t b1 = counter(mBlockIndex + 1);
+    uint8x16_t b2 = counter(mBlockIndex + 2);
+    uint8x16_t b3 = counter(mBlockIndex + 3);
+    mBlockIndex += 4;
+    for (int i = 0; i < ROUNDS - 1; i++) {
+      b0 = vaesmcq_u8(vaeseq_u8(b0, k[i]));
+      b1 = vaesmcq_u8(vaeseq_u8(b1, k[i]));
+      b2 = vaesmcq_u8(vaeseq_u8(b2, k[i]));
+      b3 = vaesmcq_u8(vaeseq_u8(b3, k[i]));
+    }
+    b0 = veorq_u8(vaeseq_u8(b0, k[ROUNDS - 1]), k[ROUNDS]);
+    b1 = veorq_u8(vaeseq_u8(b1, k[ROUNDS - 1]), k[ROUNDS]);
+    b2 = veorq_u8(vaeseq_u8(b2, k[ROUNDS - 1]), k[ROUNDS]);
+    b3 = veorq_u8(vaeseq_u8(b3, k[ROUNDS - 1]), k[ROUNDS]);
+    vst1q_u8(data + 0 * BLOCK_SIZE, veorq_u8(vld1q_u8(data + 0 * BLOCK_SIZE), b0));
+    vst1q_u8(data + 1 * BLOCK_SIZE, veorq_u8(vld1q_u8(data + 1 * BLOCK_SIZE), b1));
+    vst1q_u8(data + 2 * BLOCK_SIZE, veorq_u8(vld1q_u8(data + 2 * BLOCK_SIZE), b2));
+    vst1q_u8(data + 3 * BLOCK_SIZE, veorq_u8(vld1q_u8(data + 3 * BLOCK_SIZE), b3));
+  }
+  for (; blocks > 0; blocks--, data += BLOCK_SIZE) {
+    uint8x16_t b = encrypt(counter(mBlockIndex++));
+    vst1q_u8(data, veorq_u8(vld1q_u8(data), b));
+  }
+}
+
+#else
+
+void
+AesCtrDecryptor::XorKeyStreamHard(uint8_t *data, size_t blocks)
+{
+  XorKeyStreamSoft(data, blocks);
+}
+
+#endif
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// WebM の暗号化ブロック (ContentEncryption / AES-CTR) の復号用。
+// 鍵は AES-128 のみ。カウンタブロックは IV(8 byte) + ブロック番号(8 byte, BE) で、
+// Start で IV を設定し、Apply を続けて呼ぶと鍵ストリームが続きから使われる
+// (パーティション分割されたブロックの暗号化部分を順に渡す)。
+// AES-NI (x86/x64) / ARMv8 Crypto Extension が使えればそちらで処理する。
+class AesCtrDecryptor
+{
+public:
+  static constexpr size_t KEY_SIZE   = 16;
+  static constexpr size_t IV_SIZE    = 8;
+  static constexpr size_t BLOCK_SIZE = 16;
+
+  AesCtrDecryptor();
+
+  // useHardware = false で常に C 実装を使う (比較用)
+  bool SetKey(const uint8_t *key, size_t keyLength, bool useHardware = true);
+  bool IsHardware() const { return mIsHardware; }
+
+  void Start(const uint8_t *iv, size_t ivLength);
+  // data をその場で復号する (暗号化も同じ処理)
+  void Apply(uint8_t *data, size_t size);
+
+  // CPU が AES 命令を持っているか
+  static bool IsHardwareSupported();
+
+private:
+  static constexpr int ROUNDS = 10;
+
+  // C 実装で一度に鍵ストリームを作るブロック数
+  static constexpr size_t BATCH_BLOCKS = 64;
+
+  // data に mBlockIndex からの blocks 個分の鍵ストリームを XOR し、mBlockIndex を進める
+  void XorKeyStream(uint8_t *data, size_t blocks);
+  void XorKeyStreamSoft(uint8_t *data, size_t blocks);
+  void XorKeyStreamHard(uint8_t *data, size_t blocks);
+  // in の blocks 個のブロックを暗号化して out へ
+  void EncryptBlocksSoft(const uint8_t *in, uint8_t *out, size_t blocks) const;
+
+  alignas(16) uint8_t mRoundKeys[(ROUNDS + 1) * BLOCK_SIZE];
+  bool mIsHardware;
+
+  // カウンタブロックは mIv + mBlockIndex (BE)
+  uint8_t mIv[IV_SIZE];
+  uint64_t mBlockIndex;
+  // 前回の Apply で使い残した鍵ストリーム
+  uint8_t mKeyStream[BLOCK_SIZE];
+  size_t mKeyStreamUsed;
+};
@@ -176,6 +176,12 @@ public:
     }
   }
 
+  // index はすべて有効なこと (まとめて 1 回のロックで追加する)
+  void EnqueueBufferIndicesForReader(const int32_t *indices, size_t count)
+  {
+    mReadableQueue.EnqueueAll(indices, count);
+  }
+
   void EnqueueBufferIndexForWriter(int32_t index)
   {
     if (CheckIndex(index)) {
@@ -183,6 +189,11 @@ public:
     }
   }
 
+  void EnqueueBufferIndicesForWriter(const int32_t *indices, size_t count)
+  {
+    mWritableQueue.EnqueueAll(indices, count);
+  }
+
   int32_t DequeueIndexForReader()
   {
     int32_t index = -1;
@@ -190,6 +201,12 @@ public:
     return index;
   }
 
+  // 最大 maxCount 個を 1 回のロックで取り出す。戻り値は取り出した数
+  size_t DequeueIndicesForReader(int32_t *indices, size_t maxCount)
+  {
+    return mReadableQueue.DequeueAll(indices, maxCount);
+  }
+
   int32_t DequeueIndexForWriter()
   {
     int32_t index = -1;
@@ -197,8 +214,14 @@ public:
     return index;
   }
 
+  size_t DequeueIndicesForWriter(int32_t *indices, size_t maxCount)
+  {
+    return mWritableQueue.DequeueAll(indices, maxCount);
+  }
+
   size_t SizeForReader() const { return mReadableQueue.Size(); }
   size_t SizeForWriter() const { return mWritableQueue.Size(); }
+  size_t PoolSize() const { return mBuffers.size(); }
 
   T *GetBuffer(int32_t index)
   {
@@ -7,6 +7,48 @@
 #include "VorbisDecoder.h"
 #include "OpusDecoder.h"
 
+#include <cmath>
+#include <cstdio>
+
+#if defined(_WIN32)
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#endif
+
+// システム全体のメモリ使用率 [%]。取得できない環境では -1
+static int32_t
+get_memory_load()
+{
+#if defined(_WIN32)
+  MEMORYSTATUSEX status;
+  status.dwLength = sizeof(status);
+  if (!GlobalMemoryStatusEx(&status)) {
+    return -1;
+  }
+  return (int32_t)status.dwMemoryLoad;
+#elif defined(__linux__)
+  FILE *fp = fopen("/proc/meminfo", "r");
+  if (fp == nullptr) {
+    return -1;
+  }
+  char line[128];
+  unsigned long long totalKb = 0, availKb = 0;
+  while (fgets(line, sizeof(line), fp)) {
+    sscanf(line, "MemTotal: %llu kB", &totalKb);
+    sscanf(line, "MemAvailable: %llu kB", &availKb);
+  }
+  fclose(fp);
+  if (totalKb == 0 || availKb == 0) {
+    return -1;
+  }
+  return (int32_t)(100 - availKb * 100 / totalKb);
+#else
+  return -1;
+#endif
+}
+
 // -----------------------------------------------------------------------------
 // Decoder
 // -----------------------------------------------------------------------------
@@ -42,27 +84,80 @@ Decoder::Decoder(CodecId codecId, DecoderType type)
 , mPendingInputs(0)
 , mIsInpuEOS(false)
 {
-  size_t qInSize  = 4;
-  size_t qOutSize = 4;
-  switch (type) {
-  case DECODER_TYPE_VIDEO:
-    qInSize  = 4;
-    qOutSize = 4;
-    break;
-  case DECODER_TYPE_AUDIO:
-    qInSize  = 16;
-    qOutSize = 16;
-    break;
-  default:
-    ASSERT(false, "unknown decoder type: type=%d\n", type);
-    break;
+  mQueueConfig.Init();
+  InitQueues(type);
+}
+
+void
+Decoder::QueueConfig::Init()
+{
+  slots       = 0;
+  outputBytes = 0;
+  adaptive    = false;
+}
+
+void
+Decoder::InitQueues(DecoderType type)
+{
+  size_t slots = mQueueConfig.slots;
+  if (slots == 0) {
+    switch (type) {
+    case DECODER_TYPE_VIDEO:
+      slots = mQueueConfig.adaptive ? ADAPTIVE_MAX_SLOTS : DEFAULT_VIDEO_SLOTS;
+      break;
+    case DECODER_TYPE_AUDIO:
+      slots = DEFAULT_AUDIO_SLOTS;
+      break;
+    default:
+      ASSERT(false, "unknown decoder type: type=%d\n", type);
+      slots = DEFAULT_VIDEO_SLOTS;
+      break;
+    }
+  }
+  if (slots < MIN_OUTPUT_SLOTS) {
+    slots = MIN_OUTPUT_SLOTS;
   }
-  mFramePackets.Init(qInSize);
-  mDecodedBuffers.Init(qOutSize);
+
+  mFramePackets.Init(slots);
+  mDecodedBuffers.Init(slots);
   std::vector<DecodedBuffer> &bufs = mDecodedBuffers.Buffers();
   for (size_t i = 0; i < bufs.size(); i++) {
     bufs[i].InitByType((TrackType)type, i);
   }
+
+  // adaptive は既定値相当を下限とし、デコード時間の揺らぎに応じてプールまで増やす
+  mOutputLimit       = slots;
+  mAdaptiveBaseSlots = (type == DECODER_TYPE_AUDIO) ? DEFAULT_AUDIO_SLOTS : DEFAULT_VIDEO_SLOTS;
+  if (mAdaptiveBaseSlots > slots) {
+    mAdaptiveBaseSlots = slots;
+  }
+  if (mQueueConfig.adaptive) {
+    mOutputLimit = mAdaptiveBaseSlots;
+  }
+  mParkedOutputs.clear();
+  mOutputFrameBytes = 0;
+  mDecodeSamples    = 0;
+  mDecodeMeanNs     = 0;
+  mDecodeVarNs2     = 0;
+  mFrameDurNs       = 0;
+  mLastTimeStampNs  = -1;
+  mMemoryPressure   = false;
+  mLastMemoryCheck  = std::chrono::steady_clock::now();
+  mLastShrink       = mLastMemoryCheck;
+}
+
+bool
+Decoder::ConfigureQueues(const QueueConfig &conf)
+{
+  // スレッド開始前にのみ呼ぶこと (キューを作り直すため)
+  mQueueConfig = conf;
+  mFramePackets.Done();
+  mDecodedBuffers.Done();
+  InitQueues(Type());
+
+  LOGV("ConfigureQueues: type=%d, slots=%zu, outputBytes=%zu, adaptive=%d\n", Type(),
+       mDecodedBuffers.PoolSize(), conf.outputBytes, conf.adaptive);
+  return true;
 }
 
 void
@@ -160,6 +255,115 @@ Decoder::CommonDebugFrameInfo(FramePacket *packet)
        packet->timeStampNs);
 }
 
+// デコード統計を更新し、出力スロット上限を見直す
+void
+Decoder::UpdateDecodeStats(uint64_t decodeNs, uint64_t timeStampNs, size_t frameBytes)
+{
+  if (frameBytes > mOutputFrameBytes) {
+    mOutputFrameBytes = frameBytes;
+  }
+
+  // 指数移動平均 (1/16) で平均と分散を追う
+  if (mDecodeSamples == 0) {
+    mDecodeMeanNs = (double)decodeNs;
+    mDecodeVarNs2 = 0;
+  } else {
+    double diff = (double)decodeNs - mDecodeMeanNs;
+    mDecodeMeanNs += diff / 16;
+    mDecodeVarNs2 = (mDecodeVarNs2 + diff * diff / 16) * 15 / 16;
+  }
+  mDecodeSamples++;
+
+  if (mLastTimeStampNs != (uint64_t)-1 && timeStampNs > mLastTimeStampNs) {
+    double dur = (double)(timeStampNs - mLastTimeStampNs);
+    mFrameDurNs = (mFrameDurNs == 0) ? dur : mFrameDurNs + (dur - mFrameDurNs) / 16;
+  }
+  mLastTimeStampNs = timeStampNs;
+
+  UpdateOutputLimit();
+}
+
+void
+Decoder::UpdateOutputLimit()
+{
+  size_t pool  = mDecodedBuffers.PoolSize();
+  size_t limit = pool;
+
+  if (mQueueConfig.adaptive) {
+    // メモリ逼迫の確認は 1 秒に 1 回
+    auto now = std::chrono::steady_clock::now();
+    if (now - mLastMemoryCheck >= std::chrono::seconds(1)) {
+      mLastMemoryCheck = now;
+      int32_t load     = get_memory_load();
+      mMemoryPressure  = (load >= MEMORY_PRESSURE_PERCENT);
+    }
+
+    limit = mOutputLimit;
+    if (mMemoryPressure) {
+      limit = MIN_OUTPUT_SLOTS;
+    } else if (mDecodeSamples >= ADAPTIVE_MIN_SAMPLES && mFrameDurNs > 0) {
+      // 平均 + 2σ のデコード時間を吸収できるだけ先読みする
+      double worstNs = mDecodeMeanNs + 2 * std::sqrt(mDecodeVarNs2);
+      size_t target  = MIN_OUTPUT_SLOTS + (size_t)std::ceil(worstNs / mFrameDurNs);
+      if (target < mAdaptiveBaseSlots) {
+        target = mAdaptiveBaseSlots;
+      }
+      if (target > limit) {
+        limit = target;
+      } else if (target < limit && now - mLastShrink >= std::chrono::seconds(1)) {
+        // 縮小は 1 秒に 1 スロットずつ (揺らぎのたびに大きなバッファを解放/確保しない)
+        mLastShrink = now;
+        limit--;
+      }
+    }
+  }
+
+  if (mQueueConfig.outputBytes > 0 && mOutputFrameBytes > 0) {
+    size_t byBytes = mQueueConfig.outputBytes / mOutputFrameBytes;
+    if (byBytes < limit) {
+      limit = byBytes;
+    }
+  }
+
+  if (limit < MIN_OUTPUT_SLOTS) {
+    limit = MIN_OUTPUT_SLOTS;
+  }
+  if (limit > pool) {
+    limit = pool;
+  }
+
+  if (limit != mOutputLimit) {
+    LOGV("%s: output limit %zu -> %zu (frame=%zu bytes, decode=%.2f+-%.2f ms, dur=%.2f ms%s)\n",
+         CodecName(), mOutputLimit, limit, mOutputFrameBytes, mDecodeMeanNs / 1e6,
+         std::sqrt(mDecodeVarNs2) / 1e6, mFrameDurNs / 1e6, mMemoryPressure ? ", pressure" : "");
+    mOutputLimit = limit;
+  }
+}
+
+// 上限を超える空き出力スロットはメモリを返して休ませ、上限が上がれば戻す
+void
+Decoder::ApplyOutputLimit()
+{
+  size_t usable = mDecodedBuffers.PoolSize() - mParkedOutputs.size();
+
+  while (usable > mOutputLimit) {
+    // 使用中のスロットは戻ってきた後の呼び出しで休ませる
+    int32_t index = mDecodedBuffers.DequeueIndexForWriter();
+    if (index < 0) {
+      break;
+    }
+    mDecodedBuffers.ReleaseBuffer(index);
+    mParkedOutputs.push_back(index);
+    usable--;
+  }
+
+  while (usable < mOutputLimit && !mParkedOutputs.empty()) {
+    mDecodedBuffers.EnqueueBufferIndexForWriter(mParkedOutputs.back());
+    mParkedOutputs.pop_back();
+    usable++;
+  }
+}
+
 void
 Decoder::Decode()
 {
@@ -168,6 +372,8 @@ Decoder::Decode()
     return;
   }
 
+  ApplyOutputLimit();
+
   // 出力バッファをチェック
   int32_t outputAvailables = mDecodedBuffers.SizeForWriter();
   if (outputAvailables == 0) {
@@ -180,6 +386,14 @@ Decoder::Decode()
   int32_t inputAvailables = mFramePackets.SizeForReader();
   int32_t targetCount     = std::min(outputAvailables, inputAvailables);
   for (int32_t i = 0; i < targetCount; i++) {
+    if (i > 0) {
+      // 直前のフレームで上限が下がっていれば (最初のフレームでサイズが分かった時など)
+      // 空きスロットを休ませ、使ってよいスロットが尽きたら残りは次回に回す
+      ApplyOutputLimit();
+      if (mDecodedBuffers.SizeForWriter() == 0) {
+        break;
+      }
+    }
     int32_t packetIndex = mFramePackets.DequeueIndexForReader();
     if (packetIndex >= 0) {
       // LOGV("*** Decode - deq read buf index = %d\n", packetIndex);
@@ -197,8 +411,14 @@ Decoder::Decode()
           dcBuf->InitAsEOS(dcBufIndex);
           // LOGV("r enq: %d\n", dcBufIndex);
         } else {
+          auto decodeStart   = std::chrono::steady_clock::now();
           bool decodeSuccess = DecodeFrame(dcBuf, packet);
           ASSERT(decodeSuccess, "BUG?: decode failed.\n");
+          if (dcBuf->data && dcBuf->dataSize > 0) {
+            auto decodeNs = std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - decodeStart);
+            UpdateDecodeStats(decodeNs.count(), packet->timeStampNs, dcBuf->capacity);
+          }
           // LOGV("r enq: %d\n", dcBufIndex);
         }
 
@@ -210,6 +430,8 @@ Decoder::Decode()
           // デコード結果がない場合はデコードバッファを即時開放(Vorbisでこのケースが発生する)
           mDecodedBuffers.EnqueueBufferIndexForWriter(dcBufIndex);
         }
+        // 参照していた nestegg_packet 等はここで手放す
+        packet->ReturnBorrowed();
         mFramePackets.EnqueueBufferIndexForWriter(packetIndex);
         // LOGV("*** Decode - enq write buf index = %d\n", packetIndex);
       } else {
@@ -241,9 +463,11 @@ Decoder::HandleMessage(int32_t what, int64_t arg, void *obj)
   case MSG_FLUSH:
     mFramePackets.Clear();
     mDecodedBuffers.Clear();
-    mIsInpuEOS     = false;
-    mDecodedFrames = 0;
-    mPendingInputs = 0;
+    mParkedOutputs.clear(); // Clear で休止スロットも空きへ戻っている
+    mLastTimeStampNs = -1;
+    mIsInpuEOS       = false;
+    mDecodedFrames   = 0;
+    mPendingInputs   = 0;
     mEventFlag.Set(EVENT_FLAG_FLUSH);
     break;
 
@@ -265,6 +489,12 @@ Decoder::DequeueFramePacketIndex()
   return mFramePackets.DequeueIndexForWriter();
 }
 
+size_t
+Decoder::DequeueFramePacketIndices(int32_t *bufIndices, size_t maxCount)
+{
+  return mFramePackets.DequeueIndicesForWriter(bufIndices, maxCount);
+}
+
 FramePacket *
 Decoder::GetFramePacket(int32_t bufIndex)
 {
@@ -279,6 +509,18 @@ Decoder::QueueFramePacketIndex(int32_t bufIndex)
   return true;
 }
 
+bool
+Decoder::QueueFramePacketIndices(const int32_t *bufIndices, size_t count)
+{
+  if (count == 0) {
+    return false;
+  }
+  // Decode は入力キューにある分をまとめて消化する
+  mFramePackets.EnqueueBufferIndicesForReader(bufIndices, count);
+  Post(MSG_INPUT_AVAILABLE);
+  return true;
+}
+
 int32_t
 Decoder::DequeueDecodedBufferIndex()
 {
@@ -12,6 +12,8 @@
 #include <mutex>
 #include <queue>
 #include <condition_variable>
+#include <chrono>
+#include <vector>
 
 // -----------------------------------------------------------------------------
 // DecodedBuffer
@@ -229,6 +231,16 @@ public:
     std::vector<std::vector<uint8_t>> privateData;
   };
 
+  // 入出力キューの容量設定。Configure/Start より前に ConfigureQueues で与える
+  struct QueueConfig
+  {
+    void Init();
+
+    size_t slots;       // 入出力それぞれのスロット数 (0: 種別ごとの既定値)
+    size_t outputBytes; // デコード済みバッファの合計バイト数上限 (0: 無制限)
+    bool adaptive;      // デコード時間の揺らぎとメモリ逼迫に応じて出力の先読み数を増減する
+  };
+
 public:
   static Decoder *CreateDecoder(CodecId codecId);
 
@@ -238,6 +250,7 @@ public:
 
   virtual DecoderType Type() const { return DECODER_TYPE_UNKNOWN; }
 
+  bool ConfigureQueues(const QueueConfig &conf);
   virtual bool Configure(const Config &conf) = 0;
   virtual bool Done()                        = 0;
 
@@ -249,8 +262,15 @@ public:
   virtual const char *CodecName() const = 0;
 
   int32_t DequeueFramePacketIndex();
+  // 空いている入力スロットを最大 maxCount 個取り出す。戻り値は取り出した数
+  size_t DequeueFramePacketIndices(int32_t *bufIndices, size_t maxCount);
   FramePacket *GetFramePacket(int32_t bufIndex);
   bool QueueFramePacketIndex(int32_t bufIndex);
+  // 複数のパケットをまとめて入力し、デコーダスレッドの起床を 1 回にする
+  bool QueueFramePacketIndices(const int32_t *bufIndices, size_t count);
+  // 入力キューの長さと、入力済みでデコード待ちのパケット数
+  size_t FramePacketCapacity() const { return mFramePackets.PoolSize(); }
+  size_t QueuedFramePackets() const { return mFramePackets.SizeForReader(); }
 
   int32_t DequeueDecodedBufferIndex();
   DecodedBuffer *GetDecodedBuffer(int32_t bufIndex);
@@ -269,7 +289,11 @@ public:
   void ResetInputEOS() { mIsInpuEOS = false; }
 
 protected:
+  void InitQueues(DecoderType type);
   void Decode();
+  void UpdateDecodeStats(uint64_t decodeNs, uint64_t timeStampNs, size_t frameBytes);
+  void UpdateOutputLimit();
+  void ApplyOutputLimit();
 
   bool CommonDecodeArgCheck(DecodedBuffer *dcBuf, FramePacket *packet);
   void CommonDebugFrameInfo(FramePacket *packet);
@@ -283,6 +307,28 @@ protected:
   BufferQueue<FramePacket> mFramePackets;
   BufferQueue<DecodedBuffer> mDecodedBuffers;
 
+  // 出力キューの容量制御 (デコーダスレッドのみが触る)
+  static constexpr size_t DEFAULT_VIDEO_SLOTS      = 4;
+  static constexpr size_t DEFAULT_AUDIO_SLOTS      = 16;
+  static constexpr size_t ADAPTIVE_MAX_SLOTS       = 8;  // adaptive かつ slots 未指定時のプール
+  static constexpr size_t MIN_OUTPUT_SLOTS         = 2;  // プレイヤーが同時に保持する最大数
+  static constexpr int32_t ADAPTIVE_MIN_SAMPLES    = 16; // これ未満では先読み数を変えない
+  static constexpr int32_t MEMORY_PRESSURE_PERCENT = 90;
+
+  QueueConfig mQueueConfig;
+  size_t mOutputLimit;                 // 使ってよい出力スロット数
+  size_t mAdaptiveBaseSlots;           // adaptive 時の通常の下限
+  std::vector<int32_t> mParkedOutputs; // 上限超過で休ませている出力スロット
+  size_t mOutputFrameBytes;            // 観測した 1 フレームの最大バイト数
+  int32_t mDecodeSamples;
+  double mDecodeMeanNs; // デコード時間の指数移動平均
+  double mDecodeVarNs2; // 同分散
+  double mFrameDurNs;   // タイムスタンプ差分から求めたフレーム間隔
+  uint64_t mLastTimeStampNs;
+  bool mMemoryPressure;
+  std::chrono::steady_clock::time_point mLastMemoryCheck;
+  std::chrono::steady_clock::time_point mLastShrink;
+
   // 同期用イベントフラグ
   enum
   {
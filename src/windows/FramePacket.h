@@ -4,6 +4,9 @@
 #include "Constants.h"
 #include "BufferQueue.h"
 
+#include <memory>
+#include <utility>
+
 struct FramePacket : public BufferQueueEntryBase
 {
   int32_t bufIndex;
@@ -15,6 +18,16 @@ struct FramePacket : public BufferQueueEntryBase
   int32_t flags;
   int64_t arg; // 汎用情報
 
+  // data/adddata が外部メモリの参照になっている間、自前のバッファを退避しておく
+  bool isDataBorrowed;
+  uint8_t *ownData;
+  size_t ownCapacity;
+  bool isAddDataBorrowed;
+  uint8_t *ownAddData;
+  size_t ownAddCapacity;
+  // 参照先のメモリの持ち主 (nestegg_packet 等)。参照をやめるまで解放させない
+  std::shared_ptr<void> dataOwner;
+
   FramePacket()
   : BufferQueueEntryBase()
   , type(TRACK_TYPE_UNKNOWN)
@@ -24,12 +37,25 @@ struct FramePacket : public BufferQueueEntryBase
   , isEndOfStream(false)
   , flags(0)
   , arg(0)
+  , isDataBorrowed(false)
+  , ownData(nullptr)
+  , ownCapacity(0)
+  , isAddDataBorrowed(false)
+  , ownAddData(nullptr)
+  , ownAddCapacity(0)
   {}
-  virtual ~FramePacket() {}
+  virtual ~FramePacket()
+  {
+    // 基底のデストラクタからは基底の Release が呼ばれるので、ここで戻しておく
+    UnborrowData();
+    UnborrowAddData();
+  }
 
   virtual void Clear() override { Init(bufIndex); }
   virtual void Init(int32_t bufIdx)
   {
+    UnborrowData();
+    UnborrowAddData();
     bufIndex      = bufIdx;
     type          = TRACK_TYPE_UNKNOWN;
     trackNum      = -1;
@@ -49,6 +75,122 @@ struct FramePacket : public BufferQueueEntryBase
 
   TrackType Type() const { return type; }
 
+  // data を src の参照にする (コピーしない)。src は packet を使い終わるまで有効なこと。
+  // 参照中に Resize/Release されたら自前のバッファに戻る。
+  // src の寿命が持ち主に依存する場合は SetDataOwner で持ち主を預ける。
+  void BorrowData(const uint8_t *src, size_t size)
+  {
+    if (!isDataBorrowed) {
+      ownData        = data;
+      ownCapacity    = capacity;
+      isDataBorrowed = true;
+    }
+    data     = const_cast<uint8_t *>(src);
+    dataSize = size;
+    capacity = size;
+  }
+  void UnborrowData()
+  {
+    if (isDataBorrowed) {
+      data           = ownData;
+      dataSize       = 0;
+      capacity       = ownCapacity;
+      ownData        = nullptr;
+      ownCapacity    = 0;
+      isDataBorrowed = false;
+      ReleaseDataOwner();
+    }
+  }
+
+  void BorrowAddData(const uint8_t *src, size_t size)
+  {
+    if (!isAddDataBorrowed) {
+      ownAddData        = adddata;
+      ownAddCapacity    = addcapacity;
+      isAddDataBorrowed = true;
+    }
+    adddata     = const_cast<uint8_t *>(src);
+    adddataSize = size;
+    addcapacity = size;
+  }
+  void UnborrowAddData()
+  {
+    if (isAddDataBorrowed) {
+      adddata           = ownAddData;
+      adddataSize       = 0;
+      addcapacity       = ownAddCapacity;
+      ownAddData        = nullptr;
+      ownAddCapacity    = 0;
+      isAddDataBorrowed = false;
+      ReleaseDataOwner();
+    }
+  }
+
+  // data/adddata の両方とも参照をやめた時点で手放す
+  void SetDataOwner(const std::shared_ptr<void> &owner) { dataOwner = owner; }
+  void ReleaseDataOwner()
+  {
+    if (!isDataBorrowed && !isAddDataBorrowed) {
+      dataOwner.reset();
+    }
+  }
+
+  // デコーダがスロットを返すときに呼ぶ。参照していたメモリを持ち主に返す
+  void ReturnBorrowed()
+  {
+    UnborrowData();
+    UnborrowAddData();
+  }
+
+  // bufIndex 以外の中身 (データ・参照先とその持ち主・情報) を other と入れ替える。
+  // キューのスロット間でデータをコピーせずにパケットを受け渡すのに使う
+  void SwapContents(FramePacket *other)
+  {
+    std::swap(data, other->data);
+    std::swap(dataSize, other->dataSize);
+    std::swap(capacity, other->capacity);
+    std::swap(adddata, other->adddata);
+    std::swap(adddataSize, other->adddataSize);
+    std::swap(addcapacity, other->addcapacity);
+
+    std::swap(type, other->type);
+    std::swap(trackNum, other->trackNum);
+    std::swap(timeStampNs, other->timeStampNs);
+    std::swap(isKeyFrame, other->isKeyFrame);
+    std::swap(isEndOfStream, other->isEndOfStream);
+    std::swap(flags, other->flags);
+    std::swap(arg, other->arg);
+
+    std::swap(isDataBorrowed, other->isDataBorrowed);
+    std::swap(ownData, other->ownData);
+    std::swap(ownCapacity, other->ownCapacity);
+    std::swap(isAddDataBorrowed, other->isAddDataBorrowed);
+    std::swap(ownAddData, other->ownAddData);
+    std::swap(ownAddCapacity, other->ownAddCapacity);
+    dataOwner.swap(other->dataOwner);
+  }
+
+  virtual void Resize(size_t newSize) override
+  {
+    UnborrowData();
+    BufferQueueEntryBase::Resize(newSize);
+  }
+  virtual void Release() override
+  {
+    UnborrowData();
+    BufferQueueEntryBase::Release();
+  }
+  virtual void ResizeAdd(size_t newSize) override
+  {
+    UnborrowAddData();
+    BufferQueueEntryBase::ResizeAdd(newSize);
+  }
+  virtual void ReleaseAdd() override
+  {
+    UnborrowAddData();
+    BufferQueueEntryBase::ReleaseAdd();
+  }
+
   void PrintInfo(int32_t blockFrameIndex)
   {
 #if defined(MOVIE_DEBUG)
@@ -0,0 +1,144 @@
+#pragma once
+
+#include "FramePacket.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+// デマックス済みの FramePacket をメモリ上に溜めておくキャッシュ。
+// ループ再生の 2 周目以降をファイル I/O と EBML 解析無しで流すのに使う。
+// データは固定サイズのチャンクに詰めるので、追加してもアドレスは変わらない。
+// 上限はパケットのデータとエントリの管理情報の合計で数える (チャンクの未使用分は除く)。
+// Get で渡したパケットはチャンクを持ち主として預かるので、キャッシュを Clear しても
+// パケットが参照を返すまではデータが有効。
+class FramePacketCache
+{
+public:
+  FramePacketCache(size_t budget)
+  : mBudget(budget)
+  , mUsedSize(0)
+  , mChunkSize(0)
+  , mChunkUsed(0)
+  {}
+
+  void Clear()
+  {
+    mEntries.clear();
+    mChunks.clear();
+    mChunk.reset();
+    mUsedSize  = 0;
+    mChunkSize = 0;
+    mChunkUsed = 0;
+  }
+
+  // 上限を超える場合は何もせず false
+  bool Add(const FramePacket &packet)
+  {
+    size_t size = packet.dataSize + packet.adddataSize;
+    size_t cost = size + sizeof(Entry);
+    if (mUsedSize + cost > mBudget) {
+      return false;
+    }
+    std::shared_ptr<void> owner;
+    uint8_t *dest = Allocate(size, &owner);
+    mUsedSize += cost;
+
+    Entry entry;
+    entry.type        = packet.type;
+    entry.trackNum    = packet.trackNum;
+    entry.timeStampNs = packet.timeStampNs;
+    entry.isKeyFrame  = packet.isKeyFrame;
+    entry.arg         = packet.arg;
+    entry.owner       = owner;
+    entry.data        = dest;
+    entry.dataSize    = packet.dataSize;
+    entry.addData     = dest + packet.dataSize;
+    entry.addDataSize = packet.adddataSize;
+    if (packet.dataSize > 0) {
+      memcpy(entry.data, packet.data, packet.dataSize);
+    }
+    if (packet.adddataSize > 0) {
+      memcpy(entry.addData, packet.adddata, packet.adddataSize);
+    }
+    mEntries.push_back(entry);
+    return true;
+  }
+
+  size_t GetCount() const { return mEntries.size(); }
+  size_t GetUsedSize() const { return mUsedSize; }
+  TrackType GetType(size_t index) const { return mEntries[index].type; }
+
+  // packet のデータはキャッシュの参照になる (コピーしない)
+  void Get(size_t index, FramePacket *packet) const
+  {
+    const Entry &entry = mEntries[index];
+    packet->BorrowData(entry.data, entry.dataSize);
+    if (entry.addDataSize > 0) {
+      packet->BorrowAddData(entry.addData, entry.addDataSize);
+    } else {
+      packet->ReleaseAdd();
+    }
+    packet->SetDataOwner(entry.owner);
+    packet->type        = entry.type;
+    packet->trackNum    = entry.trackNum;
+    packet->timeStampNs = entry.timeStampNs;
+    packet->isKeyFrame  = entry.isKeyFrame;
+    packet->arg         = entry.arg;
+  }
+
+private:
+  FramePacketCache(const FramePacketCache &);
+  FramePacketCache &operator=(const FramePacketCache &);
+
+  static constexpr size_t CHUNK_SIZE = 1024 * 1024;
+
+  // 上限の確認は呼び出し側で済ませておく (size は残りの上限以下)
+  uint8_t *Allocate(size_t size, std::shared_ptr<void> *owner)
+  {
+    if (size == 0) {
+      return nullptr;
+    }
+    // チャンクより大きなパケット (キーフレーム等) は専用に確保し、詰めている
+    // チャンクはそのまま次のパケットに使う
+    if (size >= CHUNK_SIZE) {
+      mChunks.emplace_back(new uint8_t[size], std::default_delete<uint8_t[]>());
+      *owner = mChunks.back();
+      return (uint8_t *)owner->get();
+    }
+    if (!mChunk || mChunkUsed + size > mChunkSize) {
+      // 上限の近くでは残りの分だけ確保する (上限が CHUNK_SIZE より小さくても使える)
+      mChunkSize = std::max(size, std::min(CHUNK_SIZE, mBudget - mUsedSize));
+      mChunk.reset(new uint8_t[mChunkSize], std::default_delete<uint8_t[]>());
+      mChunks.push_back(mChunk);
+      mChunkUsed = 0;
+    }
+    uint8_t *ret = (uint8_t *)mChunk.get() + mChunkUsed;
+    mChunkUsed += size;
+    *owner = mChunk;
+    return ret;
+  }
+
+  struct Entry
+  {
+    TrackType type;
+    int32_t trackNum;
+    uint64_t timeStampNs;
+    bool isKeyFrame;
+    int64_t arg;
+    std::shared_ptr<void> owner; // data/addData のあるチャンク
+    uint8_t *data;
+    size_t dataSize;
+    uint8_t *addData;
+    size_t addDataSize;
+  };
+
+  size_t mBudget;
+  size_t mUsedSize; // パケットのデータ + エントリの管理情報
+  std::vector<Entry> mEntries;
+  std::vector<std::shared_ptr<void>> mChunks;
+  std::shared_ptr<void> mChunk; // 詰めている途中のチャンク
+  size_t mChunkSize;
+  size_t mChunkUsed;
+};
@@ -0,0 +1,319 @@
+#define MYLOG_TAG "MkvClusterReader"
+#include "BasicLog.h"
+#include "MkvFileReader.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// MkvClusterReader
+//   nestegg は Cluster 内の要素ヘッダやブロックを細かい Read で順に読んでいくので、
+//   Cluster 要素のサイズが分かった時点で Cluster 全体を 1 回の ReadAt でバッファに
+//   読み込み、以降の Read はバッファから返す。
+//   Cluster の末尾と一緒に次の要素ヘッダも読んでおくので、Cluster が連続している
+//   間は Cluster 1 つにつき下位 reader への読み込みは 1 回になる。
+//   Cluster 以外 (ヘッダ部分や Cues 等) は PROBE_SIZE 単位のまとめ読みになる。
+// -----------------------------------------------------------------------------
+class MkvClusterReader : public IMkvFileReader
+{
+public:
+  MkvClusterReader();
+  virtual ~MkvClusterReader();
+
+  bool Open(IMkvFileReader *reader, size_t maxClusterSize);
+  void Close();
+
+  virtual int Read(void *buffer, int64_t length);
+  virtual int Seek(int64_t offset, int whence);
+  virtual int64_t Tell() const;
+  virtual int ReadAt(int64_t offset, void *buffer, int64_t length);
+  virtual int64_t Size() const;
+
+  virtual void GetStats(MkvReaderStats *stats) const;
+
+private:
+  MkvClusterReader(const MkvClusterReader &);
+  MkvClusterReader &operator=(const MkvClusterReader &);
+
+  // pos から始まるデータをバッファに読む。clusterSize は pos の Cluster の全体サイズ (不明なら 0)
+  bool Fill(int64_t pos, size_t clusterSize);
+  bool FillRange(int64_t pos, size_t length);
+  // data が Cluster 要素ヘッダなら、要素全体のサイズを返す (それ以外は 0)
+  static size_t ParseClusterHeader(const uint8_t *data, size_t length);
+
+  // Cluster 以外の読み込み単位
+  static const size_t PROBE_SIZE = 64 * 1024;
+  // Cluster と一緒に読んでおく次の要素ヘッダ分 (ID 4 byte + サイズ 8 byte)
+  static const size_t HEADER_PEEK_SIZE = 12;
+
+  IMkvFileReader *mReader;
+  int64_t mSize;
+  int64_t mPos;
+  size_t mMaxClusterSize;
+
+  std::vector<uint8_t> mBuffer;
+  int64_t mBufferPos;
+  size_t mBufferSize;
+
+  // バッファ末尾で見つけた次の Cluster (位置と全体サイズ)
+  int64_t mNextClusterPos;
+  size_t mNextClusterSize;
+
+  // 統計情報
+  uint64_t mClusterReads, mProbeReads;
+};
+
+MkvClusterReader::MkvClusterReader()
+: mReader(nullptr)
+, mSize(-1)
+, mPos(0)
+, mMaxClusterSize(0)
+, mBufferPos(0)
+, mBufferSize(0)
+, mNextClusterPos(-1)
+, mNextClusterSize(0)
+, mClusterReads(0)
+, mProbeReads(0)
+{}
+
+MkvClusterReader::~MkvClusterReader()
+{
+  Close();
+}
+
+bool
+MkvClusterReader::Open(IMkvFileReader *reader, size_t maxClusterSize)
+{
+  if (reader == nullptr || maxClusterSize == 0) {
+    return false;
+  }
+  mReader         = reader;
+  mSize           = reader->Size();
+  mPos            = reader->Tell();
+  mMaxClusterSize = maxClusterSize;
+  return true;
+}
+
+void
+MkvClusterReader::Close()
+{
+  if (mReader) {
+    LOGV("cluster reads=%" PRIu64 " probe reads=%" PRIu64 " buffer=%zu\n", mClusterReads,
+         mProbeReads, mBuffer.size());
+    delete mReader;
+    mReader = nullptr;
+  }
+}
+
+size_t
+MkvClusterReader::ParseClusterHeader(const uint8_t *data, size_t length)
+{
+  // Cluster ID (4 byte)
+  if (length < 5 || data[0] != 0x1F || data[1] != 0x43 || data[2] != 0xB6 || data[3] != 0x75) {
+    return 0;
+  }
+
+  int sizeLength = 0;
+  for (int i = 0; i < 8; i++) {
+    if (data[4] & (0x80 >> i)) {
+      sizeLength = i + 1;
+      break;
+    }
+  }
+  if (sizeLength == 0 || length < 4 + (size_t)sizeLength) {
+    return 0;
+  }
+
+  uint64_t size = data[4] & (0xff >> sizeLength);
+  for (int i = 1; i < sizeLength; i++) {
+    size = (size << 8) | data[4 + i];
+  }
+  if (size == (1ull << (7 * sizeLength)) - 1) {
+    return 0; // サイズ不明の Cluster はまとめ読みしない
+  }
+  return 4 + sizeLength + (size_t)size;
+}
+
+bool
+MkvClusterReader::FillRange(int64_t pos, size_t length)
+{
+  if (mSize >= 0) {
+    length = (size_t)std::max<int64_t>(0, std::min<int64_t>(length, mSize - pos));
+  }
+  if (length == 0) {
+    return false;
+  }
+  if (mBuffer.size() < length) {
+    mBuffer.resize(length);
+  }
+  if (mReader->ReadAt(pos, mBuffer.data(), length) != 1) {
+    mBufferSize = 0;
+    return false;
+  }
+  mBufferPos  = pos;
+  mBufferSize = length;
+  return true;
+}
+
+bool
+MkvClusterReader::Fill(int64_t pos, size_t clusterSize)
+{
+  bool success = false;
+  if (clusterSize > 0) {
+    // サイズが分かっている Cluster は 1 回で読める
+    success = FillRange(pos, clusterSize + HEADER_PEEK_SIZE);
+    mClusterReads++;
+  } else {
+    // どこから読むか分からないので、まず少し読んで Cluster ヘッダか確認する
+    success = FillRange(pos, PROBE_SIZE);
+    mProbeReads++;
+    if (success) {
+      size_t clusterSize = ParseClusterHeader(mBuffer.data(), mBufferSize);
+      if (clusterSize > 0 && clusterSize <= mMaxClusterSize &&
+          clusterSize + HEADER_PEEK_SIZE > mBufferSize) {
+        success = FillRange(pos, clusterSize + HEADER_PEEK_SIZE);
+        mClusterReads++;
+      }
+    }
+  }
+
+  // 次の Cluster を探しておく。
+  // バッファの有効範囲は Cluster の終端までにして、次の Cluster は改めて 1 回で読む
+  mNextClusterPos  = -1;
+  mNextClusterSize = 0;
+  if (success) {
+    size_t clusterSize = ParseClusterHeader(mBuffer.data(), mBufferSize);
+    if (clusterSize > 0 && clusterSize < mBufferSize) {
+      size_t nextSize =
+        ParseClusterHeader(mBuffer.data() + clusterSize, mBufferSize - clusterSize);
+      if (nextSize > 0 && nextSize <= mMaxClusterSize) {
+        mNextClusterPos  = mBufferPos + (int64_t)clusterSize;
+        mNextClusterSize = nextSize;
+      }
+      mBufferSize = clusterSize;
+    }
+  }
+  return success;
+}
+
+int
+MkvClusterReader::Read(void *buffer, int64_t len)
+{
+  if (mReader == nullptr || len < 0) {
+    return 0;
+  }
+
+  // Cluster の先頭から読もうとしていて、Cluster 全体がバッファに無ければ Cluster ごと読む
+  // (直前の Cluster の末尾で見つけた Cluster ならサイズが分かっている)
+  int64_t bufferEnd = mBufferPos + (int64_t)mBufferSize;
+  if (mPos >= mBufferPos && mPos < bufferEnd) {
+    size_t offset      = (size_t)(mPos - mBufferPos);
+    size_t clusterSize = ParseClusterHeader(mBuffer.data() + offset, mBufferSize - offset);
+    if (clusterSize > 0 && clusterSize <= mMaxClusterSize &&
+        mPos + (int64_t)clusterSize > bufferEnd) {
+      if (!Fill(mPos, clusterSize)) {
+        return 0;
+      }
+    }
+  } else if (mPos == mNextClusterPos) {
+    if (!Fill(mPos, mNextClusterSize)) {
+      return 0;
+    }
+  }
+
+  uint8_t *dest = (uint8_t *)buffer;
+  while (len > 0) {
+    if (mPos < mBufferPos || mPos >= mBufferPos + (int64_t)mBufferSize) {
+      if (!Fill(mPos, 0)) {
+        return 0;
+      }
+    }
+    size_t offset = (size_t)(mPos - mBufferPos);
+    size_t n      = (size_t)std::min<int64_t>(len, mBufferSize - offset);
+    memcpy(dest, mBuffer.data() + offset, n);
+    dest += n;
+    len -= n;
+    mPos += n;
+  }
+  return 1;
+}
+
+int
+MkvClusterReader::Seek(int64_t offset, int whence)
+{
+  if (mReader == nullptr) {
+    return -1;
+  }
+
+  // 位置だけ更新する (読み込みは次の Read で)
+  int64_t newPos = 0;
+  switch (whence) {
+  case SEEK_SET:
+    newPos = offset;
+    break;
+  case SEEK_CUR:
+    newPos = mPos + offset;
+    break;
+  case SEEK_END:
+    if (mSize < 0) {
+      return -1;
+    }
+    newPos = mSize + offset;
+    break;
+  default:
+    return -1;
+  }
+  if (newPos < 0) {
+    return -1;
+  }
+  mPos = newPos;
+  return 0;
+}
+
+int64_t
+MkvClusterReader::Tell() const
+{
+  return mPos;
+}
+
+int
+MkvClusterReader::ReadAt(int64_t offset, void *buffer, int64_t len)
+{
+  // バッファとは独立に下位 reader から直接読む
+  if (mReader == nullptr) {
+    return 0;
+  }
+  return mReader->ReadAt(offset, buffer, len);
+}
+
+int64_t
+MkvClusterReader::Size() const
+{
+  return mSize;
+}
+
+void
+MkvClusterReader::GetStats(MkvReaderStats *stats) const
+{
+  // ストレージへの I/O は下位 reader が数える
+  if (mReader) {
+    mReader->GetStats(stats);
+  } else {
+    stats->Init();
+  }
+}
+
+IMkvFileReader *
+IMkvFileReader::CreateClusterReader(IMkvFileReader *reader, size_t maxClusterSize)
+{
+  MkvClusterReader *ret = new MkvClusterReader();
+  if (ret && ret->Open(reader, maxClusterSize)) {
+    return ret;
+  }
+  delete ret;
+  return nullptr;
+}
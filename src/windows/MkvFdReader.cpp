@@ -0,0 +1,256 @@
+#define MYLOG_TAG "MkvFdReader"
+#include "BasicLog.h"
+#include "MkvFileReader.h"
+#include "CommonUtils.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+
+#if defined(_WIN32)
+#include <io.h>
+#include <windows.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// -----------------------------------------------------------------------------
+// MkvFdReader
+//   fd の [offset, offset+length) の範囲だけを 1 ファイルとして pread で読む。
+//   アーカイブ内に無圧縮で格納されたムービーを展開せずに再生するためのもの。
+//   fd のファイル位置は使わないので、同じ fd を複数のプレイヤーで共有できる。
+//   (メモリマップできない場合のフォールバック)
+// -----------------------------------------------------------------------------
+class MkvFdReader : public IMkvFileReader
+{
+public:
+  MkvFdReader();
+  virtual ~MkvFdReader();
+
+  bool Open(int fd, int64_t offset, int64_t length);
+  void Close();
+
+  virtual int Read(void *buffer, int64_t length);
+  virtual int Seek(int64_t offset, int whence);
+  virtual int64_t Tell() const;
+  virtual int ReadAt(int64_t offset, void *buffer, int64_t length);
+  virtual int64_t Size() const;
+
+private:
+  MkvFdReader(const MkvFdReader &);
+  MkvFdReader &operator=(const MkvFdReader &);
+
+  bool IsOpen() const;
+  // 範囲内で読めた byte 数を返す
+  int64_t ReadRange(int64_t offset, void *buffer, int64_t length);
+
+  // 呼び出し側の fd は Open 後に閉じてもよい
+#if defined(_WIN32)
+  // _dup はファイルポインタを共有し、同期ハンドルへの ReadFile はそれを動かすので、
+  // 呼び出し側の fd の位置を変えないよう別のハンドルとして開き直す
+  HANDLE mFile;
+#else
+  int mFd;         // dup した fd
+#endif
+  int64_t mOffset; // 範囲の先頭 (fd 上の位置)
+  int64_t mSize;   // 範囲のサイズ
+  int64_t mPos;    // 範囲内の現在位置
+};
+
+MkvFdReader::MkvFdReader()
+#if defined(_WIN32)
+: mFile(INVALID_HANDLE_VALUE)
+#else
+: mFd(-1)
+#endif
+, mOffset(0)
+, mSize(0)
+, mPos(0)
+{}
+
+MkvFdReader::~MkvFdReader()
+{
+  Close();
+}
+
+bool
+MkvFdReader::Open(int fd, int64_t offset, int64_t length)
+{
+  if (fd < 0 || offset < 0) {
+    return false;
+  }
+
+#if defined(_WIN32)
+  int64_t fileSize = _filelengthi64(fd);
+#else
+  struct stat st;
+  int64_t fileSize = (fstat(fd, &st) == 0) ? st.st_size : -1;
+#endif
+  if (fileSize < 0) {
+    return false;
+  }
+  if (length <= 0) {
+    length = fileSize - offset;
+  }
+  if (length <= 0 || offset + length > fileSize) {
+    LOGV("invalid range: offset=%" PRId64 " length=%" PRId64 " size=%" PRId64 "\n", offset,
+         length, fileSize);
+    return false;
+  }
+
+#if defined(_WIN32)
+  HANDLE file = (HANDLE)_get_osfhandle(fd);
+  if (file == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  mFile = ReOpenFile(file, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, 0);
+  if (mFile == INVALID_HANDLE_VALUE) {
+    LOGV("failed to reopen fd: %d\n", fd);
+    return false;
+  }
+#else
+  mFd = dup(fd);
+  if (mFd < 0) {
+    return false;
+  }
+#endif
+  mOffset = offset;
+  mSize   = length;
+  mPos    = 0;
+  return true;
+}
+
+void
+MkvFdReader::Close()
+{
+#if defined(_WIN32)
+  if (mFile != INVALID_HANDLE_VALUE) {
+    CloseHandle(mFile);
+    mFile = INVALID_HANDLE_VALUE;
+  }
+#else
+  if (mFd >= 0) {
+    close(mFd);
+    mFd = -1;
+  }
+#endif
+  mOffset = 0;
+  mSize   = 0;
+  mPos    = 0;
+}
+
+bool
+MkvFdReader::IsOpen() const
+{
+#if defined(_WIN32)
+  return (mFile != INVALID_HANDLE_VALUE);
+#else
+  return (mFd >= 0);
+#endif
+}
+
+int64_t
+MkvFdReader::ReadRange(int64_t offset, void *buffer, int64_t len)
+{
+  // 範囲外は読まない
+  len = std::min(len, mSize - offset);
+
+  int64_t begin  = get_time_us();
+  uint8_t *dest  = (uint8_t *)buffer;
+  int64_t readed = 0;
+  while (readed < len) {
+    int64_t pos = mOffset + offset + readed;
+#if defined(_WIN32)
+    OVERLAPPED ov = {};
+    ov.Offset     = (DWORD)(pos & 0xffffffff);
+    ov.OffsetHigh = (DWORD)(pos >> 32);
+    DWORD n       = 0;
+    DWORD request = (DWORD)std::min<int64_t>(len - readed, 0x40000000);
+    if (!ReadFile(mFile, dest + readed, request, &n, &ov) || n == 0) {
+      break;
+    }
+#else
+    ssize_t n = pread(mFd, dest + readed, (size_t)(len - readed), (off_t)pos);
+    if (n <= 0) {
+      break;
+    }
+#endif
+    readed += n;
+  }
+  mStats.AddRead(readed, get_time_us() - begin);
+  return readed;
+}
+
+int
+MkvFdReader::Read(void *buffer, int64_t len)
+{
+  if (!IsOpen() || len < 0) {
+    return 0;
+  }
+  int64_t readed = ReadRange(mPos, buffer, len);
+  mPos += readed;
+  return (readed == len);
+}
+
+int
+MkvFdReader::Seek(int64_t offset, int whence)
+{
+  if (!IsOpen()) {
+    return -1;
+  }
+
+  int64_t newPos = 0;
+  switch (whence) {
+  case SEEK_SET:
+    newPos = offset;
+    break;
+  case SEEK_CUR:
+    newPos = mPos + offset;
+    break;
+  case SEEK_END:
+    newPos = mSize + offset;
+    break;
+  default:
+    return -1;
+  }
+  if (newPos < 0) {
+    return -1;
+  }
+  mStats.AddSeek(mPos, newPos);
+  mPos = newPos;
+  return 0;
+}
+
+int64_t
+MkvFdReader::Tell() const
+{
+  return mPos;
+}
+
+int
+MkvFdReader::ReadAt(int64_t offset, void *buffer, int64_t len)
+{
+  if (!IsOpen() || offset < 0 || len < 0) {
+    return 0;
+  }
+  return (ReadRange(offset, buffer, len) == len);
+}
+
+int64_t
+MkvFdReader::Size() const
+{
+  return mSize;
+}
+
+IMkvFileReader *
+IMkvFileReader::Create(int fd, int64_t offset, int64_t length)
+{
+  MkvFdReader *ret = new MkvFdReader();
+  if (ret && ret->Open(fd, offset, length)) {
+    return ret;
+  }
+  delete ret;
+  return nullptr;
+}
@@ -1,9 +1,19 @@
 #define MYLOG_TAG "MkvFileReader"
 #include "BasicLog.h"
 #include "MkvFileReader.h"
+#include "CommonUtils.h"
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
 
 class MkvFileReader : public IMkvFileReader
 {
@@ -11,12 +21,16 @@ public:
   MkvFileReader();
   virtual ~MkvFileReader();
 
-  bool Open(const char *filePath);
+  // isGrowing: 他プロセスが書き込み中のファイル。書き込みを妨げないように開き、
+  // Size は呼ばれるたびに現在のサイズを返す
+  bool Open(const char *filePath, bool isGrowing = false);
   void Close();
 
   virtual int Read(void *buffer, int64_t length);
   virtual int Seek(int64_t offset, int whence);
   virtual int64_t Tell() const;
+  virtual int ReadAt(int64_t offset, void *buffer, int64_t length);
+  virtual int64_t Size() const;
 
 private:
   MkvFileReader(const MkvFileReader &);
@@ -24,10 +38,23 @@ private:
 
   FILE *mFile;
   std::string mFilePath;
+  int64_t mSize;
+  bool mIsGrowing;
+
+#if defined(_WIN32)
+  // ReadAt 用のハンドル。同期ハンドルへの ReadFile はファイルポインタを動かすので
+  // FILE* 側とは別に開いておく
+  HANDLE mReadAtFile;
+#endif
 };
 
 MkvFileReader::MkvFileReader()
 : mFile(nullptr)
+, mSize(-1)
+, mIsGrowing(false)
+#if defined(_WIN32)
+, mReadAtFile(INVALID_HANDLE_VALUE)
+#endif
 {}
 
 MkvFileReader::~MkvFileReader()
@@ -36,7 +63,6 @@ MkvFileReader::~MkvFileReader()
 }
 
 #ifdef _MSC_VER
-#include <windows.h>
 std::wstring utf8_decode(const std::string &str)
 {
     if( str.empty() ) return std::wstring();
@@ -48,7 +74,7 @@ std::wstring utf8_decode(const std::string &str)
 #endif
 
 bool
-MkvFileReader::Open(const char *filePath)
+MkvFileReader::Open(const char *filePath, bool isGrowing)
 {
   if (filePath == nullptr) {
     return false;
@@ -56,9 +82,17 @@ MkvFileReader::Open(const char *filePath)
 
 #ifdef _MSC_VER
   std::wstring wpath = utf8_decode(std::string(filePath));
-  const errno_t e = _wfopen_s(&mFile, wpath.c_str(), L"rb");
-  if (e) {
-    return false;
+  if (isGrowing) {
+    // _wfopen_s は共有不可で開くので、書き込み側と同時に開けるように _wfsopen を使う
+    mFile = _wfsopen(wpath.c_str(), L"rb", _SH_DENYNO);
+    if (mFile == NULL) {
+      return false;
+    }
+  } else {
+    const errno_t e = _wfopen_s(&mFile, wpath.c_str(), L"rb");
+    if (e) {
+      return false;
+    }
   }
 #else
   mFile = fopen(filePath, "rb");
@@ -67,7 +101,23 @@ MkvFileReader::Open(const char *filePath)
   }
 #endif
 
-  mFilePath = filePath;
+  mFilePath  = filePath;
+  mIsGrowing = isGrowing;
+
+#if defined(_WIN32)
+  DWORD shareMode = isGrowing ? (FILE_SHARE_READ | FILE_SHARE_WRITE) : FILE_SHARE_READ;
+#ifdef _MSC_VER
+  mReadAtFile = CreateFileW(wpath.c_str(), GENERIC_READ, shareMode, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+#else
+  mReadAtFile = CreateFileA(filePath, GENERIC_READ, shareMode, NULL, OPEN_EXISTING,
+                            FILE_ATTRIBUTE_NORMAL, NULL);
+#endif
+#endif
+
+  Seek(0, SEEK_END);
+  mSize = Tell();
+  Seek(0, SEEK_SET);
 
   return true;
 }
@@ -80,6 +130,13 @@ MkvFileReader::Close()
     fclose(mFile);
   }
   mFile   = NULL;
+  mSize   = -1;
+#if defined(_WIN32)
+  if (mReadAtFile != INVALID_HANDLE_VALUE) {
+    CloseHandle(mReadAtFile);
+    mReadAtFile = INVALID_HANDLE_VALUE;
+  }
+#endif
 }
 
 int
@@ -88,7 +145,9 @@ MkvFileReader::Read(void *buffer, int64_t len)
   if (mFile == NULL) {
     return 0;
   }
-  size_t ret = fread(buffer, 1, len, mFile);
+  int64_t begin = get_time_us();
+  size_t ret    = fread(buffer, 1, len, mFile);
+  mStats.AddRead(ret, get_time_us() - begin);
   return (ret == (size_t)len);
 }
 
@@ -98,6 +157,7 @@ MkvFileReader::Seek(int64_t offset, int whence)
   if (mFile == NULL) {
     return -1;
   }
+  int64_t from = Tell();
 #ifdef _MSC_VER
   _fseeki64(mFile, offset, whence);
 #elif defined(_WIN32)
@@ -105,6 +165,7 @@ MkvFileReader::Seek(int64_t offset, int whence)
 #else
   fseek(mFile, static_cast<off_t>(offset), whence);
 #endif
+  mStats.AddSeek(from, Tell());
   return 0;
 }
 
@@ -123,6 +184,62 @@ MkvFileReader::Tell() const
 #endif
 }
 
+int
+MkvFileReader::ReadAt(int64_t offset, void *buffer, int64_t len)
+{
+  if (mFile == NULL || offset < 0 || len < 0) {
+    return 0;
+  }
+
+  int64_t begin = get_time_us();
+  int64_t total = len;
+  uint8_t *dest = (uint8_t *)buffer;
+  while (len > 0) {
+#if defined(_WIN32)
+    if (mReadAtFile == INVALID_HANDLE_VALUE) {
+      return 0;
+    }
+    OVERLAPPED ov = {};
+    ov.Offset     = (DWORD)(offset & 0xffffffff);
+    ov.OffsetHigh = (DWORD)(offset >> 32);
+    DWORD readed  = 0;
+    DWORD request = (DWORD)std::min<int64_t>(len, 0x40000000);
+    if (!ReadFile(mReadAtFile, dest, request, &readed, &ov) || readed == 0) {
+      return 0;
+    }
+#else
+    ssize_t readed = pread(fileno(mFile), dest, (size_t)len, (off_t)offset);
+    if (readed <= 0) {
+      return 0;
+    }
+#endif
+    dest += readed;
+    offset += readed;
+    len -= readed;
+  }
+  mStats.AddRead(total, get_time_us() - begin);
+  return 1;
+}
+
+int64_t
+MkvFileReader::Size() const
+{
+  if (mIsGrowing && mFile != NULL) {
+#if defined(_WIN32)
+    struct _stat64 st;
+    if (_fstat64(_fileno(mFile), &st) == 0) {
+      return st.st_size;
+    }
+#else
+    struct stat st;
+    if (fstat(fileno(mFile), &st) == 0) {
+      return st.st_size;
+    }
+#endif
+  }
+  return mSize;
+}
+
 IMkvFileReader *IMkvFileReader::Create(const char *filename)
 {
   MkvFileReader *ret = new MkvFileReader();
@@ -131,4 +248,15 @@ IMkvFileReader *IMkvFileReader::Create(const char *filename)
   }
   delete ret;
   return nullptr;
+}
+
+IMkvFileReader *IMkvFileReader::CreateGrowing(const char *filename)
+{
+  // マップは開いた時点のサイズに固定されるので使わない
+  MkvFileReader *ret = new MkvFileReader();
+  if (ret && ret->Open(filename, true)) {
+    return ret;
+  }
+  delete ret;
+  return nullptr;
 }
\ No newline at end of file
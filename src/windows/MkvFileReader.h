@@ -1,10 +1,131 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <cstdio>
 #include <string>
+#include <vector>
 
 class IMovieReadStream;
 
+// メモリ上のデータを読む reader 用の Read 記録。
+// コピー先アドレスからコピー元アドレスを引けるようにしておき、
+// nestegg が読み込んだフレームデータを再コピーせずに元の領域を参照するのに使う。
+class MkvReadLog
+{
+public:
+  MkvReadLog()
+  : mIsEnabled(false)
+  {}
+
+  void Begin()
+  {
+    mEntries.clear();
+    mIsEnabled = true;
+  }
+  void End() { mIsEnabled = false; }
+
+  void Add(const void *dest, const uint8_t *src, int64_t length)
+  {
+    if (mIsEnabled) {
+      mEntries.push_back({ dest, src, length });
+    }
+  }
+
+  // dest は 1 回の Read のコピー先の一部でもよい (ブロックをまとめて読んだ中のフレーム)
+  const uint8_t *Find(const void *dest, int64_t length) const
+  {
+    // 同じアドレスに複数回読んでいる場合は最後のものが現在の内容
+    const uint8_t *p = (const uint8_t *)dest;
+    for (auto it = mEntries.rbegin(); it != mEntries.rend(); ++it) {
+      const uint8_t *begin = (const uint8_t *)it->dest;
+      if (p >= begin && p + length <= begin + it->length) {
+        return it->src + (p - begin);
+      }
+    }
+    return nullptr;
+  }
+
+private:
+  struct Entry
+  {
+    const void *dest;
+    const uint8_t *src;
+    int64_t length;
+  };
+  std::vector<Entry> mEntries;
+  bool mIsEnabled;
+};
+
+// reader の I/O 統計 (Open からの累積)
+struct MkvReaderStats
+{
+  uint64_t readCalls;
+  uint64_t readBytes;
+  uint64_t seekCalls;
+  uint64_t backwardSeeks;
+  int64_t readUs; // 読み込みにかかった累計時間
+
+  void Init()
+  {
+    readCalls     = 0;
+    readBytes     = 0;
+    seekCalls     = 0;
+    backwardSeeks = 0;
+    readUs        = 0;
+  }
+  void Add(const MkvReaderStats &other)
+  {
+    readCalls += other.readCalls;
+    readBytes += other.readBytes;
+    seekCalls += other.seekCalls;
+    backwardSeeks += other.backwardSeeks;
+    readUs += other.readUs;
+  }
+};
+
+// MkvReaderStats の集計用。読み込みスレッドと参照スレッドが異なるので atomic で持つ
+class MkvReaderCounter
+{
+public:
+  MkvReaderCounter()
+  : mReadCalls(0)
+  , mReadBytes(0)
+  , mSeekCalls(0)
+  , mBackwardSeeks(0)
+  , mReadUs(0)
+  {}
+
+  void AddRead(uint64_t bytes, int64_t us)
+  {
+    mReadCalls.fetch_add(1, std::memory_order_relaxed);
+    mReadBytes.fetch_add(bytes, std::memory_order_relaxed);
+    mReadUs.fetch_add(us, std::memory_order_relaxed);
+  }
+  void AddSeek(int64_t from, int64_t to)
+  {
+    mSeekCalls.fetch_add(1, std::memory_order_relaxed);
+    if (to < from) {
+      mBackwardSeeks.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+  void Get(MkvReaderStats *stats) const
+  {
+    stats->readCalls     = mReadCalls.load(std::memory_order_relaxed);
+    stats->readBytes     = mReadBytes.load(std::memory_order_relaxed);
+    stats->seekCalls     = mSeekCalls.load(std::memory_order_relaxed);
+    stats->backwardSeeks = mBackwardSeeks.load(std::memory_order_relaxed);
+    stats->readUs        = mReadUs.load(std::memory_order_relaxed);
+  }
+
+private:
+  std::atomic<uint64_t> mReadCalls;
+  std::atomic<uint64_t> mReadBytes;
+  std::atomic<uint64_t> mSeekCalls;
+  std::atomic<uint64_t> mBackwardSeeks;
+  std::atomic<int64_t> mReadUs;
+};
+
 class IMkvFileReader
 {
 public:
@@ -13,6 +134,62 @@ public:
   virtual int Read(void *buffer, int64_t length) = 0;
   virtual int Seek(int64_t offset, int whence) = 0;
   virtual int64_t Tell() const = 0;
+  // 位置指定読み込み。Read/Seek の現在位置は変えず、複数スレッドから同時に呼べる。
+  // 戻り値は Read と同じ (全部読めたら 1)
+  virtual int ReadAt(int64_t offset, void *buffer, int64_t length) = 0;
+  // 全体サイズ(byte)。不明な場合は -1
+  virtual int64_t Size() const = 0;
+  // メモリ上のデータを読む reader のみ対応。BeginReadLog()～EndReadLog() 間の Read で
+  // dest に length byte コピーしたときのコピー元を返す (無ければ nullptr)。
+  // コピー元は reader が生きている間有効。
+  virtual void BeginReadLog() {}
+  virtual void EndReadLog() {}
+  virtual const uint8_t *FindReadSource(const void *dest, int64_t length) const
+  {
+    return nullptr;
+  }
+  // 複数ファイルを連結して読む reader のみ対応。ファイル (セグメント) 数と
+  // 各ファイルの連結後の先頭位置
+  virtual size_t GetSegmentCount() const { return 0; }
+  virtual int64_t GetSegmentOffset(size_t index) const { return -1; }
+  // 実際のストレージ (ファイル/stream/fd/メモリ) への I/O 統計。
+  // バッファや先読みで吸収された分は含まない
+  virtual void GetStats(MkvReaderStats *stats) const { mStats.Get(stats); }
+  // ファイル指定の FILE* 版。メモリマップ版は CreateMapped で明示的に作る
   static IMkvFileReader *Create(const char *filename);
-  static IMkvFileReader *Create(IMovieReadStream *stream);
-};
\ No newline at end of file
+  // 他プロセスが書き込み中のファイル用。FILE* 版で書き込みを妨げずに開き、
+  // Size は現在のサイズを返す (呼ぶたびに増えうる)
+  static IMkvFileReader *CreateGrowing(const char *filename);
+  // bufferSize > 0 の場合は bufferSize 単位でまとめ読みする (0 ならバッファ無し)
+  static IMkvFileReader *Create(IMovieReadStream *stream, size_t bufferSize = 0);
+  // 先頭から順にしか読めない stream 用 (host の Seek/Size は呼ばない)。
+  // 前方への Seek は読み捨て、後方への Seek はバッファ内のみ成功する。Size は -1、ReadAt は常に失敗
+  static IMkvFileReader *CreateForwardOnly(IMovieReadStream *stream, size_t bufferSize);
+  // メモリ上のデータを直接読む (data は reader より長生きすること。コピーはしない)
+  static IMkvFileReader *Create(const void *data, size_t size);
+  // fd の [offset, offset+length) の範囲だけを 1 ファイルとして読む (length <= 0 なら末尾まで)。
+  // pread 版 (メモリマップ版は CreateMapped)。
+  // 読み込みは位置指定のみで fd のファイル位置は使わないので、同じ fd を複数で共有できる。
+  static IMkvFileReader *Create(int fd, int64_t offset, int64_t length);
+  // メモリマップ版 (マップできない環境/ファイルでは nullptr)。
+  // 読み込み中にファイルが切り詰められる/置き換えられると SIGBUS (Windows では
+  // 例外) になるので、ファイルが変更されないことが分かっている場合のみ使う
+  static IMkvFileReader *CreateMapped(const char *filename);
+  static IMkvFileReader *CreateMapped(int fd, int64_t offset, int64_t length);
+  // 複数のファイルを順に連結して 1 つのファイルとして読む (DASH の初期化セグメント +
+  // メディアセグメント)。各ファイルは 1 回でメモリに読み込み、次のファイルは先読みする
+  static IMkvFileReader *CreateSegmented(const std::vector<std::string> &paths);
+  // reader を先読みスレッド付きでラップする (reader の所有権は移る)
+  static IMkvFileReader *CreatePrefetch(IMkvFileReader *reader, size_t windowSize);
+  // reader を Cluster 単位のまとめ読みでラップする (reader の所有権は移る)。
+  // maxClusterSize を超える Cluster は通常のまとめ読み
+  static IMkvFileReader *CreateClusterReader(IMkvFileReader *reader, size_t maxClusterSize);
+
+protected:
+  MkvReaderCounter mStats;
+};
+
+#ifdef _MSC_VER
+// UTF-8 パス → wchar_t パス (MkvFileReader.cpp)
+std::wstring utf8_decode(const std::string &str);
+#endif
@@ -0,0 +1,235 @@
+#define MYLOG_TAG "MkvForwardStreamReader"
+#include "BasicLog.h"
+#include "MkvFileReader.h"
+#include "IMoviePlayer.h"
+#include "CommonUtils.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// MkvForwardStreamReader
+//   パイプやネットワーク等、先頭から順にしか読めない stream 用。
+//   host の IMovieReadStream には Read しか呼ばない (Seek/Size/Tell は呼ばない)。
+//   開いた時点の stream の位置をムービーの先頭 (位置 0) として扱う。
+//   前方への Seek は読み捨てで、後方への Seek はバッファ内に収まる場合だけ成功する。
+//   host の Read が要求より少なく返してきても、そこまででバッファを返すので
+//   データが揃うのを待たずに解析を進められる。
+// -----------------------------------------------------------------------------
+class MkvForwardStreamReader : public IMkvFileReader
+{
+public:
+  MkvForwardStreamReader();
+  virtual ~MkvForwardStreamReader();
+
+  bool Open(IMovieReadStream *stream, size_t bufferSize);
+  void Close();
+
+  virtual int Read(void *buffer, int64_t length);
+  virtual int Seek(int64_t offset, int whence);
+  virtual int64_t Tell() const;
+  virtual int ReadAt(int64_t offset, void *buffer, int64_t length);
+  virtual int64_t Size() const;
+
+private:
+  MkvForwardStreamReader(const MkvForwardStreamReader &);
+  MkvForwardStreamReader &operator=(const MkvForwardStreamReader &);
+
+  size_t ReadFromStream(void *buffer, size_t length);
+  bool Fill();
+
+  // 前方シークの読み捨てにも使うので、bufferSize = 0 でもこれだけは持つ
+  static constexpr size_t MIN_BUFFER_SIZE = 4 * 1024;
+
+  IMovieReadStream *mStream;
+
+  // 読み込みバッファ。常に host stream から最後に読んだ範囲を持つ
+  // (mBufferPos + mBufferSize == mStreamPos)
+  std::vector<uint8_t> mBuffer;
+  int64_t mBufferPos;
+  size_t mBufferSize;
+  int64_t mPos;       // nestegg から見た現在位置
+  int64_t mStreamPos; // host stream の現在位置
+
+  uint64_t mSkippedBytes; // 前方シークで読み捨てた量
+};
+
+MkvForwardStreamReader::MkvForwardStreamReader()
+: mStream(nullptr)
+, mBufferPos(0)
+, mBufferSize(0)
+, mPos(0)
+, mStreamPos(0)
+, mSkippedBytes(0)
+{}
+
+MkvForwardStreamReader::~MkvForwardStreamReader()
+{
+  Close();
+}
+
+bool
+MkvForwardStreamReader::Open(IMovieReadStream *stream, size_t bufferSize)
+{
+  if (stream == nullptr) {
+    return false;
+  }
+  mStream = stream;
+  mStream->AddRef();
+
+  mBuffer.resize(std::max(bufferSize, MIN_BUFFER_SIZE));
+  mPos = mStreamPos = mBufferPos = 0;
+  mBufferSize                    = 0;
+  return true;
+}
+
+void
+MkvForwardStreamReader::Close()
+{
+  if (mStream) {
+    MkvReaderStats stats;
+    mStats.Get(&stats);
+    LOGV("forward stream: read=%" PRIu64 " bytes=%" PRIu64 " skipped=%" PRIu64 "\n",
+         stats.readCalls, stats.readBytes, mSkippedBytes);
+    mStream->Release();
+    mStream = nullptr;
+  }
+}
+
+size_t
+MkvForwardStreamReader::ReadFromStream(void *buffer, size_t length)
+{
+  int64_t begin = get_time_us();
+  size_t readed = mStream->Read(buffer, length);
+  mStreamPos += readed;
+  mStats.AddRead(readed, get_time_us() - begin);
+  return readed;
+}
+
+bool
+MkvForwardStreamReader::Fill()
+{
+  // host から返ってきた分だけで良い (バッファが埋まるまで待たない)
+  int64_t bufferEnd = mStreamPos;
+  size_t readed     = ReadFromStream(mBuffer.data(), mBuffer.size());
+  if (readed == 0) {
+    return false; // EOS
+  }
+  mBufferPos  = bufferEnd;
+  mBufferSize = readed;
+  if (mPos > mBufferPos) {
+    mSkippedBytes += std::min<int64_t>(mPos - mBufferPos, readed);
+  }
+  return true;
+}
+
+int
+MkvForwardStreamReader::Read(void *buffer, int64_t len)
+{
+  if (mStream == nullptr || len < 0) {
+    return 0;
+  }
+
+  uint8_t *dest = (uint8_t *)buffer;
+  size_t remain = static_cast<size_t>(len);
+  while (remain > 0) {
+    // バッファに載っている分を返す
+    if (mBufferPos <= mPos && mPos < mBufferPos + (int64_t)mBufferSize) {
+      size_t offset = (size_t)(mPos - mBufferPos);
+      size_t n      = std::min(remain, mBufferSize - offset);
+      memcpy(dest, mBuffer.data() + offset, n);
+      dest += n;
+      remain -= n;
+      mPos += n;
+      continue;
+    }
+    if (mPos < mBufferPos) {
+      return 0; // 読み終えた位置には戻れない
+    }
+
+    // バッファより大きい読み込みは直接読む。短く返ってきたら続きを待つ
+    if (mPos == mStreamPos && remain >= mBuffer.size()) {
+      while (remain > 0) {
+        size_t readed = ReadFromStream(dest, remain);
+        if (readed == 0) {
+          break; // EOS
+        }
+        dest += readed;
+        remain -= readed;
+        mPos += readed;
+      }
+      mBufferPos  = mStreamPos;
+      mBufferSize = 0;
+      return (remain == 0);
+    }
+
+    // 前方シーク分はここで読み捨てられる
+    if (!Fill()) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int
+MkvForwardStreamReader::Seek(int64_t offset, int whence)
+{
+  if (mStream == nullptr) {
+    return -1;
+  }
+
+  int64_t newPos = 0;
+  switch (whence) {
+  case SEEK_SET:
+    newPos = offset;
+    break;
+  case SEEK_CUR:
+    newPos = mPos + offset;
+    break;
+  case SEEK_END: // 全体サイズは分からない
+  default:
+    return -1;
+  }
+
+  // 前方は次の Read で読み捨てる。後方はバッファ内だけ
+  if (newPos < mBufferPos) {
+    LOGV("backward seek is not supported: %" PRId64 " -> %" PRId64 "\n", mPos, newPos);
+    return -1;
+  }
+  mPos = newPos;
+  return 0;
+}
+
+int64_t
+MkvForwardStreamReader::Tell() const
+{
+  return mPos;
+}
+
+int
+MkvForwardStreamReader::ReadAt(int64_t /*offset*/, void * /*buffer*/, int64_t /*len*/)
+{
+  // 位置指定の読み込みはできない
+  return 0;
+}
+
+int64_t
+MkvForwardStreamReader::Size() const
+{
+  return -1;
+}
+
+IMkvFileReader *
+IMkvFileReader::CreateForwardOnly(IMovieReadStream *stream, size_t bufferSize)
+{
+  MkvForwardStreamReader *ret = new MkvForwardStreamReader();
+  if (ret && ret->Open(stream, bufferSize)) {
+    return ret;
+  }
+  delete ret;
+  return nullptr;
+}
@@ -0,0 +1,395 @@
+#define MYLOG_TAG "MkvMappedFileReader"
+#include "BasicLog.h"
+#include "MkvFileReader.h"
+#include "CommonUtils.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <io.h>
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// -----------------------------------------------------------------------------
+// MkvMappedFileReader
+//   ファイル全体を読み取り専用でメモリマップし、nestegg からの細かい Read を
+//   ポインタ演算 + memcpy だけで処理する。fread/fseek 経由の libc 呼び出しが
+//   クラスタあたり数千回になるのを避けるためのもの。
+// -----------------------------------------------------------------------------
+class MkvMappedFileReader : public IMkvFileReader
+{
+public:
+  MkvMappedFileReader();
+  virtual ~MkvMappedFileReader();
+
+  bool Open(const char *filePath);
+  bool Open(int fd, int64_t offset, int64_t length);
+  void Close();
+
+  virtual int Read(void *buffer, int64_t length);
+  virtual int Seek(int64_t offset, int whence);
+  virtual int64_t Tell() const;
+  virtual int ReadAt(int64_t offset, void *buffer, int64_t length);
+  virtual int64_t Size() const;
+
+  virtual void BeginReadLog() { mReadLog.Begin(); }
+  virtual void EndReadLog() { mReadLog.End(); }
+  virtual const uint8_t *FindReadSource(const void *dest, int64_t length) const
+  {
+    return mReadLog.Find(dest, length);
+  }
+
+private:
+  MkvMappedFileReader(const MkvMappedFileReader &);
+  MkvMappedFileReader &operator=(const MkvMappedFileReader &);
+
+#if defined(_WIN32)
+  bool Map(HANDLE file, int64_t offset, int64_t length);
+#else
+  bool Map(int fd, int64_t offset, int64_t length);
+#endif
+  void AdviseWillNeed(int64_t offset);
+
+  // 先読みヒント(WILLNEED)を出す単位
+  static const int64_t WILLNEED_WINDOW = 1024 * 1024;
+
+  const uint8_t *mMapBase; // マップした領域 (ページ/アロケーション粒度境界)
+  int64_t mMapSize;
+  const uint8_t *mData; // 読み込み対象範囲の先頭
+  int64_t mSize;
+  int64_t mPos;
+  int64_t mAdvisedEnd; // WILLNEED 済み範囲の終端
+
+  MkvReadLog mReadLog;
+
+#if defined(_WIN32)
+  HANDLE mFile;
+  HANDLE mMapping;
+#endif
+};
+
+MkvMappedFileReader::MkvMappedFileReader()
+: mMapBase(nullptr)
+, mMapSize(0)
+, mData(nullptr)
+, mSize(0)
+, mPos(0)
+, mAdvisedEnd(0)
+#if defined(_WIN32)
+, mFile(INVALID_HANDLE_VALUE)
+, mMapping(NULL)
+#endif
+{}
+
+MkvMappedFileReader::~MkvMappedFileReader()
+{
+  Close();
+}
+
+bool
+MkvMappedFileReader::Open(const char *filePath)
+{
+  if (filePath == nullptr) {
+    return false;
+  }
+
+#if defined(_WIN32)
+#ifdef _MSC_VER
+  std::wstring wpath = utf8_decode(std::string(filePath));
+  mFile = CreateFileW(wpath.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                      FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+#else
+  mFile = CreateFileA(filePath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                      FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+#endif
+  if (mFile == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(mFile, &size) || !Map(mFile, 0, size.QuadPart)) {
+    Close();
+    return false;
+  }
+#else
+  int fd = open(filePath, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+
+  struct stat st;
+  bool success = (fstat(fd, &st) == 0 && Map(fd, 0, st.st_size));
+  // マップ後は fd 不要 (マッピングがファイル参照を保持する)
+  close(fd);
+  if (!success) {
+    return false;
+  }
+#endif
+  return true;
+}
+
+bool
+MkvMappedFileReader::Open(int fd, int64_t offset, int64_t length)
+{
+  if (fd < 0 || offset < 0) {
+    return false;
+  }
+
+  // fd は借りるだけ (マッピングがファイル参照を持つので、Open 後は閉じられてもよい)
+#if defined(_WIN32)
+  HANDLE file = (HANDLE)_get_osfhandle(fd);
+  LARGE_INTEGER size;
+  if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &size)) {
+    return false;
+  }
+  int64_t fileSize = size.QuadPart;
+#else
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return false;
+  }
+  int64_t fileSize = st.st_size;
+#endif
+  if (length <= 0) {
+    length = fileSize - offset;
+  }
+  if (offset + length > fileSize) {
+    LOGV("invalid range: offset=%" PRId64 " length=%" PRId64 " size=%" PRId64 "\n", offset,
+         length, fileSize);
+    return false;
+  }
+
+#if defined(_WIN32)
+  return Map(file, offset, length);
+#else
+  return Map(fd, offset, length);
+#endif
+}
+
+#if defined(_WIN32)
+bool
+MkvMappedFileReader::Map(HANDLE file, int64_t offset, int64_t length)
+#else
+bool
+MkvMappedFileReader::Map(int fd, int64_t offset, int64_t length)
+#endif
+{
+  if (length <= 0 || (uint64_t)length > (uint64_t)SIZE_MAX) {
+    // 空、あるいは 32bit プロセスでマップしきれないサイズ
+    return false;
+  }
+
+#if defined(_WIN32)
+  // マップ開始位置はアロケーション粒度に揃える必要がある
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  int64_t mapOffset = offset - (offset % si.dwAllocationGranularity);
+  int64_t mapSize   = length + (offset - mapOffset);
+
+  mMapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+  if (mMapping == NULL) {
+    return false;
+  }
+
+  mMapBase = (const uint8_t *)MapViewOfFile(mMapping, FILE_MAP_READ, (DWORD)(mapOffset >> 32),
+                                            (DWORD)(mapOffset & 0xffffffff), (SIZE_T)mapSize);
+  if (mMapBase == nullptr) {
+    LOGV("MapViewOfFile failed: size=%" PRId64 "\n", mapSize);
+    CloseHandle(mMapping);
+    mMapping = NULL;
+    return false;
+  }
+#else
+  // マップ開始位置はページ境界に揃える必要がある
+  static const int64_t pageSize = sysconf(_SC_PAGESIZE);
+  int64_t mapOffset = offset - (offset % pageSize);
+  int64_t mapSize   = length + (offset - mapOffset);
+
+  void *addr = mmap(nullptr, (size_t)mapSize, PROT_READ, MAP_PRIVATE, fd, (off_t)mapOffset);
+  if (addr == MAP_FAILED) {
+    LOGV("mmap failed: size=%" PRId64 "\n", mapSize);
+    return false;
+  }
+  mMapBase = (const uint8_t *)addr;
+
+  // 基本はシーケンシャルアクセス (Cues/Seek 時のみ飛ぶ)
+  madvise(addr, (size_t)mapSize, MADV_SEQUENTIAL);
+#endif
+
+  mMapSize    = mapSize;
+  mData       = mMapBase + (offset - mapOffset);
+  mSize       = length;
+  mPos        = 0;
+  mAdvisedEnd = 0;
+  AdviseWillNeed(0);
+
+  return true;
+}
+
+void
+MkvMappedFileReader::Close()
+{
+#if defined(_WIN32)
+  if (mMapBase) {
+    UnmapViewOfFile(mMapBase);
+  }
+  if (mMapping != NULL) {
+    CloseHandle(mMapping);
+    mMapping = NULL;
+  }
+  if (mFile != INVALID_HANDLE_VALUE) {
+    CloseHandle(mFile);
+    mFile = INVALID_HANDLE_VALUE;
+  }
+#else
+  if (mMapBase) {
+    munmap((void *)mMapBase, (size_t)mMapSize);
+  }
+#endif
+  mMapBase = nullptr;
+  mMapSize = 0;
+  mData    = nullptr;
+  mSize    = 0;
+  mPos     = 0;
+}
+
+void
+MkvMappedFileReader::AdviseWillNeed(int64_t offset)
+{
+#if !defined(_WIN32)
+  // ページ境界に揃えて offset から WILLNEED_WINDOW 分を先読み要求
+  // (範囲指定で開いた場合 mData 自体はページ境界に揃っていない)
+  static const int64_t pageSize = sysconf(_SC_PAGESIZE);
+
+  int64_t mapPos = (mData - mMapBase) + offset;
+  int64_t begin  = mapPos - (mapPos % pageSize);
+  int64_t end    = (mData - mMapBase) + std::min(offset + WILLNEED_WINDOW, mSize);
+  if (begin < end) {
+    madvise((void *)(mMapBase + begin), (size_t)(end - begin), MADV_WILLNEED);
+  }
+  mAdvisedEnd = std::min(offset + WILLNEED_WINDOW, mSize);
+#else
+  // Windows は FILE_FLAG_SEQUENTIAL_SCAN のキャッシュマネージャ先読みに任せる
+  mAdvisedEnd = mSize;
+#endif
+}
+
+int
+MkvMappedFileReader::Read(void *buffer, int64_t len)
+{
+  if (mData == nullptr || len < 0) {
+    return 0;
+  }
+  if (mPos + len > mSize) {
+    // 読めるところまで読んでおく (fread 版と同じく戻り値は失敗扱い)
+    if (mPos < mSize) {
+      memcpy(buffer, mData + mPos, (size_t)(mSize - mPos));
+      mPos = mSize;
+    }
+    return 0;
+  }
+
+  // メモリ上でもページフォルト(実際のディスク読み込み)はここで起きる
+  int64_t begin = get_time_us();
+  memcpy(buffer, mData + mPos, (size_t)len);
+  mStats.AddRead(len, get_time_us() - begin);
+  mReadLog.Add(buffer, mData + mPos, len);
+  mPos += len;
+
+  // 先読み範囲の後半に入ったら次の範囲を要求しておく
+  if (mPos + WILLNEED_WINDOW / 2 > mAdvisedEnd && mAdvisedEnd < mSize) {
+    AdviseWillNeed(mAdvisedEnd);
+  }
+  return 1;
+}
+
+int
+MkvMappedFileReader::Seek(int64_t offset, int whence)
+{
+  if (mData == nullptr) {
+    return -1;
+  }
+
+  int64_t newPos = 0;
+  switch (whence) {
+  case SEEK_SET:
+    newPos = offset;
+    break;
+  case SEEK_CUR:
+    newPos = mPos + offset;
+    break;
+  case SEEK_END:
+    newPos = mSize + offset;
+    break;
+  default:
+    return -1;
+  }
+  if (newPos < 0) {
+    return -1;
+  }
+  mStats.AddSeek(mPos, newPos);
+
+  // 先読み済み範囲の外へ飛んだ場合 (Cues 読み込み、シーク) は飛び先から先読み
+  bool isOutOfAdvised = (newPos < mPos || newPos >= mAdvisedEnd);
+  mPos                = newPos;
+  if (isOutOfAdvised && mPos < mSize) {
+    AdviseWillNeed(mPos);
+  }
+  return 0;
+}
+
+int64_t
+MkvMappedFileReader::Tell() const
+{
+  return mPos;
+}
+
+int
+MkvMappedFileReader::ReadAt(int64_t offset, void *buffer, int64_t len)
+{
+  // マップ済み領域からのコピーだけなのでそのままスレッドセーフ
+  if (mData == nullptr || offset < 0 || len < 0 || offset + len > mSize) {
+    return 0;
+  }
+  int64_t begin = get_time_us();
+  memcpy(buffer, mData + offset, (size_t)len);
+  mStats.AddRead(len, get_time_us() - begin);
+  return 1;
+}
+
+int64_t
+MkvMappedFileReader::Size() const
+{
+  return mSize;
+}
+
+IMkvFileReader *
+IMkvFileReader::CreateMapped(const char *filename)
+{
+  MkvMappedFileReader *ret = new MkvMappedFileReader();
+  if (ret && ret->Open(filename)) {
+    return ret;
+  }
+  delete ret;
+  return nullptr;
+}
+
+IMkvFileReader *
+IMkvFileReader::CreateMapped(int fd, int64_t offset, int64_t length)
+{
+  MkvMappedFileReader *ret = new MkvMappedFileReader();
+  if (ret && ret->Open(fd, offset, length)) {
+    return ret;
+  }
+  delete ret;
+  return nullptr;
+}
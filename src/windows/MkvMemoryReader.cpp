@@ -0,0 +1,164 @@
+#define MYLOG_TAG "MkvMemoryReader"
+#include "BasicLog.h"
+#include "MkvFileReader.h"
+#include "CommonUtils.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+// -----------------------------------------------------------------------------
+// MkvMemoryReader
+//   host が用意したメモリ上の WebM をそのまま読む。データの所有権は持たず、
+//   コピーもしない。Read 記録を取っておき、WebmExtractor がフレームデータを
+//   元の領域から直接参照できるようにする。
+// -----------------------------------------------------------------------------
+class MkvMemoryReader : public IMkvFileReader
+{
+public:
+  MkvMemoryReader();
+  virtual ~MkvMemoryReader();
+
+  bool Open(const void *data, size_t size);
+  void Close();
+
+  virtual int Read(void *buffer, int64_t length);
+  virtual int Seek(int64_t offset, int whence);
+  virtual int64_t Tell() const;
+  virtual int ReadAt(int64_t offset, void *buffer, int64_t length);
+  virtual int64_t Size() const;
+
+  virtual void BeginReadLog() { mReadLog.Begin(); }
+  virtual void EndReadLog() { mReadLog.End(); }
+  virtual const uint8_t *FindReadSource(const void *dest, int64_t length) const
+  {
+    return mReadLog.Find(dest, length);
+  }
+
+private:
+  MkvMemoryReader(const MkvMemoryReader &);
+  MkvMemoryReader &operator=(const MkvMemoryReader &);
+
+  const uint8_t *mData;
+  int64_t mSize;
+  int64_t mPos;
+
+  MkvReadLog mReadLog;
+};
+
+MkvMemoryReader::MkvMemoryReader()
+: mData(nullptr)
+, mSize(0)
+, mPos(0)
+{}
+
+MkvMemoryReader::~MkvMemoryReader()
+{
+  Close();
+}
+
+bool
+MkvMemoryReader::Open(const void *data, size_t size)
+{
+  if (data == nullptr || size == 0) {
+    return false;
+  }
+  mData = (const uint8_t *)data;
+  mSize = (int64_t)size;
+  mPos  = 0;
+  return true;
+}
+
+void
+MkvMemoryReader::Close()
+{
+  mData = nullptr;
+  mSize = 0;
+  mPos  = 0;
+}
+
+int
+MkvMemoryReader::Read(void *buffer, int64_t len)
+{
+  if (mData == nullptr || len < 0) {
+    return 0;
+  }
+  if (mPos + len > mSize) {
+    if (mPos < mSize) {
+      memcpy(buffer, mData + mPos, (size_t)(mSize - mPos));
+      mPos = mSize;
+    }
+    return 0;
+  }
+
+  int64_t begin = get_time_us();
+  memcpy(buffer, mData + mPos, (size_t)len);
+  mStats.AddRead(len, get_time_us() - begin);
+  mReadLog.Add(buffer, mData + mPos, len);
+  mPos += len;
+  return 1;
+}
+
+int
+MkvMemoryReader::Seek(int64_t offset, int whence)
+{
+  if (mData == nullptr) {
+    return -1;
+  }
+
+  int64_t newPos = 0;
+  switch (whence) {
+  case SEEK_SET:
+    newPos = offset;
+    break;
+  case SEEK_CUR:
+    newPos = mPos + offset;
+    break;
+  case SEEK_END:
+    newPos = mSize + offset;
+    break;
+  default:
+    return -1;
+  }
+  if (newPos < 0) {
+    return -1;
+  }
+  mStats.AddSeek(mPos, newPos);
+  mPos = newPos;
+  return 0;
+}
+
+int64_t
+MkvMemoryReader::Tell() const
+{
+  return mPos;
+}
+
+int
+MkvMemoryReader::ReadAt(int64_t offset, void *buffer, int64_t len)
+{
+  if (mData == nullptr || offset < 0 || len < 0 || offset + len > mSize) {
+    return 0;
+  }
+  int64_t begin = get_time_us();
+  memcpy(buffer, mData + offset, (size_t)len);
+  mStats.AddRead(len, get_time_us() - begin);
+  return 1;
+}
+
+int64_t
+MkvMemoryReader::Size() const
+{
+  return mSize;
+}
+
+IMkvFileReader *
+IMkvFileReader::Create(const void *data, size_t size)
+{
+  MkvMemoryReader *ret = new MkvMemoryReader();
+  if (ret && ret->Open(data, size)) {
+    return ret;
+  }
+  delete ret;
+  return nullptr;
+}
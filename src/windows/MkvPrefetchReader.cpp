@@ -0,0 +1,327 @@
+#define MYLOG_TAG "MkvPrefetchReader"
+#include "BasicLog.h"
+#include "MkvFileReader.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// -----------------------------------------------------------------------------
+// MkvPrefetchReader
+//   下位 reader から現在位置以降を I/O スレッドでリングバッファに先読みしておき、
+//   nestegg (MoviePlayerCore の looper スレッド) からの Read はメモリコピーだけで
+//   済ませる。遅いディスクやネットワーク FS の待ちが表示スレッドに乗らないようにする。
+//
+//   下位 reader は I/O スレッドから ReadAt で読む (Seek 位置は持たない)。
+//   リングには [mBufBegin, mBufEnd) のファイル範囲が入っていて、
+//   先読み窓の外へ Seek された場合は世代(mGeneration)を進めて飛び先から読み直す。
+// -----------------------------------------------------------------------------
+class MkvPrefetchReader : public IMkvFileReader
+{
+public:
+  MkvPrefetchReader();
+  virtual ~MkvPrefetchReader();
+
+  bool Open(IMkvFileReader *reader, size_t windowSize);
+  void Close();
+
+  virtual int Read(void *buffer, int64_t length);
+  virtual int Seek(int64_t offset, int whence);
+  virtual int64_t Tell() const;
+  virtual int ReadAt(int64_t offset, void *buffer, int64_t length);
+  virtual int64_t Size() const;
+
+  virtual void GetStats(MkvReaderStats *stats) const;
+
+private:
+  MkvPrefetchReader(const MkvPrefetchReader &);
+  MkvPrefetchReader &operator=(const MkvPrefetchReader &);
+
+  void Restart(int64_t pos);
+  void FetchThread();
+
+  // I/O スレッドが 1 回に読む最大サイズ
+  static constexpr size_t FETCH_CHUNK_SIZE = 64 * 1024;
+
+  IMkvFileReader *mReader;
+  int64_t mSize;
+  int64_t mPos; // nestegg から見た現在位置
+
+  std::vector<uint8_t> mRing;
+  int64_t mBufBegin, mBufEnd; // リング内の有効範囲 (ファイル位置)
+  int64_t mReadableEnd;       // consumer 側で最後に確認した mBufEnd (ロック無しで読める終端)
+  uint32_t mGeneration;
+  bool mIsFetchEnd; // EOF またはエラーでこれ以上読めない
+  bool mIsQuit;
+  bool mIsFetchWaiting; // I/O スレッドがリングの空き待ち
+
+  std::thread mThread;
+  std::mutex mMutex;
+  std::condition_variable mCond;
+
+  // 統計情報
+  uint64_t mRestartCount, mWaitCount;
+};
+
+MkvPrefetchReader::MkvPrefetchReader()
+: mReader(nullptr)
+, mSize(-1)
+, mPos(0)
+, mBufBegin(0)
+, mBufEnd(0)
+, mReadableEnd(0)
+, mGeneration(0)
+, mIsFetchEnd(false)
+, mIsQuit(false)
+, mIsFetchWaiting(false)
+, mRestartCount(0)
+, mWaitCount(0)
+{}
+
+MkvPrefetchReader::~MkvPrefetchReader()
+{
+  Close();
+}
+
+bool
+MkvPrefetchReader::Open(IMkvFileReader *reader, size_t windowSize)
+{
+  if (reader == nullptr || windowSize == 0) {
+    return false;
+  }
+  mReader = reader;
+  mSize   = reader->Size();
+  mPos    = reader->Tell();
+
+  mRing.resize(std::max(windowSize, FETCH_CHUNK_SIZE));
+  mBufBegin = mBufEnd = mReadableEnd = mPos;
+
+  mThread = std::thread(&MkvPrefetchReader::FetchThread, this);
+  return true;
+}
+
+void
+MkvPrefetchReader::Close()
+{
+  if (mThread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mIsQuit = true;
+    }
+    mCond.notify_all();
+    mThread.join();
+    LOGV("prefetch: window=%zu restart=%" PRIu64 " wait=%" PRIu64 "\n", mRing.size(),
+         mRestartCount, mWaitCount);
+  }
+  if (mReader) {
+    delete mReader;
+    mReader = nullptr;
+  }
+}
+
+void
+MkvPrefetchReader::Restart(int64_t pos)
+{
+  // mMutex ロック済みで呼ぶこと
+  mBufBegin = mBufEnd = mReadableEnd = pos;
+  mIsFetchEnd = false;
+  mGeneration++;
+  mRestartCount++;
+  mCond.notify_all();
+}
+
+void
+MkvPrefetchReader::FetchThread()
+{
+  std::unique_lock<std::mutex> lock(mMutex);
+  while (!mIsQuit) {
+    size_t capacity = mRing.size();
+    size_t used     = (size_t)(mBufEnd - mBufBegin);
+    if (mIsFetchEnd || used >= capacity) {
+      mIsFetchWaiting = true;
+      mCond.wait(lock);
+      mIsFetchWaiting = false;
+      continue;
+    }
+
+    // リング末尾で折り返さない範囲だけ読む
+    int64_t pos     = mBufEnd;
+    size_t ringOffs = (size_t)(pos % (int64_t)capacity);
+    size_t length   = std::min({ capacity - used, capacity - ringOffs, FETCH_CHUNK_SIZE });
+    if (mSize >= 0) {
+      length = (size_t)std::max<int64_t>(0, std::min<int64_t>(length, mSize - pos));
+    }
+    if (length == 0) {
+      mIsFetchEnd = true;
+      mCond.notify_all();
+      continue;
+    }
+    uint32_t generation = mGeneration;
+
+    // 書き込み先 [pos, pos+length) は consumer が読まない範囲なのでロック外で読む
+    lock.unlock();
+    bool success = (mReader->ReadAt(pos, mRing.data() + ringOffs, length) == 1);
+    lock.lock();
+
+    if (generation != mGeneration) {
+      // 読んでいる間に Seek されたので捨てる
+      continue;
+    }
+    if (success) {
+      mBufEnd += length;
+    } else {
+      LOGV("prefetch read failed: pos=%" PRId64 " length=%zu\n", pos, length);
+      mIsFetchEnd = true;
+    }
+    mCond.notify_all();
+  }
+}
+
+int
+MkvPrefetchReader::Read(void *buffer, int64_t len)
+{
+  if (mReader == nullptr || len < 0) {
+    return 0;
+  }
+
+  uint8_t *dest   = (uint8_t *)buffer;
+  size_t remain   = (size_t)len;
+  size_t capacity = mRing.size();
+
+  // 確認済みの範囲内ならロック無しでコピーする。
+  // [mBufBegin, mReadableEnd) は I/O スレッドが書き換えない範囲で、
+  // mBufBegin を動かすのは consumer 側 (ロック中) だけ。
+  // 解放が遅れすぎないよう、1 チャンク読み進んだらロック側に回す。
+  if (mPos >= mBufBegin && mPos + len <= mReadableEnd &&
+      mPos - mBufBegin < (int64_t)FETCH_CHUNK_SIZE) {
+    while (remain > 0) {
+      size_t ringOffs = (size_t)(mPos % (int64_t)capacity);
+      size_t n        = std::min(remain, capacity - ringOffs);
+      memcpy(dest, mRing.data() + ringOffs, n);
+      dest += n;
+      remain -= n;
+      mPos += n;
+    }
+    return 1;
+  }
+
+  std::unique_lock<std::mutex> lock(mMutex);
+  while (remain > 0) {
+    // 先読み済み範囲から離れた位置なら飛び先から読み直し
+    // (少し先への前方スキップは先読みが追いつくのを待つ)
+    if (mPos < mBufBegin || mPos > mBufEnd + (int64_t)FETCH_CHUNK_SIZE) {
+      Restart(mPos);
+    }
+
+    if (mPos >= mBufEnd) {
+      // 飛ばした分は不要なのでリングを空けておく
+      mBufBegin = mBufEnd;
+      if (mIsFetchEnd) {
+        return 0; // EOF or error
+      }
+      mWaitCount++;
+      mCond.notify_all();
+      mCond.wait(lock);
+      continue;
+    }
+
+    size_t ringOffs = (size_t)(mPos % (int64_t)capacity);
+    size_t n        = std::min({ remain, (size_t)(mBufEnd - mPos), capacity - ringOffs });
+    memcpy(dest, mRing.data() + ringOffs, n);
+    dest += n;
+    remain -= n;
+    mPos += n;
+
+    // 読み終わった分を解放する。
+    // I/O スレッドが空き待ちなら 1 チャンク分空いた時点で起こす
+    mBufBegin     = mPos;
+    mReadableEnd  = mBufEnd;
+    if (mIsFetchWaiting && (size_t)(mBufEnd - mBufBegin) + FETCH_CHUNK_SIZE <= capacity) {
+      mCond.notify_all();
+    }
+  }
+  return 1;
+}
+
+int
+MkvPrefetchReader::Seek(int64_t offset, int whence)
+{
+  if (mReader == nullptr) {
+    return -1;
+  }
+
+  // 位置だけ更新し、リングの入れ替えは次の Read で判断する
+  std::lock_guard<std::mutex> lock(mMutex);
+  int64_t newPos = 0;
+  switch (whence) {
+  case SEEK_SET:
+    newPos = offset;
+    break;
+  case SEEK_CUR:
+    newPos = mPos + offset;
+    break;
+  case SEEK_END:
+    if (mSize < 0) {
+      return -1;
+    }
+    newPos = mSize + offset;
+    break;
+  default:
+    return -1;
+  }
+  if (newPos < 0) {
+    return -1;
+  }
+  mPos = newPos;
+  return 0;
+}
+
+int64_t
+MkvPrefetchReader::Tell() const
+{
+  return mPos;
+}
+
+int
+MkvPrefetchReader::ReadAt(int64_t offset, void *buffer, int64_t len)
+{
+  // 先読みとは独立に下位 reader から直接読む
+  if (mReader == nullptr) {
+    return 0;
+  }
+  return mReader->ReadAt(offset, buffer, len);
+}
+
+int64_t
+MkvPrefetchReader::Size() const
+{
+  return mSize;
+}
+
+void
+MkvPrefetchReader::GetStats(MkvReaderStats *stats) const
+{
+  // ストレージへの I/O は下位 reader が数える
+  if (mReader) {
+    mReader->GetStats(stats);
+  } else {
+    stats->Init();
+  }
+}
+
+IMkvFileReader *
+IMkvFileReader::CreatePrefetch(IMkvFileReader *reader, size_t windowSize)
+{
+  MkvPrefetchReader *ret = new MkvPrefetchReader();
+  if (ret && ret->Open(reader, windowSize)) {
+    return ret;
+  }
+  delete ret;
+  return nullptr;
+}
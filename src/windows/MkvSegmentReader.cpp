@@ -0,0 +1,415 @@
+#define MYLOG_TAG "MkvSegmentReader"
+#include "BasicLog.h"
+#include "MkvFileReader.h"
+#include "CommonUtils.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// -----------------------------------------------------------------------------
+// MkvSegmentReader
+//   DASH 形式の WebM (初期化セグメント + メディアセグメントのファイル群) を
+//   連結した 1 つのファイルとして読む。
+//   セグメントはファイルごと 1 回でメモリに読み込み、Read が次のセグメントに
+//   入った時点でその次のセグメントを別スレッドで読み込んでおく。
+//   メモリに持つのは初期化セグメントと現在/次のセグメントだけ。
+//   ReadAt で読み込んでいないセグメントを読む場合 (シーク位置の探索等) は
+//   ファイルから必要な範囲だけを直接読む。
+// -----------------------------------------------------------------------------
+class MkvSegmentReader : public IMkvFileReader
+{
+public:
+  MkvSegmentReader();
+  virtual ~MkvSegmentReader();
+
+  bool Open(const std::vector<std::string> &paths);
+  void Close();
+
+  virtual int Read(void *buffer, int64_t length);
+  virtual int Seek(int64_t offset, int whence);
+  virtual int64_t Tell() const;
+  virtual int ReadAt(int64_t offset, void *buffer, int64_t length);
+  virtual int64_t Size() const;
+
+  virtual size_t GetSegmentCount() const { return mSegments.size(); }
+  virtual int64_t GetSegmentOffset(size_t index) const;
+
+private:
+  MkvSegmentReader(const MkvSegmentReader &);
+  MkvSegmentReader &operator=(const MkvSegmentReader &);
+
+  typedef std::shared_ptr<std::vector<uint8_t>> SegmentData;
+
+  struct Segment
+  {
+    std::string path;
+    int64_t offset; // 連結後の先頭位置
+    int64_t size;
+    SegmentData data;
+    bool isLoading;
+  };
+
+  // hint は pos が入っていそうなセグメント (Read の現在セグメント)
+  size_t FindSegment(int64_t pos, size_t hint) const;
+  // 読み込み済みでなければ読み込む (先読み中なら待つ)
+  SegmentData GetSegment(size_t index);
+  SegmentData LoadSegment(size_t index);
+  // 現在のセグメントが変わったら次を先読みさせ、不要になったものを捨てる
+  void SetCurrent(size_t index);
+  bool ReadDirect(size_t index, int64_t offset, void *buffer, int64_t length);
+  void PrefetchThread();
+
+  std::vector<Segment> mSegments;
+  int64_t mSize;
+  int64_t mPos;
+  size_t mCurrent; // Read で最後に読んだセグメント (変更は Read のスレッドのみ)
+
+  // ReadAt 用にファイルを開いたままにしておくセグメント
+  IMkvFileReader *mDirectReader;
+  size_t mDirectIndex;
+  std::mutex mDirectMutex;
+
+  std::mutex mMutex;
+  std::condition_variable mCond;
+  std::thread mThread;
+  size_t mPrefetchIndex; // 先読み要求 (無ければ SIZE_MAX)
+  bool mIsQuit;
+
+  // 統計情報
+  uint64_t mLoadCount, mPrefetchHits;
+};
+
+MkvSegmentReader::MkvSegmentReader()
+: mSize(0)
+, mPos(0)
+, mCurrent(SIZE_MAX)
+, mDirectReader(nullptr)
+, mDirectIndex(SIZE_MAX)
+, mPrefetchIndex(SIZE_MAX)
+, mIsQuit(false)
+, mLoadCount(0)
+, mPrefetchHits(0)
+{}
+
+MkvSegmentReader::~MkvSegmentReader()
+{
+  Close();
+}
+
+bool
+MkvSegmentReader::Open(const std::vector<std::string> &paths)
+{
+  if (paths.empty()) {
+    return false;
+  }
+
+  // 開く時点ではサイズだけ調べる (読み込みは必要になってから)
+  mSize = 0;
+  for (const std::string &path : paths) {
+#ifdef _MSC_VER
+    struct _stat64 st;
+    if (_wstat64(utf8_decode(path).c_str(), &st) != 0) {
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+#endif
+      LOGE("segment not found: %s\n", path.c_str());
+      mSegments.clear();
+      return false;
+    }
+    Segment segment;
+    segment.path      = path;
+    segment.offset    = mSize;
+    segment.size      = st.st_size;
+    segment.isLoading = false;
+    mSegments.push_back(segment);
+    mSize += st.st_size;
+  }
+
+  mThread = std::thread(&MkvSegmentReader::PrefetchThread, this);
+  return true;
+}
+
+void
+MkvSegmentReader::Close()
+{
+  if (mThread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      mIsQuit = true;
+    }
+    mCond.notify_all();
+    mThread.join();
+    LOGV("segments=%zu loads=%" PRIu64 " prefetch hits=%" PRIu64 "\n", mSegments.size(),
+         mLoadCount, mPrefetchHits);
+  }
+  if (mDirectReader) {
+    delete mDirectReader;
+    mDirectReader = nullptr;
+  }
+  mSegments.clear();
+}
+
+int64_t
+MkvSegmentReader::GetSegmentOffset(size_t index) const
+{
+  return (index < mSegments.size()) ? mSegments[index].offset : -1;
+}
+
+size_t
+MkvSegmentReader::FindSegment(int64_t pos, size_t hint) const
+{
+  // 順に読んでいる間は現在のセグメントの中であることがほとんど
+  if (hint < mSegments.size()) {
+    const Segment &current = mSegments[hint];
+    if (pos >= current.offset && pos < current.offset + current.size) {
+      return hint;
+    }
+  }
+  auto it = std::upper_bound(mSegments.begin(), mSegments.end(), pos,
+                             [](int64_t p, const Segment &s) { return p < s.offset; });
+  return (size_t)(it - mSegments.begin()) - 1;
+}
+
+MkvSegmentReader::SegmentData
+MkvSegmentReader::LoadSegment(size_t index)
+{
+  const Segment &segment = mSegments[index];
+  IMkvFileReader *reader = IMkvFileReader::Create(segment.path.c_str());
+  if (reader == nullptr) {
+    LOGE("failed to open segment: %s\n", segment.path.c_str());
+    return nullptr;
+  }
+
+  int64_t begin    = get_time_us();
+  SegmentData data = std::make_shared<std::vector<uint8_t>>((size_t)segment.size);
+  bool success     = (reader->Size() == segment.size &&
+                  (segment.size == 0 || reader->ReadAt(0, data->data(), segment.size) == 1));
+  delete reader;
+  if (!success) {
+    LOGE("failed to read segment: %s\n", segment.path.c_str());
+    return nullptr;
+  }
+  mStats.AddRead(segment.size, get_time_us() - begin);
+  return data;
+}
+
+MkvSegmentReader::SegmentData
+MkvSegmentReader::GetSegment(size_t index)
+{
+  std::unique_lock<std::mutex> lock(mMutex);
+  Segment &segment = mSegments[index];
+  while (segment.isLoading) {
+    mCond.wait(lock);
+  }
+  if (segment.data) {
+    return segment.data;
+  }
+
+  segment.isLoading = true;
+  lock.unlock();
+  SegmentData data = LoadSegment(index);
+  lock.lock();
+  segment.isLoading = false;
+  segment.data      = data;
+  mLoadCount++;
+  mCond.notify_all();
+  return data;
+}
+
+void
+MkvSegmentReader::SetCurrent(size_t index)
+{
+  if (index == mCurrent) {
+    return;
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  mCurrent = index;
+  // 入った時点で先読みが済んでいれば hit (この後の GetSegment で待たずに済む)
+  if (mSegments[index].data) {
+    mPrefetchHits++;
+  }
+  for (size_t i = 1; i < mSegments.size(); i++) {
+    if (i != index && i != index + 1 && !mSegments[i].isLoading) {
+      mSegments[i].data.reset();
+    }
+  }
+  if (index + 1 < mSegments.size() && !mSegments[index + 1].data) {
+    mPrefetchIndex = index + 1;
+    mCond.notify_all();
+  }
+}
+
+void
+MkvSegmentReader::PrefetchThread()
+{
+  std::unique_lock<std::mutex> lock(mMutex);
+  while (true) {
+    mCond.wait(lock, [this] { return mIsQuit || mPrefetchIndex != SIZE_MAX; });
+    if (mIsQuit) {
+      break;
+    }
+    size_t index     = mPrefetchIndex;
+    mPrefetchIndex   = SIZE_MAX;
+    Segment &segment = mSegments[index];
+    if (segment.data || segment.isLoading) {
+      continue;
+    }
+
+    segment.isLoading = true;
+    lock.unlock();
+    SegmentData data = LoadSegment(index);
+    lock.lock();
+    segment.isLoading = false;
+    // 読んでいる間に現在位置が離れていたら捨てる
+    if (index == mCurrent || index == mCurrent + 1) {
+      segment.data = data;
+    }
+    mLoadCount++;
+    mCond.notify_all();
+  }
+}
+
+bool
+MkvSegmentReader::ReadDirect(size_t index, int64_t offset, void *buffer, int64_t length)
+{
+  std::lock_guard<std::mutex> lock(mDirectMutex);
+  if (mDirectIndex != index) {
+    delete mDirectReader;
+    mDirectReader = IMkvFileReader::Create(mSegments[index].path.c_str());
+    mDirectIndex  = index;
+  }
+  if (mDirectReader == nullptr) {
+    return false;
+  }
+  int64_t begin = get_time_us();
+  bool success  = (mDirectReader->ReadAt(offset, buffer, length) == 1);
+  mStats.AddRead(length, get_time_us() - begin);
+  return success;
+}
+
+int
+MkvSegmentReader::Read(void *buffer, int64_t len)
+{
+  if (mSegments.empty() || len < 0) {
+    return 0;
+  }
+
+  uint8_t *dest = (uint8_t *)buffer;
+  while (len > 0) {
+    if (mPos >= mSize) {
+      return 0;
+    }
+    size_t index = FindSegment(mPos, mCurrent);
+    SetCurrent(index);
+    SegmentData data = GetSegment(index);
+    if (!data) {
+      return 0;
+    }
+
+    const Segment &segment = mSegments[index];
+    size_t offset          = (size_t)(mPos - segment.offset);
+    size_t n               = (size_t)std::min<int64_t>(len, segment.size - offset);
+    memcpy(dest, data->data() + offset, n);
+    dest += n;
+    len -= n;
+    mPos += n;
+  }
+  return 1;
+}
+
+int
+MkvSegmentReader::Seek(int64_t offset, int whence)
+{
+  if (mSegments.empty()) {
+    return -1;
+  }
+
+  int64_t newPos = 0;
+  switch (whence) {
+  case SEEK_SET:
+    newPos = offset;
+    break;
+  case SEEK_CUR:
+    newPos = mPos + offset;
+    break;
+  case SEEK_END:
+    newPos = mSize + offset;
+    break;
+  default:
+    return -1;
+  }
+  if (newPos < 0) {
+    return -1;
+  }
+  mStats.AddSeek(mPos, newPos);
+  mPos = newPos;
+  return 0;
+}
+
+int64_t
+MkvSegmentReader::Tell() const
+{
+  return mPos;
+}
+
+int
+MkvSegmentReader::ReadAt(int64_t offset, void *buffer, int64_t len)
+{
+  if (mSegments.empty() || offset < 0 || len < 0 || offset + len > mSize) {
+    return 0;
+  }
+
+  uint8_t *dest = (uint8_t *)buffer;
+  while (len > 0) {
+    size_t index           = FindSegment(offset, SIZE_MAX);
+    const Segment &segment = mSegments[index];
+    int64_t segmentOffset  = offset - segment.offset;
+    int64_t n              = std::min<int64_t>(len, segment.size - segmentOffset);
+
+    // メモリにあればそこから、無ければファイルから直接読む
+    SegmentData data;
+    {
+      std::lock_guard<std::mutex> lock(mMutex);
+      data = segment.data;
+    }
+    if (data) {
+      memcpy(dest, data->data() + segmentOffset, (size_t)n);
+    } else if (!ReadDirect(index, segmentOffset, dest, n)) {
+      return 0;
+    }
+    dest += n;
+    len -= n;
+    offset += n;
+  }
+  return 1;
+}
+
+int64_t
+MkvSegmentReader::Size() const
+{
+  return mSize;
+}
+
+IMkvFileReader *
+IMkvFileReader::CreateSegmented(const std::vector<std::string> &paths)
+{
+  MkvSegmentReader *ret = new MkvSegmentReader();
+  if (ret && ret->Open(paths)) {
+    return ret;
+  }
+  delete ret;
+  return nullptr;
+}
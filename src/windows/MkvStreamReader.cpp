@@ -2,32 +2,71 @@
 #include "BasicLog.h"
 #include "MkvFileReader.h"
 #include "IMoviePlayer.h"
+#include "CommonUtils.h"
 
+#include <algorithm>
+#include <cinttypes>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <vector>
 
+// -----------------------------------------------------------------------------
+// MkvIStreamReader
+//   nestegg からの Read は EBML ID/サイズなど 1～8 byte の細かいものが大半なので、
+//   host の IMovieReadStream を直接叩くと host 側の呼び出しコスト(ロック等)が
+//   そのまま効いてくる。bufferSize > 0 の場合はブロック単位でまとめ読みして
+//   小さな Read はバッファから返し、バッファ内に収まる Seek は host に流さない。
+//   host stream が IMovieReadStream2 なら ReadAt で読み、Seek は一切流さない。
+// -----------------------------------------------------------------------------
 class MkvIStreamReader : public IMkvFileReader
 {
 public:
   MkvIStreamReader();
   virtual ~MkvIStreamReader();
 
-  bool Open(IMovieReadStream *stream);
+  bool Open(IMovieReadStream *stream, size_t bufferSize);
   void Close();
 
   virtual int Read(void *buffer, int64_t length);
   virtual int Seek(int64_t offset, int whence);
   virtual int64_t Tell() const;
+  virtual int ReadAt(int64_t offset, void *buffer, int64_t length);
+  virtual int64_t Size() const;
 
 private:
   MkvIStreamReader(const MkvIStreamReader &);
   MkvIStreamReader &operator=(const MkvIStreamReader &);
 
+  size_t ReadFromStream(void *buffer, size_t length);
+
   IMovieReadStream *mStream;
+  IMovieReadStream2 *mStream2; // ReadAt 対応 stream なら非 null
+
+  // ReadAt 非対応 stream の Seek+Read を他スレッドからの ReadAt と排他する
+  std::mutex mStreamMutex;
+
+  // 読み込みバッファ (mBuffer が空ならバッファ無しで直接読む)
+  std::vector<uint8_t> mBuffer;
+  int64_t mBufferPos;  // mBuffer[0] のストリーム上の位置
+  size_t mBufferSize;  // mBuffer 内の有効データサイズ
+  int64_t mPos;        // nestegg から見た現在位置
+  int64_t mStreamPos;  // host stream の実際の現在位置
+
+  // nestegg からの呼び出し回数 (host への呼び出しは mStats)
+  uint64_t mReadCalls, mSeekCalls;
 };
 
 MkvIStreamReader::MkvIStreamReader()
 : mStream(nullptr)
+, mStream2(nullptr)
+, mBufferPos(0)
+, mBufferSize(0)
+, mPos(0)
+, mStreamPos(0)
+, mReadCalls(0)
+, mSeekCalls(0)
 {}
 
 MkvIStreamReader::~MkvIStreamReader()
@@ -36,13 +75,19 @@ MkvIStreamReader::~MkvIStreamReader()
 }
 
 bool
-MkvIStreamReader::Open(IMovieReadStream *stream)
+MkvIStreamReader::Open(IMovieReadStream *stream, size_t bufferSize)
 {
   if (stream == nullptr) {
     return false;
   }
   mStream = stream;
   mStream->AddRef();
+  mStream2 = dynamic_cast<IMovieReadStream2 *>(stream);
+
+  mBuffer.resize(bufferSize);
+  mBufferPos  = 0;
+  mBufferSize = 0;
+  mPos = mStreamPos = mStream->Tell();
   return true;
 }
 
@@ -51,19 +96,86 @@ void
 MkvIStreamReader::Close()
 {
   if (mStream) {
+    if (!mBuffer.empty()) {
+      MkvReaderStats stats;
+      mStats.Get(&stats);
+      LOGV("buffered stream: read=%" PRIu64 " (host %" PRIu64 "), seek=%" PRIu64
+           " (host %" PRIu64 "), avoided host calls=%" PRIu64 "\n",
+           mReadCalls, stats.readCalls, mSeekCalls, stats.seekCalls,
+           (mReadCalls + mSeekCalls) - (stats.readCalls + stats.seekCalls));
+    }
     mStream->Release();
-    mStream = nullptr;
+    mStream  = nullptr;
+    mStream2 = nullptr;
   }
 }
 
+size_t
+MkvIStreamReader::ReadFromStream(void *buffer, size_t length)
+{
+  int64_t begin = get_time_us();
+  if (mStream2) {
+    size_t readed = mStream2->ReadAt(mPos, buffer, length);
+    mStats.AddRead(readed, get_time_us() - begin);
+    return readed;
+  }
+
+  // host stream の位置合わせは実際に読む直前まで遅延させる
+  std::lock_guard<std::mutex> lock(mStreamMutex);
+  if (mStreamPos != mPos) {
+    mStream->Seek(mPos, SEEK_SET);
+    mStats.AddSeek(mStreamPos, mPos);
+    mStreamPos = mPos;
+  }
+  size_t readed = mStream->Read(buffer, length);
+  mStreamPos += readed;
+  mStats.AddRead(readed, get_time_us() - begin);
+  return readed;
+}
+
 int
 MkvIStreamReader::Read(void *buffer, int64_t len)
 {
   if (mStream == NULL) {
     return 0;
   }
-  size_t readed = mStream->Read(buffer, static_cast<size_t>(len));
-  return (readed == static_cast<size_t>(len));
+  mReadCalls++;
+
+  if (mBuffer.empty()) {
+    size_t readed = ReadFromStream(buffer, static_cast<size_t>(len));
+    mPos += readed;
+    return (readed == static_cast<size_t>(len));
+  }
+
+  uint8_t *dest = (uint8_t *)buffer;
+  size_t remain = static_cast<size_t>(len);
+  while (remain > 0) {
+    // バッファに載っている分を返す
+    if (mBufferPos <= mPos && mPos < mBufferPos + (int64_t)mBufferSize) {
+      size_t offset = (size_t)(mPos - mBufferPos);
+      size_t n      = std::min(remain, mBufferSize - offset);
+      memcpy(dest, mBuffer.data() + offset, n);
+      dest += n;
+      remain -= n;
+      mPos += n;
+      continue;
+    }
+
+    // バッファより大きい読み込みはバッファを経由せず直接読む
+    if (remain >= mBuffer.size()) {
+      size_t readed = ReadFromStream(dest, remain);
+      mPos += readed;
+      return (readed == remain);
+    }
+
+    // バッファを詰め直す
+    mBufferPos  = mPos;
+    mBufferSize = ReadFromStream(mBuffer.data(), mBuffer.size());
+    if (mBufferSize == 0) {
+      return 0; // EOS
+    }
+  }
+  return 1;
 }
 
 int 
@@ -72,7 +184,31 @@ MkvIStreamReader::Seek(int64_t offset, int whence)
   if (mStream == NULL) {
     return -1;
   }
-  mStream->Seek(offset, whence);
+  mSeekCalls++;
+
+  if (mBuffer.empty() && mStream2 == nullptr) {
+    std::lock_guard<std::mutex> lock(mStreamMutex);
+    mStream->Seek(offset, whence);
+    int64_t from = mStreamPos;
+    mPos = mStreamPos = mStream->Tell();
+    mStats.AddSeek(from, mStreamPos);
+    return 0;
+  }
+
+  // 位置だけ更新しておき、host stream への Seek は次にバッファ外を読むときに行う
+  switch (whence) {
+  case SEEK_SET:
+    mPos = offset;
+    break;
+  case SEEK_CUR:
+    mPos += offset;
+    break;
+  case SEEK_END:
+    mPos = (int64_t)mStream->Size() + offset;
+    break;
+  default:
+    return -1;
+  }
   return 0;
 }
 
@@ -82,13 +218,46 @@ MkvIStreamReader::Tell() const
   if (mStream == NULL) {
     return 0;
   }
-  return mStream->Tell();
+  return mPos;
+}
+
+int
+MkvIStreamReader::ReadAt(int64_t offset, void *buffer, int64_t len)
+{
+  if (mStream == NULL || offset < 0 || len < 0) {
+    return 0;
+  }
+  int64_t begin = get_time_us();
+  if (mStream2) {
+    size_t readed = mStream2->ReadAt(offset, buffer, (size_t)len);
+    mStats.AddRead(readed, get_time_us() - begin);
+    return (readed == (size_t)len);
+  }
+
+  // ReadAt 非対応の stream は Seek+Read を排他して代用する。
+  // host stream の位置が変わるので、次の通常 Read で位置合わせし直される
+  std::lock_guard<std::mutex> lock(mStreamMutex);
+  mStream->Seek(offset, SEEK_SET);
+  mStats.AddSeek(mStreamPos, offset);
+  size_t readed = mStream->Read(buffer, (size_t)len);
+  mStreamPos    = offset + readed;
+  mStats.AddRead(readed, get_time_us() - begin);
+  return (readed == (size_t)len);
+}
+
+int64_t
+MkvIStreamReader::Size() const
+{
+  if (mStream == NULL) {
+    return -1;
+  }
+  return (int64_t)mStream->Size();
 }
 
-IMkvFileReader *IMkvFileReader::Create(IMovieReadStream *stream)
+IMkvFileReader *IMkvFileReader::Create(IMovieReadStream *stream, size_t bufferSize)
 {
   MkvIStreamReader *ret = new MkvIStreamReader();
-  if (ret && ret->Open(stream)) {
+  if (ret && ret->Open(stream, bufferSize)) {
     return ret;
   }
   delete ret;
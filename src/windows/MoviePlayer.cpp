@@ -6,6 +6,7 @@
 
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 
 static inline PixelFormat
 conv_color_format(IMoviePlayer::ColorFormat colorFormat)
@@ -83,6 +84,60 @@ conv_pixel_format(PixelFormat pixelFormat)
   return colorFormat;
 }
 
+static inline const char *
+conv_codec_name(CodecId codecId)
+{
+  switch (codecId) {
+  case CODEC_V_VP8:
+    return "vp8";
+  case CODEC_V_VP9:
+    return "vp9";
+  case CODEC_V_AV1:
+    return "av1";
+  case CODEC_A_VORBIS:
+    return "vorbis";
+  case CODEC_A_OPUS:
+    return "opus";
+  default:
+    return nullptr;
+  }
+}
+
+static inline WebmExtractor::Config
+conv_extractor_config(const IMoviePlayer::InitParam &param)
+{
+  WebmExtractor::Config config;
+  config.Init();
+  config.streamBufferSize   = param.streamBufferSize;
+  config.prefetchSize       = param.prefetchSize;
+  config.prefetchSeconds    = param.prefetchSeconds;
+  config.loopCacheSize      = param.loopCacheSize;
+  config.maxClusterReadSize = param.maxClusterReadSize;
+  config.streamForwardOnly  = param.streamForwardOnly;
+  config.followFile         = param.followFile;
+  config.followLatencyMs    = param.followLatencyMs;
+  config.followTimeoutMs    = param.followTimeoutMs;
+  config.memoryMappedFile   = param.memoryMappedFile;
+  config.contentKeyCallback = param.contentKeyCallback;
+  return config;
+}
+
+static inline MoviePlayerCore::Config
+conv_player_config(const IMoviePlayer::InitParam &param)
+{
+  MoviePlayerCore::Config config;
+  config.Init();
+  config.demuxThread   = param.demuxThread;
+  config.demuxPerTrack = param.demuxPerTrack;
+
+  config.videoQueue.slots       = param.videoDecodeQueueSize;
+  config.videoQueue.outputBytes = param.videoDecodeQueueBytes;
+  config.videoQueue.adaptive    = param.adaptiveDecodeQueue;
+  config.audioQueue.slots       = param.audioDecodeQueueSize;
+  config.audioQueue.outputBytes = param.audioDecodeQueueBytes;
+  return config;
+}
+
 // -----------------------------------------------------------------------------
 // MoviePlayer
 // -----------------------------------------------------------------------------
@@ -116,7 +171,8 @@ bool
 MoviePlayer::Open(const char *filepath)
 {
   mPlayer = new MoviePlayerCore(conv_color_format(mInitParam.videoColorFormat),
-                                mInitParam.audioSink);
+                                mInitParam.audioSink, conv_player_config(mInitParam),
+                                conv_extractor_config(mInitParam));
   return mPlayer->Open(filepath);
 }
 
@@ -124,10 +180,38 @@ bool
 MoviePlayer::Open(IMovieReadStream *stream)
 {
   mPlayer = new MoviePlayerCore(conv_color_format(mInitParam.videoColorFormat),
-                                mInitParam.audioSink);
+                                mInitParam.audioSink, conv_player_config(mInitParam),
+                                conv_extractor_config(mInitParam));
   return mPlayer->Open(stream);
 }
 
+bool
+MoviePlayer::Open(const void *data, size_t size)
+{
+  mPlayer = new MoviePlayerCore(conv_color_format(mInitParam.videoColorFormat),
+                                mInitParam.audioSink, conv_player_config(mInitParam),
+                                conv_extractor_config(mInitParam));
+  return mPlayer->Open(data, size);
+}
+
+bool
+MoviePlayer::Open(int fd, int64_t offset, int64_t length)
+{
+  mPlayer = new MoviePlayerCore(conv_color_format(mInitParam.videoColorFormat),
+                                mInitParam.audioSink, conv_player_config(mInitParam),
+                                conv_extractor_config(mInitParam));
+  return mPlayer->Open(fd, offset, length);
+}
+
+bool
+MoviePlayer::Open(const std::vector<std::string> &segmentPaths)
+{
+  mPlayer = new MoviePlayerCore(conv_color_format(mInitParam.videoColorFormat),
+                                mInitParam.audioSink, conv_player_config(mInitParam),
+                                conv_extractor_config(mInitParam));
+  return mPlayer->Open(segmentPaths);
+}
+
 IMoviePlayer::State 
 MoviePlayer::GetState() const
 {
@@ -259,6 +343,60 @@ MoviePlayer::GetAudioFormat(AudioFormat *format) const
   }
 }
 
+int32_t
+MoviePlayer::GetAudioTrackCount() const
+{
+  if (mPlayer) {
+    return mPlayer->AudioTrackCount();
+  } else {
+    return 0;
+  }
+}
+
+bool
+MoviePlayer::GetAudioTrackInfo(int32_t index, AudioTrackInfo *info) const
+{
+  TrackInfo track;
+  if (!mPlayer || info == nullptr || !mPlayer->GetAudioTrackInfo(index, &track)) {
+    return false;
+  }
+  info->trackIndex = track.index;
+  info->codec      = conv_codec_name(track.codecId);
+  info->sampleRate = (int32_t)track.a.sampleRate;
+  info->channels   = track.a.channels;
+  return true;
+}
+
+int32_t
+MoviePlayer::GetAudioTrack() const
+{
+  if (mPlayer) {
+    return mPlayer->AudioTrack();
+  } else {
+    return -1;
+  }
+}
+
+bool
+MoviePlayer::SelectAudioTrack(int32_t index)
+{
+  if (mPlayer) {
+    return mPlayer->SelectAudioTrack(index);
+  } else {
+    return false;
+  }
+}
+
+bool
+MoviePlayer::SetAudioEnabled(bool enabled)
+{
+  if (mPlayer) {
+    return mPlayer->SetAudioEnabled(enabled);
+  } else {
+    return false;
+  }
+}
+
 void
 MoviePlayer::SetVolume(float volume)
 {
@@ -317,6 +455,38 @@ MoviePlayer::Loop() const
   }
 }
 
+bool
+MoviePlayer::IsSeekable() const
+{
+  if (mPlayer) {
+    return mPlayer->IsSeekable();
+  } else {
+    return false;
+  }
+}
+
+void
+MoviePlayer::GetIOStats(IOStats *stats) const
+{
+  MkvReaderStats demux, storage;
+  if (mPlayer) {
+    mPlayer->GetIOStats(&demux, &storage);
+  } else {
+    demux.Init();
+    storage.Init();
+  }
+  stats->readCalls            = demux.readCalls;
+  stats->readBytes            = demux.readBytes;
+  stats->seekCalls            = demux.seekCalls;
+  stats->backwardSeeks        = demux.backwardSeeks;
+  stats->blockedUs            = demux.readUs;
+  stats->storageReadCalls     = storage.readCalls;
+  stats->storageReadBytes     = storage.readBytes;
+  stats->storageSeekCalls     = storage.seekCalls;
+  stats->storageBackwardSeeks = storage.backwardSeeks;
+  stats->storageReadUs        = storage.readUs;
+}
+
 void
 MoviePlayer::SetOnState(OnState func, void *userPtr)
 {
@@ -429,3 +599,111 @@ IMoviePlayer::CreateMoviePlayer(IMovieReadStream *stream, InitParam &param)
   delete player;
   return nullptr;
 }
+
+IMoviePlayer *
+IMoviePlayer::CreateMoviePlayer(const void *data, size_t size, InitParam &param)
+{
+  MoviePlayer *player = new MoviePlayer(param);
+  if (player->Open(data, size)) {
+    return player;
+  }
+  delete player;
+  return nullptr;
+}
+
+IMoviePlayer *
+IMoviePlayer::CreateMoviePlayer(int fd, int64_t offset, int64_t length, InitParam &param)
+{
+  MoviePlayer *player = new MoviePlayer(param);
+  if (player->Open(fd, offset, length)) {
+    return player;
+  }
+  delete player;
+  return nullptr;
+}
+
+IMoviePlayer *
+IMoviePlayer::CreateSegmentedMoviePlayer(const char *const *segmentPaths, size_t segmentCount,
+                                         InitParam &param)
+{
+  if (segmentPaths == nullptr || segmentCount == 0) {
+    return nullptr;
+  }
+  std::vector<std::string> paths(segmentPaths, segmentPaths + segmentCount);
+  MoviePlayer *player = new MoviePlayer(param);
+  if (player->Open(paths)) {
+    return player;
+  }
+  delete player;
+  return nullptr;
+}
+
+// MoviePlayerCore::SelectTargetTrack と同じトラックを選んで情報を詰める
+static bool
+probe_extractor(WebmExtractor &extractor, IMoviePlayer::ProbeInfo *info)
+{
+  info->hasVideo   = false;
+  info->videoCodec = nullptr;
+  info->hasAudio   = false;
+  info->audioCodec = nullptr;
+  info->durationUs = (int64_t)extractor.GetDurationUs();
+  memset(&info->video, 0, sizeof(info->video));
+  memset(&info->audio, 0, sizeof(info->audio));
+  info->video.colorFormat = IMoviePlayer::COLOR_UNKNOWN;
+  info->audio.encoding    = IMoviePlayer::PCM_UNKNOWN;
+
+  size_t trackNum = extractor.GetTrackCount();
+  for (size_t i = 0; i < trackNum; i++) {
+    TrackInfo track;
+    if (!extractor.GetTrackInfo(i, &track) || track.codecId == CODEC_UNKNOWN) {
+      continue;
+    }
+    if (track.type == TRACK_TYPE_VIDEO && !info->hasVideo) {
+      info->hasVideo        = true;
+      info->videoCodec      = conv_codec_name(track.codecId);
+      info->video.width     = track.v.width;
+      info->video.height    = track.v.height;
+      info->video.frameRate = track.v.frameRate;
+    } else if (track.type == TRACK_TYPE_AUDIO && !info->hasAudio) {
+      // 出力は S16 固定 (AudioDecoder::Encoding)
+      info->hasAudio            = true;
+      info->audioCodec          = conv_codec_name(track.codecId);
+      info->audio.sampleRate    = (int32_t)track.a.sampleRate;
+      info->audio.channels      = track.a.channels;
+      info->audio.bitsPerSample = 16;
+      info->audio.encoding      = IMoviePlayer::PCM_S16;
+    }
+  }
+  return true;
+}
+
+static WebmExtractor::Config
+probe_config()
+{
+  WebmExtractor::Config config;
+  config.Init();
+  config.metadataOnly = true;
+  // ヘッダの読み込みで余分に読まないよう、stream のまとめ読みは小さくする
+  config.streamBufferSize = 16 * 1024;
+  return config;
+}
+
+bool
+IMoviePlayer::Probe(const char *filename, ProbeInfo *info)
+{
+  if (filename == nullptr || info == nullptr) {
+    return false;
+  }
+  WebmExtractor extractor(probe_config());
+  return extractor.Open(std::string(filename)) && probe_extractor(extractor, info);
+}
+
+bool
+IMoviePlayer::Probe(IMovieReadStream *stream, ProbeInfo *info)
+{
+  if (stream == nullptr || info == nullptr) {
+    return false;
+  }
+  WebmExtractor extractor(probe_config());
+  return extractor.Open(stream) && probe_extractor(extractor, info);
+}
@@ -3,6 +3,8 @@
 #include <IMoviePlayer.h>
 
 #include <cstdint>
+#include <string>
+#include <vector>
 
 // ムービープレイヤー実装クラス
 class MoviePlayer : public IMoviePlayer
@@ -13,6 +15,9 @@ public:
 
   bool Open(const char *filepath);
   bool Open(IMovieReadStream *stream);
+  bool Open(const void *data, size_t size);
+  bool Open(int fd, int64_t offset, int64_t length);
+  bool Open(const std::vector<std::string> &segmentPaths);
 
   virtual State GetState() const override;
 
@@ -30,6 +35,11 @@ public:
   // audio info
   virtual bool IsAudioAvailable() const override;
   virtual void GetAudioFormat(AudioFormat *format) const override;
+  virtual int32_t GetAudioTrackCount() const override;
+  virtual bool GetAudioTrackInfo(int32_t index, AudioTrackInfo *info) const override;
+  virtual int32_t GetAudioTrack() const override;
+  virtual bool SelectAudioTrack(int32_t index) override;
+  virtual bool SetAudioEnabled(bool enabled) override;
 
   virtual void SetVolume(float volume) override;
   virtual float Volume() const override;
@@ -39,6 +49,8 @@ public:
   virtual int64_t Position() const override;
   virtual bool IsPlaying() const override;
   virtual bool Loop() const override;
+  virtual bool IsSeekable() const override;
+  virtual void GetIOStats(IOStats *stats) const override;
 
   virtual void SetOnState(OnState func, void *userPtr);
 
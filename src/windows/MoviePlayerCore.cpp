@@ -5,8 +5,22 @@
 #include "IAudioSink.h"
 #include "IMoviePlayer.h"
 
-MoviePlayerCore::MoviePlayerCore(PixelFormat pixelFormat, IAudioSink *audioSink)
+void
+MoviePlayerCore::Config::Init()
+{
+  demuxThread   = true;
+  demuxPerTrack = false;
+  demuxer.Init();
+  videoQueue.Init();
+  audioQueue.Init();
+}
+
+MoviePlayerCore::MoviePlayerCore(PixelFormat pixelFormat, IAudioSink *audioSink,
+                                 const Config &config,
+                                 const WebmExtractor::Config &extractorConfig)
 : mState(STATE_UNINIT)
+, mConfig(config)
+, mExtractorConfig(extractorConfig)
 , mPixelFormat(pixelFormat)
 , mAudioSink(audioSink)
 , mOnStateFunc(nullptr)
@@ -37,9 +51,16 @@ MoviePlayerCore::Init()
 
   mIsLoop = false;
 
-  mExtractor    = nullptr;
-  mVideoDecoder = nullptr;
-  mAudioDecoder = nullptr;
+  mExtractor       = nullptr;
+  mAudioExtractor  = nullptr;
+  mDemuxer         = nullptr;
+  mVideoDecoder    = nullptr;
+  mAudioDecoder    = nullptr;
+  mVideoTrackIndex = -1;
+  mAudioTrackIndex = -1;
+  mIsAudioAvailable = false;
+  mAudioTracks.clear();
+  mAudioTrack = -1;
 
   mClock.Reset();
 
@@ -90,7 +111,19 @@ MoviePlayerCore::Done()
   if (mAudioDecoder) {
     mAudioDecoder->Stop();
     delete mAudioDecoder;
-    mAudioDecoder = nullptr;
+    mAudioDecoder     = nullptr;
+    mIsAudioAvailable = false;
+  }
+
+  // デマックススレッドは extractor より先に止める (extractor を参照している)
+  if (mDemuxer) {
+    delete mDemuxer;
+    mDemuxer = nullptr;
+  }
+
+  if (mAudioExtractor) {
+    delete mAudioExtractor;
+    mAudioExtractor = nullptr;
   }
 
   if (mExtractor) {
@@ -113,6 +146,12 @@ MoviePlayerCore::Start()
     mAudioDecoder->Start();
   }
 
+  if (mConfig.demuxThread) {
+    mDemuxer = new PacketDemuxer(mExtractor, mAudioExtractor, mConfig.demuxer,
+                                 IsVideoAvailable(), IsAudioAvailable());
+    mDemuxer->Start();
+  }
+
   StartThread();
 }
 
@@ -154,6 +193,10 @@ MoviePlayerCore::Resume()
 void
 MoviePlayerCore::Seek(int64_t posUs)
 {
+  if (!IsSeekable()) {
+    LOGE("seek is not supported: %" PRId64 "us\n", posUs);
+    return;
+  }
   if (IsRunning()) {
     Post(MoviePlayerCore::MSG_SEEK, posUs);
   }
@@ -208,12 +251,15 @@ MoviePlayerCore::OutputPixelFormat() const
 bool
 MoviePlayerCore::IsAudioAvailable() const
 {
-  return (mAudioDecoder != nullptr);
+  return mIsAudioAvailable;
 }
 
 int32_t
 MoviePlayerCore::SampleRate() const
 {
+  // オーディオデコーダはトラックの切り替えで作り直される
+  std::lock_guard<std::mutex> lock(mApiMutex);
+
   if (IsAudioAvailable()) {
     return mAudioDecoder->SampleRate();
   } else {
@@ -224,6 +270,8 @@ MoviePlayerCore::SampleRate() const
 int32_t
 MoviePlayerCore::Channels() const
 {
+  std::lock_guard<std::mutex> lock(mApiMutex);
+
   if (IsAudioAvailable()) {
     return mAudioDecoder->Channels();
   } else {
@@ -234,6 +282,8 @@ MoviePlayerCore::Channels() const
 int32_t
 MoviePlayerCore::BitsPerSample() const
 {
+  std::lock_guard<std::mutex> lock(mApiMutex);
+
   if (IsAudioAvailable()) {
     return mAudioDecoder->BitsPerSample();
   } else {
@@ -244,6 +294,8 @@ MoviePlayerCore::BitsPerSample() const
 int32_t
 MoviePlayerCore::Encoding() const
 {
+  std::lock_guard<std::mutex> lock(mApiMutex);
+
   if (IsAudioAvailable()) {
     return mAudioDecoder->Encoding();
   } else {
@@ -251,6 +303,84 @@ MoviePlayerCore::Encoding() const
   }
 }
 
+int32_t
+MoviePlayerCore::AudioTrackCount() const
+{
+  std::lock_guard<std::mutex> lock(mApiMutex);
+
+  return (int32_t)mAudioTracks.size();
+}
+
+bool
+MoviePlayerCore::GetAudioTrackInfo(int32_t index, TrackInfo *info) const
+{
+  std::lock_guard<std::mutex> lock(mApiMutex);
+
+  if (index < 0 || index >= (int32_t)mAudioTracks.size()) {
+    return false;
+  }
+  *info = mAudioTracks[index].info;
+  return true;
+}
+
+int32_t
+MoviePlayerCore::AudioTrack() const
+{
+  std::lock_guard<std::mutex> lock(mApiMutex);
+
+  return mAudioTrack;
+}
+
+bool
+MoviePlayerCore::SelectAudioTrack(int32_t index)
+{
+  std::lock_guard<std::mutex> lock(mApiMutex);
+
+  if (index < 0 || index >= (int32_t)mAudioTracks.size() || mAudioTrack < 0) {
+    LOGE("invalid audio track: %d\n", index);
+    return false;
+  }
+  if (index == mAudioTrack) {
+    return true;
+  }
+  if (!IsSeekable()) {
+    LOGE("audio track switch is not supported: stream is not seekable\n");
+    return false;
+  }
+  const TrackInfo &current = mAudioTracks[mAudioTrack].info;
+  const TrackInfo &target  = mAudioTracks[index].info;
+  if (current.a.channels != target.a.channels || current.a.sampleRate != target.a.sampleRate) {
+    LOGE("audio track switch is not supported: format differs (%dch %fHz -> %dch %fHz)\n",
+         current.a.channels, current.a.sampleRate, target.a.channels, target.a.sampleRate);
+    return false;
+  }
+  if (!IsRunning()) {
+    return false;
+  }
+  Post(MoviePlayerCore::MSG_SELECT_AUDIO, index);
+  return true;
+}
+
+bool
+MoviePlayerCore::SetAudioEnabled(bool enabled)
+{
+  std::lock_guard<std::mutex> lock(mApiMutex);
+
+  if (mAudioTrack < 0) {
+    // sink が無い (Setup に失敗した) 場合はオーディオを読んでいない
+    return !enabled;
+  }
+  if (enabled && !IsAudioAvailable() && !IsSeekable()) {
+    LOGE("audio cannot be enabled: stream is not seekable\n");
+    return false;
+  }
+  if (!IsRunning()) {
+    return false;
+  }
+  Post(MoviePlayerCore::MSG_SET_AUDIO_ENABLED, enabled ? 1 : 0);
+  return true;
+}
+
 int64_t
 MoviePlayerCore::Duration() const
 {
@@ -267,6 +397,25 @@ MoviePlayerCore::Position() const
   return mClock.GetPresentationTime();
 }
 
+void
+MoviePlayerCore::GetIOStats(MkvReaderStats *demux, MkvReaderStats *storage) const
+{
+  std::lock_guard<std::mutex> lock(mApiMutex);
+
+  if (mExtractor) {
+    mExtractor->GetIOStats(demux, storage);
+    if (mAudioExtractor) {
+      MkvReaderStats audioDemux, audioStorage;
+      mAudioExtractor->GetIOStats(&audioDemux, &audioStorage);
+      demux->Add(audioDemux);
+      storage->Add(audioStorage);
+    }
+  } else {
+    demux->Init();
+    storage->Init();
+  }
+}
+
 bool
 MoviePlayerCore::IsPlaying() const
 {
@@ -283,6 +432,13 @@ MoviePlayerCore::Loop() const
   return mIsLoop;
 }
 
+bool
+MoviePlayerCore::IsSeekable() const
+{
+  // 前方読みのみかどうかは Open 時に決まり、以降は変わらない
+  return (mExtractor && mExtractor->IsSeekable());
+}
+
 void
 MoviePlayerCore::SelectTargetTrack()
 {
@@ -317,6 +473,7 @@ MoviePlayerCore::SelectTargetTrack()
 
       mVideoDecoder = (VideoDecoder *)Decoder::CreateDecoder(info.codecId);
       ASSERT(mVideoDecoder != nullptr, "failed to create video decoder\n");
+      mVideoDecoder->ConfigureQueues(mConfig.videoQueue);
 
       InitDummyFrame();
 
@@ -337,6 +494,7 @@ MoviePlayerCore::SelectTargetTrack()
       }
 
       mExtractor->SelectTrack(TRACK_TYPE_VIDEO, i);
+      mVideoTrackIndex = (int32_t)i;
 
       if (mVideoDecoder) {
         LOGV(" VIDEO: codec=%s, width=%d, height=%d, fps=%f\n",
@@ -345,32 +503,25 @@ MoviePlayerCore::SelectTargetTrack()
 
     } break;
     case TRACK_TYPE_AUDIO: {
-      if (mAudioDecoder != nullptr) {
-        // 複数オーディオトラックの場合は最初のトラックのみ対象とする
-        continue;
-      }
-
       if (info.codecId == CODEC_UNKNOWN) {
         LOGV("unsupported audio codec! skip this track: index=%d\n", (int)i);
         continue;
       }
 
-      mAudioDecoder = (AudioDecoder *)Decoder::CreateDecoder(info.codecId);
-      ASSERT(mAudioDecoder != nullptr, "failed to create audio decoder\n");
-
-      Decoder::Config config;
-      config.Init(info.codecId);
-      if (info.codecId == CODEC_A_VORBIS) {
-        config.vorbis.channels   = info.a.channels;
-        config.vorbis.sampleRate = info.a.sampleRate;
-      } else if (info.codecId == CODEC_A_OPUS) {
-        config.opus.channels   = info.a.channels;
-        config.opus.sampleRate = info.a.sampleRate;
-      }
-      mExtractor->GetCodecPrivateData(i, config.privateData);
-      mAudioDecoder->Configure(config);
+      AudioTrackEntry entry;
+      entry.info = info;
+      mExtractor->GetCodecPrivateData(i, entry.privateData);
+      mAudioTracks.push_back(entry);
 
-      mAudioCodecDelayUs = ns_to_us(info.a.codecDelay);
+      if (mAudioTrack >= 0) {
+        // 2 本目以降のオーディオトラックは SelectAudioTrack で切り替えるまで読まない
+        continue;
+      }
+      if (mAudioSink == nullptr) {
+        // 出力先が無ければトラックを選ばず、デマックスもデコードもしない
+        LOGV("no audio sink; skip this track: index=%d\n", (int)i);
+        continue;
+      }
 
       // TODO AUDIO_FORMAT_S16 で固定。汎用にするならインタフェース追加
       AudioFormat audioFormat = AUDIO_FORMAT_S16;
@@ -388,7 +539,7 @@ MoviePlayerCore::SelectTargetTrack()
       }
 
       // 外部 audio sink にフォーマットを通知。失敗したら audio 無し再生に切替。
-      if (mAudioSink != nullptr) {
+      {
         IAudioSink::Encoding encoding = IAudioSink::PCM_S16;
         switch (audioFormat) {
         case AUDIO_FORMAT_U8:  encoding = IAudioSink::PCM_U8;  break;
@@ -402,10 +553,17 @@ MoviePlayerCore::SelectTargetTrack()
                                bitsPerSample, encoding)) {
           LOGE("audio sink setup failed; disabling audio output\n");
           mAudioSink = nullptr;
+          continue;
         }
       }
 
+      mAudioTrack        = (int32_t)mAudioTracks.size() - 1;
+      mAudioDecoder      = CreateAudioDecoder(mAudioTrack);
+      mIsAudioAvailable  = true;
+      mAudioCodecDelayUs = ns_to_us(info.a.codecDelay);
+
       mExtractor->SelectTrack(TRACK_TYPE_AUDIO, i);
+      mAudioTrackIndex = (int32_t)i;
 
       if (mAudioDecoder) {
         LOGV(" AUDIO: codec=%s, channels=%d, sampleRate=%f, depth=%d, codecDelay=%" PRIu64
@@ -421,38 +579,219 @@ MoviePlayerCore::SelectTargetTrack()
   }
 }
 
+AudioDecoder *
+MoviePlayerCore::CreateAudioDecoder(int32_t index)
+{
+  const AudioTrackEntry &track = mAudioTracks[index];
+  const TrackInfo &info        = track.info;
+
+  AudioDecoder *decoder = (AudioDecoder *)Decoder::CreateDecoder(info.codecId);
+  ASSERT(decoder != nullptr, "failed to create audio decoder\n");
+  decoder->ConfigureQueues(mConfig.audioQueue);
+
+  Decoder::Config config;
+  config.Init(info.codecId);
+  if (info.codecId == CODEC_A_VORBIS) {
+    config.vorbis.channels   = info.a.channels;
+    config.vorbis.sampleRate = info.a.sampleRate;
+  } else if (info.codecId == CODEC_A_OPUS) {
+    config.opus.channels   = info.a.channels;
+    config.opus.sampleRate = info.a.sampleRate;
+  }
+  config.privateData = track.privateData;
+  decoder->Configure(config);
+
+  return decoder;
+}
+
+void
+MoviePlayerCore::SwitchAudioTrack(int32_t index)
+{
+  if (index == mAudioTrack) {
+    return;
+  }
+  if (mAudioDecoder == nullptr) {
+    // オーディオを止めている間は、次に再開するトラックだけを替えておく
+    std::lock_guard<std::mutex> lock(mApiMutex);
+
+    mAudioTrack      = index;
+    mAudioTrackIndex = mAudioTracks[index].info.index;
+    return;
+  }
+
+  // オーディオデコーダだけを作り直す。ビデオのデコーダと出力フレームはそのまま
+  ReleaseAudioDecoder();
+  StartAudioTrack(index);
+}
+
+void
+MoviePlayerCore::StartAudioTrack(int32_t index)
+{
+  const TrackInfo &info = mAudioTracks[index].info;
+  int64_t positionUs    = mClock.GetPresentationTime();
+  if (positionUs < 0) {
+    positionUs = 0;
+  }
+
+  AudioDecoder *decoder = CreateAudioDecoder(index);
+  {
+    std::lock_guard<std::mutex> lock(mApiMutex);
+
+    mAudioDecoder     = decoder;
+    mIsAudioAvailable = true;
+    mAudioTrack       = index;
+    mAudioTrackIndex  = info.index;
+  }
+  mAudioCodecDelayUs = ns_to_us(info.a.codecDelay);
+
+  // オーディオだけを今の再生位置から読み直す
+  bool switched = mDemuxer ? mDemuxer->SwitchAudioTrackSync(info.index, positionUs)
+                           : mExtractor->SwitchAudioTrack(info.index, positionUs);
+  if (!switched) {
+    LOGE("failed to switch audio track: track=%d\n", info.index);
+  }
+  mAudioDecoder->Start();
+  mSawAudioInputEOS = mSawAudioOutputEOS = mLastAudioFrameEnd = false;
+
+  // 新しいトラックの最初のバッファが sink に届くまでは、ビデオが止まらないよう
+  // 今の位置から実時間で進める (Resume と同じ)
+  mAudioResumeMediaTimeUs = positionUs;
+  if (IsCurrentState(STATE_PLAY)) {
+    mClock.ClearStartMediaTime();
+    mClock.SetStartMediaTime(positionUs);
+    mClock.SetPresentationTime(positionUs);
+    mClock.UpdateAnchorTime(positionUs, get_time_us(), INT64_MAX);
+  }
+
+  LOGV("audio track started: track=%d, codec=%s, position=%" PRId64 "us\n", info.index,
+       mAudioDecoder->CodecName(), positionUs);
+}
+
+void
+MoviePlayerCore::ReleaseAudioDecoder()
+{
+  // sink に渡したバッファをデコーダへ返してから破棄する
+  FlushAudioSink();
+  mAudioDecoder->Stop();
+
+  AudioDecoder *decoder = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mApiMutex);
+
+    std::swap(mAudioDecoder, decoder);
+    mIsAudioAvailable = false;
+  }
+  delete decoder;
+}
+
+void
+MoviePlayerCore::DisableAudio()
+{
+  if (mAudioDecoder == nullptr) {
+    return;
+  }
+
+  ReleaseAudioDecoder();
+  if (mDemuxer) {
+    mDemuxer->DisableAudioSync();
+  }
+  mSawAudioInputEOS = mSawAudioOutputEOS = mLastAudioFrameEnd = true;
+
+  // 以降はビデオフレームの PTS で時刻を進める (SetVideoFrame)。
+  // 次のフレームが出るまで今の位置から実時間で進める
+  if (IsCurrentState(STATE_PLAY)) {
+    int64_t nowUs       = get_time_us();
+    int64_t mediaTimeUs = mClock.GetMediaTime(nowUs);
+    if (mediaTimeUs >= 0) {
+      mClock.UpdateAnchorTime(mediaTimeUs, nowUs, INT64_MAX);
+    }
+  }
+
+  LOGV("audio disabled\n");
+}
+
 bool
 MoviePlayerCore::Open(const char *filepath)
 {
-  mExtractor   = new WebmExtractor();
+  mExtractor   = new WebmExtractor(mExtractorConfig);
   bool success = mExtractor->Open(filepath);
   if (!success) {
     LOGV("failed to create Extractor\n");
     return false;
   }
-  OpenSetup();
+  std::string path(filepath);
+  OpenSetup([&path](WebmExtractor *extractor) { return extractor->Open(path); });
   return true;
 }
 
 bool
 MoviePlayerCore::Open(IMovieReadStream *stream)
 {
-  mExtractor   = new WebmExtractor();
+  mExtractor   = new WebmExtractor(mExtractorConfig);
   bool success = mExtractor->Open(stream);
   if (!success) {
     LOGV("failed to create Extractor\n");
     return false;
   }
-  OpenSetup();
+  // 位置指定で読めない stream は reader ごとに Seek し合うので開き直さない
+  std::function<bool(WebmExtractor *)> reopen;
+  if (dynamic_cast<IMovieReadStream2 *>(stream)) {
+    reopen = [stream](WebmExtractor *extractor) { return extractor->Open(stream); };
+  }
+  OpenSetup(reopen);
+  return true;
+}
+
+bool
+MoviePlayerCore::Open(const void *data, size_t size)
+{
+  mExtractor   = new WebmExtractor(mExtractorConfig);
+  bool success = mExtractor->Open(data, size);
+  if (!success) {
+    LOGV("failed to create Extractor\n");
+    return false;
+  }
+  OpenSetup([data, size](WebmExtractor *extractor) { return extractor->Open(data, size); });
+  return true;
+}
+
+bool
+MoviePlayerCore::Open(int fd, int64_t offset, int64_t length)
+{
+  mExtractor   = new WebmExtractor(mExtractorConfig);
+  bool success = mExtractor->Open(fd, offset, length);
+  if (!success) {
+    LOGV("failed to create Extractor\n");
+    return false;
+  }
+  OpenSetup([fd, offset, length](WebmExtractor *extractor) {
+    return extractor->Open(fd, offset, length);
+  });
+  return true;
+}
+
+bool
+MoviePlayerCore::Open(const std::vector<std::string> &segmentPaths)
+{
+  mExtractor   = new WebmExtractor(mExtractorConfig);
+  bool success = mExtractor->Open(segmentPaths);
+  if (!success) {
+    LOGV("failed to create Extractor\n");
+    return false;
+  }
+  OpenSetup([&segmentPaths](WebmExtractor *extractor) { return extractor->Open(segmentPaths); });
   return true;
 }
 
 void
-MoviePlayerCore::OpenSetup()
+MoviePlayerCore::OpenSetup(const std::function<bool(WebmExtractor *)> &reopen)
 {
   mClock.SetDuration(mExtractor->GetDurationUs());
 
   SelectTargetTrack();
+  if (mConfig.demuxThread && mConfig.demuxPerTrack && reopen) {
+    SetupAudioExtractor(reopen);
+  }
   InitStatusFlags();
   Start();
 
@@ -460,6 +799,27 @@ MoviePlayerCore::OpenSetup()
   PreLoadInput();
 }
 
+void
+MoviePlayerCore::SetupAudioExtractor(const std::function<bool(WebmExtractor *)> &reopen)
+{
+  // 書き込み中のファイルの追いかけ・前方読みのみの stream はカーソルを分けられない
+  if (!IsVideoAvailable() || !IsAudioAvailable() || !mExtractor->IsSeekable()) {
+    return;
+  }
+
+  WebmExtractor *extractor = new WebmExtractor(mExtractorConfig);
+  if (!reopen(extractor)) {
+    LOGE("failed to open audio extractor; demux with a single cursor\n");
+    delete extractor;
+    return;
+  }
+  // シーク先はビデオのキーフレームの Cluster にそろえる
+  extractor->SelectTrack(TRACK_TYPE_AUDIO, mAudioTrackIndex);
+  extractor->SetSeekTrack(mVideoTrackIndex);
+  mExtractor->SelectTrack(TRACK_TYPE_AUDIO, -1);
+  mAudioExtractor = extractor;
+}
+
 void
 MoviePlayerCore::InitStatusFlags()
 {
@@ -473,6 +833,10 @@ MoviePlayerCore::DemuxInput()
   if (mSawVideoInputEOS && mSawAudioInputEOS) {
     return;
   }
+  if (mDemuxer) {
+    HandoffInput();
+    return;
+  }
 
   bool isPreloading  = IsCurrentState(STATE_PRELOADING);
   bool isInputFilled = false;
@@ -488,7 +852,10 @@ MoviePlayerCore::DemuxInput()
       break;
     case TRACK_TYPE_AUDIO:
       decoder = mAudioDecoder;
-      ASSERT(decoder != nullptr, "BUG: invali audio decoder.\n");
+      if (decoder == nullptr) {
+        // オーディオを止めている間は読み捨てる
+        mExtractor->Advance();
+      }
       break;
     case TRACK_TYPE_UNKNOWN:
     default:
@@ -520,7 +887,8 @@ MoviePlayerCore::DemuxInput()
         }
       }
     }
-  } while (isPreloading && !isInputFilled);
+    // 書き込み中のファイルの続き待ちなら、届くまでプリロードは打ち切る
+  } while (isPreloading && !isInputFilled && !mExtractor->IsWaitingData());
 }
 
 int32_t
@@ -541,6 +909,84 @@ MoviePlayerCore::InputToDecoder(Decoder *decoder, bool inputIsEOS)
   return packetIndex;
 }
 
+void
+MoviePlayerCore::HandoffInput()
+{
+  bool isPreloading = IsCurrentState(STATE_PRELOADING);
+
+  while (true) {
+    bool isInputFilled = false;
+    if (IsVideoAvailable() &&
+        InputFromDemuxer(mVideoDecoder, TRACK_TYPE_VIDEO, &mSawVideoInputEOS, isPreloading)) {
+      isInputFilled = true;
+    }
+    if (IsAudioAvailable() &&
+        InputFromDemuxer(mAudioDecoder, TRACK_TYPE_AUDIO, &mSawAudioInputEOS, isPreloading)) {
+      isInputFilled = true;
+    }
+
+    // プリロード中はデコーダの入力が埋まるまでデマックスを待つ。
+    // 書き込み中のファイルの続き待ちなら、届くまでプリロードは打ち切る
+    if (!isPreloading || isInputFilled || (mSawVideoInputEOS && mSawAudioInputEOS) ||
+        mDemuxer->IsWaitingData()) {
+      break;
+    }
+    mDemuxer->WaitPacket(10000);
+  }
+}
+
+bool
+MoviePlayerCore::InputFromDemuxer(Decoder *decoder, TrackType type, bool *sawInputEOS,
+                                  bool isPreloading)
+{
+  // デコード待ちが入力キューの半分以上残っている間は渡さず、減ってから空きの分を
+  // まとめて渡す (デコーダスレッドの起床をパケットごとではなくまとめた分で 1 回にする)。
+  // プリロード中は入るだけ渡す
+  if (!isPreloading && decoder->QueuedFramePackets() * 2 >= decoder->FramePacketCapacity()) {
+    return false;
+  }
+
+  // デマックス済みのパケットを入るだけ渡す。デコーダの入力が埋まったら true
+  bool isInputFilled = false;
+  while (!*sawInputEOS && !isInputFilled) {
+    size_t available = mDemuxer->PacketCount(type);
+    if (available == 0) {
+      break;
+    }
+    if (available > MAX_INPUT_BATCH) {
+      available = MAX_INPUT_BATCH;
+    }
+    int32_t indices[MAX_INPUT_BATCH];
+    size_t count  = decoder->DequeueFramePacketIndices(indices, available);
+    isInputFilled = (count < available);
+    if (count == 0) {
+      break;
+    }
+
+    FramePacket *packets[MAX_INPUT_BATCH];
+    for (size_t i = 0; i < count; i++) {
+      packets[i] = decoder->GetFramePacket(indices[i]);
+    }
+    // デマックスのキューから取り出すのはこのスレッドだけなので、数えた分は必ず取れる
+    size_t taken = mDemuxer->TakePackets(type, packets, count);
+    ASSERT(taken == count, "BUG: demuxed packets lost: %zu/%zu\n", taken, count);
+    for (size_t i = 0; i < taken; i++) {
+      if (packets[i]->isEndOfStream) {
+        *sawInputEOS = true;
+      }
+    }
+    decoder->QueueFramePacketIndices(indices, taken);
+  }
+  return isInputFilled;
+}
+
+bool
+MoviePlayerCore::CanSeekTo(int64_t posUs)
+{
+  // デマックススレッドがあれば extractor はそちら経由で触る
+  return mDemuxer ? mDemuxer->CanSeekTo(posUs) : mExtractor->CanSeekTo(posUs);
+}
+
 void
 MoviePlayerCore::HandleVideoOutput()
 {
@@ -673,11 +1119,14 @@ MoviePlayerCore::Decode()
 
   bool isMovieDone = (sawInputEOS && sawOutputEOS && lastFrameEnd);
   if (isMovieDone) {
-    if (mIsLoop) {
+    if (mIsLoop && CanSeekTo(0)) {
       LOGV("---- Loop ----\n");
       Post(MSG_SEEK, 0);
       Post(MSG_DECODE);
     } else {
+      if (mIsLoop) {
+        LOGV("stream is not seekable: loop ignored\n");
+      }
       Post(MSG_FINISH);
     }
   } else {
@@ -747,14 +1196,34 @@ MoviePlayerCore::HandleMessage(int32_t what, int64_t arg, void *data)
   } break;
 
   case MSG_SEEK: {
+    if (!CanSeekTo(arg)) {
+      LOGE("seek is not supported: %" PRId64 "us\n", arg);
+      break;
+    }
     Flush();
-    mExtractor->SeekTo(arg);
+    if (mDemuxer) {
+      mDemuxer->SeekSync(arg);
+    } else {
+      mExtractor->SeekTo(arg);
+    }
     State savedState = GetState();
     SetState(STATE_PRELOADING);
     Decode();
     SetState(savedState);
   } break;
 
+  case MSG_SELECT_AUDIO:
+    SwitchAudioTrack((int32_t)arg);
+    break;
+
+  case MSG_SET_AUDIO_ENABLED:
+    if (arg == 0) {
+      DisableAudio();
+    } else if (mAudioDecoder == nullptr) {
+      StartAudioTrack(mAudioTrack);
+    }
+    break;
+
   case MSG_STOP:
     SetVideoFrame(&mDummyFrame);
     SetState(STATE_STOP);
@@ -800,19 +1269,7 @@ MoviePlayerCore::Flush()
 
   // オーディオ出力待ちをフラッシュ
   if (mAudioDecoder != nullptr) {
-    if (mAudioSink) {
-      // pending を全て consumed に流して取り出す。
-      mAudioSink->Flush();
-      void *param = nullptr;
-      while (mAudioSink->TryPopConsumed(&param)) {
-        DecodedBuffer *buf = (DecodedBuffer *)param;
-        if (buf) {
-          mAudioDecoder->ReleaseDecodedBufferIndex(buf->bufIndex);
-        }
-      }
-    }
-    mAudioStartPtsValid     = false;
-    mAudioStartPtsNs        = 0;
+    FlushAudioSink();
     mAudioResumeMediaTimeUs = 0;
   }
 
@@ -832,6 +1289,24 @@ MoviePlayerCore::Flush()
   mLastVideoFrameEnd = false;
 }
 
+void
+MoviePlayerCore::FlushAudioSink()
+{
+  if (mAudioSink) {
+    // pending を全て consumed に流して取り出す。
+    mAudioSink->Flush();
+    void *param = nullptr;
+    while (mAudioSink->TryPopConsumed(&param)) {
+      DecodedBuffer *buf = (DecodedBuffer *)param;
+      if (buf) {
+        mAudioDecoder->ReleaseDecodedBufferIndex(buf->bufIndex);
+      }
+    }
+  }
+  mAudioStartPtsValid = false;
+  mAudioStartPtsNs    = 0;
+}
+
 void
 MoviePlayerCore::UpdateVideoFrameToNext()
 {
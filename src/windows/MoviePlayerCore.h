@@ -2,9 +2,11 @@
 
 #include "Constants.h"
 #include "MessageLooper.h"
+#include "PacketDemuxer.h"
 #include "WebmExtractor.h"
 #include "Decoder.h"
 #include "MediaClock.h"
+#include <atomic>
 #include <functional>
 
 class IAudioSink;
@@ -23,6 +25,8 @@ public:
     MSG_RESUME,
     MSG_SET_LOOP,
     MSG_SEEK,
+    MSG_SELECT_AUDIO,
+    MSG_SET_AUDIO_ENABLED,
     MSG_STOP,
     MSG_FINISH
   };
@@ -38,8 +42,25 @@ public:
     STATE_FINISH,
   };
 
+  struct Config
+  {
+    void Init();
+
+    // デマックスを専用スレッド (PacketDemuxer) で行う。false なら再生ループの
+    // スレッドでデコーダの入力が空くたびに extractor から読む
+    bool demuxThread;
+    // demuxThread 有効時に、オーディオを同じソースを開き直した別の extractor から読む
+    // (トラックごとに独立したカーソル)。ビデオとオーディオが両方ある場合のみ
+    bool demuxPerTrack;
+    PacketDemuxer::Config demuxer;
+    // デコーダの入出力キュー容量
+    Decoder::QueueConfig videoQueue;
+    Decoder::QueueConfig audioQueue;
+  };
+
 public:
-  MoviePlayerCore(PixelFormat pixelFormat, IAudioSink *audioSink);
+  MoviePlayerCore(PixelFormat pixelFormat, IAudioSink *audioSink, const Config &config,
+                  const WebmExtractor::Config &extractorConfig);
   virtual ~MoviePlayerCore();
 
   void Init();
@@ -47,6 +68,9 @@ public:
 
   bool Open(const char *filepath);
   bool Open(IMovieReadStream *stream);
+  bool Open(const void *data, size_t size);
+  bool Open(int fd, int64_t offset, int64_t length);
+  bool Open(const std::vector<std::string> &segmentPaths);
 
   void Play(bool loop = false);
   void Stop();
@@ -72,10 +96,25 @@ public:
   void SetVolume(float volume);
   float Volume() const;
 
+  // 再生できるオーディオトラックの一覧 (コンテナ内の順)。index はこの一覧での番号
+  int32_t AudioTrackCount() const;
+  bool GetAudioTrackInfo(int32_t index, TrackInfo *info) const;
+  // 再生中のオーディオトラックの番号 (無ければ -1)
+  int32_t AudioTrack() const;
+  // 再生中にオーディオトラックを切り替える (ビデオは止めずに、オーディオだけを今の
+  // 再生位置から読み直す)。シークできない場合と、サンプルレート・チャンネル数が
+  // 今のトラックと違う場合 (IAudioSink は Open 時のフォーマットのまま) は false
+  bool SelectAudioTrack(int32_t index);
+  // オーディオのデコードを止める/再開する。止めている間は IsAudioAvailable が false で
+  // ビデオを基準に再生する。再開はシークできる場合のみ (今の再生位置から読み直す)
+  bool SetAudioEnabled(bool enabled);
+
   int64_t Duration() const;
   int64_t Position() const;
   bool IsPlaying() const;
   bool Loop() const;
+  bool IsSeekable() const;
+  void GetIOStats(MkvReaderStats *demux, MkvReaderStats *storage) const;
 
   bool GetVideoFrame(const DecodedBuffer **videoFrame);
 
@@ -95,16 +134,28 @@ public:
 protected:
   virtual void HandleMessage(int32_t what, int64_t arg, void *data) override;
 
-  void OpenSetup();
+  // reopen は同じソースを別の extractor で開く (開き直せないソースなら空)
+  void OpenSetup(const std::function<bool(WebmExtractor *)> &reopen);
+  void SetupAudioExtractor(const std::function<bool(WebmExtractor *)> &reopen);
   void InitStatusFlags();
   void SelectTargetTrack();
+  AudioDecoder *CreateAudioDecoder(int32_t index);
+  void SwitchAudioTrack(int32_t index);
+  void StartAudioTrack(int32_t index);
+  void ReleaseAudioDecoder();
+  void DisableAudio();
   void Start();
   void Decode();
   void DemuxInput();
   int32_t InputToDecoder(Decoder *decoder, bool inputIsEOS);
+  void HandoffInput();
+  bool InputFromDemuxer(Decoder *decoder, TrackType type, bool *sawInputEOS,
+                        bool isPreloading);
+  bool CanSeekTo(int64_t posUs);
   void HandleVideoOutput();
   void HandleAudioOutput();
   void Flush();
+  void FlushAudioSink();
 
   void SetState(State newState);
   bool IsCurrentState(State state) const;
@@ -123,13 +174,35 @@ protected:
   void DrainAudioSinkConsumed();
 
 private:
+  // デマックススレッドからデコーダへ 1 回に渡す最大パケット数
+  static constexpr size_t MAX_INPUT_BATCH = 16;
+
   // ステート
   State mState;
   bool mIsLoop;
 
+  Config mConfig;
+  WebmExtractor::Config mExtractorConfig;
   WebmExtractor *mExtractor;
+  WebmExtractor *mAudioExtractor; // demuxPerTrack が有効な場合のみ (オーディオ用)
+  PacketDemuxer *mDemuxer; // demuxThread が有効な場合のみ
   VideoDecoder *mVideoDecoder;
   AudioDecoder *mAudioDecoder;
+  // mAudioDecoder があるか。デコーダは再生スレッドで作り直される (SetAudioEnabled) ので、
+  // 他のスレッドからの IsAudioAvailable はポインタではなくこちらを見る
+  std::atomic<bool> mIsAudioAvailable;
+  int32_t mVideoTrackIndex; //< 再生中のトラック index (無ければ -1)
+  int32_t mAudioTrackIndex;
+
+  // 再生できるオーディオトラック。再生中に extractor を触らずに切り替えられるよう
+  // Open 時に CodecPrivate まで取っておく
+  struct AudioTrackEntry
+  {
+    TrackInfo info;
+    std::vector<std::vector<uint8_t>> privateData;
+  };
+  std::vector<AudioTrackEntry> mAudioTracks;
+  int32_t mAudioTrack; //< mAudioTracks での再生中の番号 (無ければ -1)
 
   // API用mutex
   mutable std::mutex mApiMutex;
@@ -0,0 +1,333 @@
+#define MYLOG_TAG "PacketDemuxer"
+#include "BasicLog.h"
+#include "PacketDemuxer.h"
+#include "WebmExtractor.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+void
+PacketDemuxer::Config::Init()
+{
+  // 30fps で約 1 秒分、20ms の音声パケットで約 1.3 秒分
+  videoQueueSize = 32;
+  audioQueueSize = 64;
+}
+
+PacketDemuxer::PacketDemuxer(WebmExtractor *extractor, WebmExtractor *audioExtractor,
+                             const Config &config, bool hasVideo, bool hasAudio)
+: mExtractor(extractor)
+, mAudioExtractor(audioExtractor)
+, mHasVideo(hasVideo)
+, mHasAudio(hasAudio)
+, mAudioEnabled(hasAudio)
+, mSawVideoEOS(!hasVideo)
+, mSawAudioEOS(!hasAudio)
+, mSwitchAudioTrack(-1)
+, mSwitchAudioResult(false)
+, mIsWaitingData(false)
+, mPackets(0)
+, mQueueFullCount(0)
+{
+  // 対象外のトラックのキューも空のまま作っておく (BufferQueue は空では破棄できない)
+  mVideoQueue.Init(hasVideo ? std::max<size_t>(config.videoQueueSize, 1) : 1);
+  mAudioQueue.Init(hasAudio ? std::max<size_t>(config.audioQueueSize, 1) : 1);
+}
+
+PacketDemuxer::~PacketDemuxer()
+{
+  Stop();
+  LOGV("demuxer: packets=%" PRIu64 " queue full=%" PRIu64 "\n", mPackets, mQueueFullCount);
+}
+
+void
+PacketDemuxer::Start()
+{
+  StartThread();
+  Post(MSG_DEMUX);
+}
+
+void
+PacketDemuxer::Stop()
+{
+  StopThread();
+}
+
+BufferQueue<FramePacket> *
+PacketDemuxer::GetQueue(TrackType type)
+{
+  switch (type) {
+  case TRACK_TYPE_VIDEO:
+    return mHasVideo ? &mVideoQueue : nullptr;
+  case TRACK_TYPE_AUDIO:
+    return mHasAudio ? &mAudioQueue : nullptr;
+  default:
+    return nullptr;
+  }
+}
+
+const BufferQueue<FramePacket> *
+PacketDemuxer::GetQueue(TrackType type) const
+{
+  return const_cast<PacketDemuxer *>(this)->GetQueue(type);
+}
+
+bool
+PacketDemuxer::HasPacket(TrackType type) const
+{
+  const BufferQueue<FramePacket> *queue = GetQueue(type);
+  return queue && queue->SizeForReader() > 0;
+}
+
+size_t
+PacketDemuxer::PacketCount(TrackType type) const
+{
+  const BufferQueue<FramePacket> *queue = GetQueue(type);
+  return queue ? queue->SizeForReader() : 0;
+}
+
+bool
+PacketDemuxer::TakePacket(TrackType type, FramePacket *packet)
+{
+  BufferQueue<FramePacket> *queue = GetQueue(type);
+  if (!queue) {
+    return false;
+  }
+  int32_t index = queue->DequeueIndexForReader();
+  if (index < 0) {
+    return false;
+  }
+  queue->GetBuffer(index)->SwapContents(packet);
+  queue->EnqueueBufferIndexForWriter(index);
+
+  // 空いたスロットの分を読み進める
+  Post(MSG_DEMUX);
+  return true;
+}
+
+size_t
+PacketDemuxer::TakePackets(TrackType type, FramePacket *const *packets, size_t count)
+{
+  BufferQueue<FramePacket> *queue = GetQueue(type);
+  if (!queue) {
+    return 0;
+  }
+  int32_t indices[MAX_TAKE_PACKETS];
+  if (count > MAX_TAKE_PACKETS) {
+    count = MAX_TAKE_PACKETS;
+  }
+  size_t taken = queue->DequeueIndicesForReader(indices, count);
+  for (size_t i = 0; i < taken; i++) {
+    queue->GetBuffer(indices[i])->SwapContents(packets[i]);
+  }
+  queue->EnqueueBufferIndicesForWriter(indices, taken);
+
+  if (taken > 0) {
+    Post(MSG_DEMUX);
+  }
+  return taken;
+}
+
+void
+PacketDemuxer::WaitPacket(int64_t timeoutUs)
+{
+  if (HasPacket(TRACK_TYPE_VIDEO) || HasPacket(TRACK_TYPE_AUDIO) || mIsWaitingData) {
+    return;
+  }
+  mEventFlag.Wait(EVENT_FLAG_PACKET, timeoutUs);
+}
+
+bool
+PacketDemuxer::CanSeekTo(int64_t positionUs)
+{
+  std::lock_guard<std::mutex> lock(mExtractorMutex);
+
+  return mExtractor->CanSeekTo(positionUs);
+}
+
+void
+PacketDemuxer::SeekSync(int64_t positionUs)
+{
+  // 未処理の MSG_DEMUX は捨ててよい (シーク後に読み直す)
+  Post(MSG_SEEK, positionUs, nullptr, true);
+  mEventFlag.Wait(EVENT_FLAG_SEEK);
+}
+
+bool
+PacketDemuxer::SwitchAudioTrackSync(int32_t trackIndex, int64_t positionUs)
+{
+  if (!mHasAudio) {
+    return false;
+  }
+  // 呼び出し元 (再生ループ) は終わるまで待つので、引数はメンバで渡してよい
+  mSwitchAudioTrack = trackIndex;
+  Post(MSG_SWITCH_AUDIO, positionUs);
+  mEventFlag.Wait(EVENT_FLAG_SWITCH);
+  return mSwitchAudioResult;
+}
+
+void
+PacketDemuxer::DisableAudioSync()
+{
+  if (!mHasAudio) {
+    return;
+  }
+  Post(MSG_DISABLE_AUDIO);
+  mEventFlag.Wait(EVENT_FLAG_SWITCH);
+}
+
+void
+PacketDemuxer::HandleMessage(int32_t what, int64_t arg, void *data)
+{
+  switch (what) {
+  case MSG_DEMUX:
+    Demux();
+    break;
+
+  case MSG_SEEK: {
+    // キューに残ったパケットの参照先はここで手放す
+    mVideoQueue.Clear();
+    mAudioQueue.Clear();
+    {
+      std::lock_guard<std::mutex> lock(mExtractorMutex);
+      mExtractor->SeekTo(arg);
+      if (mAudioExtractor) {
+        mAudioExtractor->SeekTo(arg);
+      }
+    }
+    mSawVideoEOS   = !mHasVideo;
+    mSawAudioEOS   = !mAudioEnabled;
+    mIsWaitingData = false;
+    mEventFlag.Set(EVENT_FLAG_SEEK);
+    Demux();
+  } break;
+
+  case MSG_SWITCH_AUDIO: {
+    // 単一カーソルでもビデオのキューは捨てない (extractor が読み出し済みの分を飛ばす)
+    mAudioQueue.Clear();
+    {
+      std::lock_guard<std::mutex> lock(mExtractorMutex);
+      WebmExtractor *extractor = mAudioExtractor ? mAudioExtractor : mExtractor;
+      mSwitchAudioResult       = extractor->SwitchAudioTrack(mSwitchAudioTrack, arg);
+    }
+    mAudioEnabled  = true;
+    mSawAudioEOS   = false;
+    mIsWaitingData = false;
+    mEventFlag.Set(EVENT_FLAG_SWITCH);
+    Demux();
+  } break;
+
+  case MSG_DISABLE_AUDIO:
+    // 単一カーソルならオーディオのパケットは DemuxPacket で読み捨て、
+    // トラックごとのカーソルならオーディオ側は読まない
+    mAudioQueue.Clear();
+    mAudioEnabled = false;
+    mSawAudioEOS  = true;
+    mEventFlag.Set(EVENT_FLAG_SWITCH);
+    Demux();
+    break;
+
+  default:
+    ASSERT(false, "unknown message type: %d\n", what);
+    break;
+  }
+}
+
+bool
+PacketDemuxer::QueueEOS(BufferQueue<FramePacket> *queue, bool *sawEOS)
+{
+  if (*sawEOS) {
+    return true;
+  }
+  int32_t index = queue->DequeueIndexForWriter();
+  if (index < 0) {
+    return false;
+  }
+  queue->GetBuffer(index)->InitAsEOS(index);
+  queue->EnqueueBufferIndexForReader(index);
+  *sawEOS = true;
+  return true;
+}
+
+void
+PacketDemuxer::Demux()
+{
+  if (!mAudioExtractor) {
+    while (DemuxPacket(mExtractor)) {
+    }
+    return;
+  }
+
+  // トラックごとのカーソルは 1 パケットずつ交互に読み、止まった方は飛ばして
+  // もう片方を読み進める
+  bool canReadVideo = true;
+  bool canReadAudio = mAudioEnabled;
+  while (canReadVideo || canReadAudio) {
+    if (canReadVideo) {
+      canReadVideo = DemuxPacket(mExtractor);
+    }
+    if (canReadAudio) {
+      canReadAudio = DemuxPacket(mAudioExtractor);
+    }
+  }
+}
+
+bool
+PacketDemuxer::DemuxPacket(WebmExtractor *extractor)
+{
+  std::unique_lock<std::mutex> lock(mExtractorMutex);
+
+  TrackType type = extractor->NextFramePacketType();
+  if (extractor->IsReachedEOS()) {
+    // 空きが無ければ次に取り出されたときに入れる
+    if (extractor != mAudioExtractor) {
+      QueueEOS(&mVideoQueue, &mSawVideoEOS);
+    }
+    if (extractor == mAudioExtractor || !mAudioExtractor) {
+      QueueEOS(&mAudioQueue, &mSawAudioEOS);
+    }
+    mEventFlag.Set(EVENT_FLAG_PACKET);
+    return false;
+  }
+
+  if (extractor->IsWaitingData()) {
+    // 続きが書き足されるまで間隔をあけて確認する
+    lock.unlock();
+    if (!mIsWaitingData) {
+      mIsWaitingData = true;
+      mEventFlag.Set(EVENT_FLAG_PACKET);
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(WAIT_DATA_INTERVAL_US));
+    Post(MSG_DEMUX);
+    return false;
+  }
+  mIsWaitingData = false;
+
+  if (type == TRACK_TYPE_AUDIO && !mAudioEnabled) {
+    extractor->Advance();
+    return true;
+  }
+  BufferQueue<FramePacket> *queue = GetQueue(type);
+  if (!queue) {
+    // 読み込みエラー。再生ループから直接読んでいた場合と同じく読み進めない
+    return false;
+  }
+  int32_t index = queue->DequeueIndexForWriter();
+  if (index < 0) {
+    // キューが埋まっているので取り出されるまで待つ
+    mQueueFullCount++;
+    return false;
+  }
+  // スロットには TakePacket で入れ替えた前の中身 (EOS のこともある) が残っている
+  FramePacket *packet = queue->GetBuffer(index);
+  packet->Init(index);
+  extractor->ReadSampleData(packet);
+  extractor->Advance();
+  lock.unlock();
+
+  queue->EnqueueBufferIndexForReader(index);
+  mPackets++;
+  mEventFlag.Set(EVENT_FLAG_PACKET);
+  return true;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "CommonUtils.h"
+#include "Constants.h"
+#include "FramePacket.h"
+#include "MessageLooper.h"
+
+#include <atomic>
+#include <mutex>
+
+class WebmExtractor;
+
+// WebmExtractor からのパケットの読み出しを専用スレッドで行い、トラックごとの
+// パケットキューに先読みしておく。再生ループはキューからデコーダへ渡すだけになるので、
+// 読み込みが詰まってもキューが尽きるまではフレームの切り替えや音声の供給が止まらない。
+// Start 以降、extractor の読み出しとシークはこのクラス経由でのみ行うこと。
+//
+// audioExtractor を渡すとオーディオはそちら (同じファイルを別に開いてオーディオだけを
+// 選択したもの) から読み、トラックごとに独立したカーソルで読み進める。ビデオとオーディオの
+// 並びが偏ったファイルでも、片方のキューが埋まってもう片方が読めなくなることが無い。
+class PacketDemuxer : public MessageLooper
+{
+public:
+  enum Message
+  {
+    MSG_DEMUX,
+    MSG_SEEK,
+    MSG_SWITCH_AUDIO,
+    MSG_DISABLE_AUDIO,
+  };
+
+  struct Config
+  {
+    void Init();
+
+    // トラックごとのキューの長さ (パケット数)。デコーダの入力キューの手前に置かれる
+    size_t videoQueueSize;
+    size_t audioQueueSize;
+  };
+
+public:
+  PacketDemuxer(WebmExtractor *extractor, WebmExtractor *audioExtractor,
+                const Config &config, bool hasVideo, bool hasAudio);
+  virtual ~PacketDemuxer();
+
+  void Start();
+  void Stop();
+
+  // type のキューにパケットがあるか
+  bool HasPacket(TrackType type) const;
+  size_t PacketCount(TrackType type) const;
+  // type のキューの先頭のパケットを packet と入れ替えて取り出す (データはコピーしない)。
+  // 取り出したスロットには packet の元の中身が入り、そのまま次の読み込みに使われる
+  bool TakePacket(TrackType type, FramePacket *packet);
+  // 先頭から最大 count 個を packets[i] と入れ替えて取り出す (demux スレッドの起床は
+  // 1 回)。戻り値は取り出した数
+  size_t TakePackets(TrackType type, FramePacket *const *packets, size_t count);
+  // いずれかのキューにパケットが入るか、読み込みが止まる (終端・続き待ち) まで待つ
+  void WaitPacket(int64_t timeoutUs);
+  // 書き込み中のファイルの続きを待っている
+  bool IsWaitingData() const { return mIsWaitingData; }
+
+  bool CanSeekTo(int64_t positionUs);
+  // キューを捨てて extractor をシークし、読み込みを再開する (終わるまで待つ)
+  void SeekSync(int64_t positionUs);
+  // オーディオのキューだけを捨て、trackIndex のオーディオを positionUs から読み直す
+  // (ビデオのキューとその続きはそのまま。終わるまで待つ)。失敗したら false
+  bool SwitchAudioTrackSync(int32_t trackIndex, int64_t positionUs);
+  // オーディオのキューを捨て、以降のオーディオは読み捨てる (終わるまで待つ)。
+  // SwitchAudioTrackSync で再開する
+  void DisableAudioSync();
+
+  // MessageLooper
+  virtual void HandleMessage(int32_t what, int64_t arg, void *data) override;
+
+private:
+  // 書き込み中のファイルの続きを確認する間隔
+  static constexpr int64_t WAIT_DATA_INTERVAL_US = 5000;
+  // TakePackets で 1 回に取り出す最大数
+  static constexpr size_t MAX_TAKE_PACKETS = 64;
+
+  void Demux();
+  // extractor から 1 パケット読んでキューに入れる。続けて読める場合は true
+  bool DemuxPacket(WebmExtractor *extractor);
+  bool QueueEOS(BufferQueue<FramePacket> *queue, bool *sawEOS);
+  BufferQueue<FramePacket> *GetQueue(TrackType type);
+  const BufferQueue<FramePacket> *GetQueue(TrackType type) const;
+
+  WebmExtractor *mExtractor;
+  WebmExtractor *mAudioExtractor; //< トラックごとのカーソルで読む場合のみ
+  // extractor を demux スレッド以外から参照する場合 (CanSeekTo) 用
+  std::mutex mExtractorMutex;
+
+  BufferQueue<FramePacket> mVideoQueue;
+  BufferQueue<FramePacket> mAudioQueue;
+  bool mHasVideo, mHasAudio;
+  bool mAudioEnabled;              //< false ならオーディオは読み捨てる
+  bool mSawVideoEOS, mSawAudioEOS; //< EOS パケットをキューに入れた
+  int32_t mSwitchAudioTrack;       //< MSG_SWITCH_AUDIO の対象トラック
+  bool mSwitchAudioResult;
+  std::atomic_bool mIsWaitingData;
+
+  // 統計情報
+  uint64_t mPackets;
+  uint64_t mQueueFullCount; //< キューが埋まって読み込みを止めた回数
+
+  // 同期用イベントフラグ
+  enum
+  {
+    EVENT_FLAG_PACKET = 1 << 0,
+    EVENT_FLAG_SEEK   = 1 << 1,
+    EVENT_FLAG_SWITCH = 1 << 2,
+  };
+  EventFlag mEventFlag;
+};
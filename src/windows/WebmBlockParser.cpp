@@ -0,0 +1,619 @@
+#define MYLOG_TAG "WebmBlockParser"
+#include "BasicLog.h"
+#include "WebmBlockParser.h"
+#include "CommonUtils.h"
+
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+// Matroska 要素 ID
+const uint32_t ID_CRC32              = 0xBF;
+const uint32_t ID_CLUSTER            = 0x1F43B675;
+const uint32_t ID_TIMECODE           = 0xE7;
+const uint32_t ID_SIMPLE_BLOCK       = 0xA3;
+const uint32_t ID_BLOCK_GROUP        = 0xA0;
+const uint32_t ID_BLOCK              = 0xA1;
+const uint32_t ID_BLOCK_ADDITIONS    = 0x75A1;
+const uint32_t ID_BLOCK_MORE         = 0xA6;
+const uint32_t ID_BLOCK_ADD_ID       = 0xEE;
+const uint32_t ID_BLOCK_ADDITIONAL   = 0xA5;
+const uint32_t ID_DISCARD_PADDING    = 0x75A2;
+
+const uint64_t UNKNOWN_SIZE = UINT64_MAX;
+
+// ReadSimpleBlock/ReadBlockGroup の戻り値 (1: 読んだ, 0: 終端, -1: エラー 以外)
+const int BLOCK_SKIPPED = 2;
+
+// nestegg と同じ上限
+const uint64_t LIMIT_BLOCK = 1 << 30;
+const uint64_t LIMIT_FRAME = 1 << 28;
+
+// ブロックのヘッダ: TrackNumber(vint) + Timecode(2) + Flags(1)
+const uint8_t BLOCK_FLAG_KEYFRAME = 0x80;
+const uint8_t BLOCK_FLAG_LACING   = 0x06;
+enum
+{
+  LACING_NONE  = 0,
+  LACING_XIPH  = 1,
+  LACING_FIXED = 2,
+  LACING_EBML  = 3,
+};
+
+// vint の byte 数 (先頭 byte の最上位の 1 の位置)
+int
+vint_length(uint8_t c)
+{
+  for (int i = 0; i < 8; i++) {
+    if (c & (0x80 >> i)) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// メモリ上の vint。isId なら長さビットを残す (要素 ID)
+bool
+read_vint(const uint8_t *p, size_t avail, bool isId, uint64_t *value, int *length)
+{
+  if (avail == 0) {
+    return false;
+  }
+  int len = vint_length(p[0]);
+  if (len == 0 || (size_t)len > avail || (isId && len > 4)) {
+    return false;
+  }
+  uint64_t v    = isId ? p[0] : (p[0] & (0xFF >> len));
+  bool isAllOne = (v == (uint64_t)(0xFF >> len));
+  for (int i = 1; i < len; i++) {
+    v = (v << 8) | p[i];
+    isAllOne &= (p[i] == 0xFF);
+  }
+  *value  = (!isId && isAllOne) ? UNKNOWN_SIZE : v;
+  *length = len;
+  return true;
+}
+
+// EBML レーシングの差分 (符号付き vint)
+bool
+read_svint(const uint8_t *p, size_t avail, int64_t *value, int *length)
+{
+  uint64_t v;
+  if (!read_vint(p, avail, false, &v, length) || v == UNKNOWN_SIZE) {
+    return false;
+  }
+  *value = (int64_t)v - (((int64_t)1 << (7 * *length - 1)) - 1);
+  return true;
+}
+
+uint64_t
+read_be(const uint8_t *p, size_t size)
+{
+  uint64_t v = 0;
+  for (size_t i = 0; i < size; i++) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+// メモリ上の子要素のヘッダ。データが範囲内に収まらなければ false
+bool
+read_child_header(const uint8_t *data, size_t size, size_t pos, uint32_t *id,
+                  uint64_t *childSize, size_t *dataPos)
+{
+  uint64_t value;
+  int idLength, sizeLength;
+  if (!read_vint(data + pos, size - pos, true, &value, &idLength) ||
+      !read_vint(data + pos + idLength, size - pos - idLength, false, childSize,
+                 &sizeLength)) {
+    return false;
+  }
+  *id      = (uint32_t)value;
+  *dataPos = pos + idLength + sizeLength;
+  return *childSize != UNKNOWN_SIZE && *childSize <= size - *dataPos;
+}
+
+} // namespace
+
+WebmBlockParser::WebmBlockParser()
+: mReader(nullptr)
+, mStats(nullptr)
+, mTimecodeScale(1000000)
+, mClusterTimecode(0)
+, mHasClusterTimecode(false)
+, mNextBuffer(0)
+, mBlockCount(0)
+, mSkippedBlocks(0)
+{
+  mPacket.track          = 0;
+  mPacket.timeStampNs    = 0;
+  mPacket.isKeyFrame     = false;
+  mPacket.discardPadding = 0;
+  mPacket.frameCount     = 0;
+  mPacket.hasAdditional  = false;
+}
+
+void
+WebmBlockParser::Init(IMkvFileReader *reader, MkvReaderCounter *stats,
+                      const std::vector<uint64_t> &trackNumbers, uint64_t timecodeScale)
+{
+  mReader        = reader;
+  mStats         = stats;
+  mTrackNumbers  = trackNumbers;
+  mTimecodeScale = timecodeScale;
+  mTrackEnabled.assign(trackNumbers.size(), true);
+}
+
+void
+WebmBlockParser::SetTrackEnabled(unsigned int track, bool isEnabled)
+{
+  if (track < mTrackEnabled.size()) {
+    mTrackEnabled[track] = isEnabled;
+  }
+}
+
+bool
+WebmBlockParser::IsTrackEnabled(int track) const
+{
+  return track >= 0 && (size_t)track < mTrackEnabled.size() && mTrackEnabled[track];
+}
+
+int
+WebmBlockParser::FindTrackIndex(uint64_t trackNumber) const
+{
+  for (size_t i = 0; i < mTrackNumbers.size(); i++) {
+    if (mTrackNumbers[i] == trackNumber) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+WebmBlockParser::Buffer
+WebmBlockParser::AcquireBuffer(size_t size)
+{
+  if (size > MAX_POOLED_BUFFER_SIZE) {
+    // プールに入れず、参照が無くなったら解放する
+    return std::make_shared<std::vector<uint8_t>>(size);
+  }
+
+  // 誰も参照していない (プールだけが持っている) バッファを探す
+  Buffer buffer;
+  for (size_t i = 0; i < mBuffers.size(); i++) {
+    size_t index = (mNextBuffer + i) % mBuffers.size();
+    if (mBuffers[index].use_count() == 1) {
+      // 参照していたスレッドの読み込みが済んでから書き換える
+      std::atomic_thread_fence(std::memory_order_acquire);
+      buffer      = mBuffers[index];
+      mNextBuffer = index + 1;
+      break;
+    }
+  }
+  if (!buffer) {
+    buffer = std::make_shared<std::vector<uint8_t>>();
+    // 上限を超えて使われている分はプールに入れない
+    if (mBuffers.size() < MAX_POOLED_BUFFERS) {
+      mBuffers.push_back(buffer);
+    }
+  }
+  // 上限の大きさまでは縮めずに使い回す
+  if (buffer->size() < size) {
+    buffer->resize(size);
+  }
+  return buffer;
+}
+
+bool
+WebmBlockParser::Read(void *buffer, uint64_t length)
+{
+  int64_t begin = get_time_us();
+  int ret       = mReader->Read(buffer, (int64_t)length);
+  if (mStats) {
+    mStats->AddRead(length, get_time_us() - begin);
+  }
+  return ret == 1;
+}
+
+int
+WebmBlockParser::ReadElementHeader(uint32_t *id, uint64_t *size)
+{
+  uint8_t buf[8];
+  uint64_t value;
+  int length;
+
+  if (!Read(buf, 1)) {
+    return 0;
+  }
+  length = vint_length(buf[0]);
+  if (length == 0 || length > 4) {
+    return -1;
+  }
+  if (length > 1 && !Read(buf + 1, length - 1)) {
+    return 0;
+  }
+  read_vint(buf, length, true, &value, &length);
+  *id = (uint32_t)value;
+
+  if (!Read(buf, 1)) {
+    return 0;
+  }
+  length = vint_length(buf[0]);
+  if (length == 0) {
+    return -1;
+  }
+  if (length > 1 && !Read(buf + 1, length - 1)) {
+    return 0;
+  }
+  read_vint(buf, length, false, size, &length);
+  return 1;
+}
+
+int
+WebmBlockParser::ReadUInt(uint64_t size, uint64_t *value)
+{
+  uint8_t buf[8];
+  if (size > sizeof(buf)) {
+    return -1;
+  }
+  if (size > 0 && !Read(buf, size)) {
+    return 0;
+  }
+  *value = read_be(buf, (size_t)size);
+  return 1;
+}
+
+int
+WebmBlockParser::Skip(uint64_t size)
+{
+  if (size == UNKNOWN_SIZE || size > INT64_MAX) {
+    return -1;
+  }
+  int64_t from = mReader->Tell();
+  int ret      = mReader->Seek((int64_t)size, SEEK_CUR);
+  if (mStats) {
+    mStats->AddSeek(from, mReader->Tell());
+  }
+  return (ret == 0) ? 1 : -1;
+}
+
+int
+WebmBlockParser::ReadPacket()
+{
+  mPacket.buffer.reset();
+
+  while (true) {
+    uint32_t id;
+    uint64_t size;
+    int r = ReadElementHeader(&id, &size);
+    if (r != 1) {
+      return r;
+    }
+
+    switch (id) {
+    case ID_CLUSTER:
+      // サイズに関係なく中の要素を続けて読む。CRC-32 の次は Timecode でなければならない
+      r = ReadElementHeader(&id, &size);
+      if (r == 1 && id == ID_CRC32) {
+        r = Skip(size);
+        if (r == 1) {
+          r = ReadElementHeader(&id, &size);
+        }
+      }
+      if (r != 1) {
+        return r;
+      }
+      if (id != ID_TIMECODE) {
+        return -1;
+      }
+      r = ReadUInt(size, &mClusterTimecode);
+      if (r != 1) {
+        return r;
+      }
+      mHasClusterTimecode = true;
+      break;
+
+    case ID_SIMPLE_BLOCK:
+      r = ReadSimpleBlock(size);
+      if (r != BLOCK_SKIPPED) {
+        return r;
+      }
+      break;
+
+    case ID_BLOCK_GROUP:
+      r = ReadBlockGroup(size);
+      if (r != BLOCK_SKIPPED) {
+        return r;
+      }
+      break;
+
+    default:
+      r = Skip(size);
+      if (r != 1) {
+        return r;
+      }
+      break;
+    }
+  }
+}
+
+// 対象外のトラックなら BLOCK_SKIPPED。終端で途中までしか読めなければ
+// nestegg と同じく終端 (0) とする
+int
+WebmBlockParser::ReadSimpleBlock(uint64_t size)
+{
+  if (size > LIMIT_BLOCK || size == 0) {
+    return -1;
+  }
+
+  // 先に TrackNumber だけ読み、対象外なら本体は読まない
+  uint8_t head[8];
+  if (!Read(head, 1)) {
+    return 0;
+  }
+  int length = vint_length(head[0]);
+  if (length == 0 || (uint64_t)length > size) {
+    return -1;
+  }
+  if (length > 1 && !Read(head + 1, length - 1)) {
+    return 0;
+  }
+  uint64_t trackNumber;
+  read_vint(head, length, false, &trackNumber, &length);
+  int track = FindTrackIndex(trackNumber);
+  if (track < 0) {
+    return -1;
+  }
+  if (!IsTrackEnabled(track)) {
+    mSkippedBlocks++;
+    return (Skip(size - length) == 1) ? BLOCK_SKIPPED : -1;
+  }
+
+  Buffer buffer = AcquireBuffer((size_t)size);
+  uint8_t *data = buffer->data();
+  memcpy(data, head, length);
+  if (!Read(data + length, size - length)) {
+    return 0;
+  }
+  mPacket.buffer         = buffer;
+  mPacket.discardPadding = 0;
+  mPacket.hasAdditional  = false;
+  return ParseBlock(data, (size_t)size, 0, true);
+}
+
+int
+WebmBlockParser::ReadBlockGroup(uint64_t size)
+{
+  if (size > LIMIT_BLOCK) {
+    return -1;
+  }
+
+  // BlockGroup 全体を読んでメモリ上で解析する
+  Buffer buffer = AcquireBuffer((size_t)size);
+  uint8_t *data = buffer->data();
+  if (size > 0 && !Read(data, size)) {
+    return 0;
+  }
+
+  bool hasBlock          = false;
+  bool hasAdditions      = false;
+  int64_t discardPadding = 0;
+  mPacket.hasAdditional  = false;
+
+  size_t pos = 0;
+  while (pos < size) {
+    uint32_t id;
+    uint64_t childSize;
+    size_t dataPos;
+    if (!read_child_header(data, (size_t)size, pos, &id, &childSize, &dataPos)) {
+      return -1;
+    }
+    switch (id) {
+    case ID_BLOCK:
+      // 複数あれば nestegg と同じく最後のものを使う
+      if (ParseBlock(data + dataPos, (size_t)childSize, dataPos, false) != 1) {
+        return -1;
+      }
+      hasBlock = true;
+      break;
+    case ID_DISCARD_PADDING:
+      if (childSize == 0 || childSize > 8) {
+        return -1;
+      }
+      // 符号付き
+      discardPadding = (int64_t)(read_be(data + dataPos, (size_t)childSize)
+                                 << (64 - 8 * childSize)) >>
+                       (64 - 8 * childSize);
+      break;
+    case ID_BLOCK_ADDITIONS:
+      if (hasAdditions || !ParseBlockAdditions(data + dataPos, (size_t)childSize, dataPos)) {
+        return -1;
+      }
+      hasAdditions = true;
+      break;
+    default:
+      // ReferenceBlock は見ない。BlockGroup のブロックは nestegg ではキーフレーム不明
+      // (ReferenceBlock があれば非キーフレーム) になり、extractor はどちらも
+      // 非キーフレームとして扱う
+      break;
+    }
+    pos = dataPos + (size_t)childSize;
+  }
+
+  if (!hasBlock) {
+    return BLOCK_SKIPPED;
+  }
+  if (!IsTrackEnabled((int)mPacket.track)) {
+    mSkippedBlocks++;
+    return BLOCK_SKIPPED;
+  }
+  mPacket.buffer         = buffer;
+  mPacket.discardPadding = discardPadding;
+  return 1;
+}
+
+// data はバッファの offset の位置にあるブロック本体
+int
+WebmBlockParser::ParseBlock(const uint8_t *data, size_t size, size_t offset, bool isSimpleBlock)
+{
+  uint64_t trackNumber;
+  int length;
+  if (!read_vint(data, size, false, &trackNumber, &length) || size < (size_t)length + 3) {
+    return -1;
+  }
+  int track = FindTrackIndex(trackNumber);
+  if (track < 0 || !mHasClusterTimecode) {
+    return -1;
+  }
+  int16_t timecode = (int16_t)read_be(data + length, 2);
+  uint8_t flags    = data[length + 2];
+  size_t pos       = length + 3;
+
+  unsigned int frames = 1;
+  int lacing          = (flags & BLOCK_FLAG_LACING) >> 1;
+  if (lacing != LACING_NONE) {
+    if (pos >= size) {
+      return -1;
+    }
+    frames = data[pos++] + 1;
+    if (frames == 1 && lacing != LACING_FIXED) {
+      return -1;
+    }
+  }
+
+  Frame *out = mPacket.frames;
+  switch (lacing) {
+  case LACING_NONE:
+    out[0].size = (uint32_t)(size - pos);
+    break;
+  case LACING_XIPH:
+  case LACING_EBML: {
+    // 最後のフレーム以外のサイズが並び、最後は残り全部
+    uint64_t sum = 0;
+    for (unsigned int i = 0; i < frames - 1; i++) {
+      uint64_t frameSize = 0;
+      if (lacing == LACING_XIPH) {
+        uint8_t c;
+        do {
+          if (pos >= size) {
+            return -1;
+          }
+          c = data[pos++];
+          frameSize += c;
+        } while (c == 0xFF);
+      } else if (i == 0) {
+        if (!read_vint(data + pos, size - pos, false, &frameSize, &length) ||
+            frameSize == UNKNOWN_SIZE) {
+          return -1;
+        }
+        pos += length;
+      } else {
+        int64_t diff;
+        if (!read_svint(data + pos, size - pos, &diff, &length)) {
+          return -1;
+        }
+        pos += length;
+        int64_t signedSize = (int64_t)out[i - 1].size + diff;
+        if (signedSize < 0) {
+          return -1;
+        }
+        frameSize = (uint64_t)signedSize;
+      }
+      if (frameSize > LIMIT_FRAME) {
+        return -1;
+      }
+      out[i].size = (uint32_t)frameSize;
+      sum += frameSize;
+    }
+    if (pos + sum > size) {
+      return -1;
+    }
+    out[frames - 1].size = (uint32_t)(size - pos - sum);
+  } break;
+  case LACING_FIXED:
+    if ((size - pos) % frames) {
+      return -1;
+    }
+    for (unsigned int i = 0; i < frames; i++) {
+      out[i].size = (uint32_t)((size - pos) / frames);
+    }
+    break;
+  }
+
+  for (unsigned int i = 0; i < frames; i++) {
+    if (out[i].size > LIMIT_FRAME) {
+      return -1;
+    }
+    out[i].offset = (uint32_t)(offset + pos);
+    pos += out[i].size;
+  }
+
+  // 負の時刻は nestegg と同じく 0 にする
+  int64_t absTimecode = (int64_t)mClusterTimecode + timecode;
+  if (absTimecode < 0) {
+    absTimecode = 0;
+  }
+  mPacket.track       = (unsigned int)track;
+  mPacket.timeStampNs = (uint64_t)absTimecode * mTimecodeScale;
+  mPacket.isKeyFrame  = isSimpleBlock && (flags & BLOCK_FLAG_KEYFRAME);
+  mPacket.frameCount  = frames;
+  mBlockCount++;
+  return 1;
+}
+
+bool
+WebmBlockParser::ParseBlockAdditions(const uint8_t *data, size_t size, size_t offset)
+{
+  size_t pos = 0;
+  while (pos < size) {
+    uint32_t id;
+    uint64_t childSize;
+    size_t dataPos;
+    if (!read_child_header(data, size, pos, &id, &childSize, &dataPos)) {
+      return false;
+    }
+    if (id == ID_BLOCK_MORE) {
+      uint64_t addId      = 1;
+      bool hasAdditional  = false;
+      Frame additional    = {};
+      size_t morePos      = dataPos;
+      size_t moreEnd      = dataPos + (size_t)childSize;
+      while (morePos < moreEnd) {
+        uint32_t moreId;
+        uint64_t moreSize;
+        size_t moreDataPos;
+        if (!read_child_header(data, moreEnd, morePos, &moreId, &moreSize, &moreDataPos)) {
+          return false;
+        }
+        if (moreId == ID_BLOCK_ADD_ID) {
+          if (moreSize > 8) {
+            return false;
+          }
+          addId = read_be(data + moreDataPos, (size_t)moreSize);
+          if (addId == 0) {
+            return false;
+          }
+        } else if (moreId == ID_BLOCK_ADDITIONAL) {
+          if (hasAdditional) {
+            return false;
+          }
+          hasAdditional     = true;
+          additional.offset = (uint32_t)(offset + moreDataPos);
+          additional.size   = (uint32_t)moreSize;
+        }
+        morePos = moreDataPos + (size_t)moreSize;
+      }
+      if (!hasAdditional) {
+        return false;
+      }
+      // アルファは BlockAddID 1 (複数あれば nestegg と同じく最後のもの)
+      if (addId == 1) {
+        mPacket.hasAdditional = true;
+        mPacket.additional    = additional;
+      }
+    }
+    pos = dataPos + (size_t)childSize;
+  }
+  return true;
+}
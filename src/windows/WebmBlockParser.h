@@ -0,0 +1,105 @@
+#pragma once
+
+#include "MkvFileReader.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Cluster 内のブロック (SimpleBlock / BlockGroup) を nestegg を通さずに読む。
+// nestegg_read_packet と同じく Segment 直下を平坦に読み進め (Cluster の中に入ったら
+// Timecode を読み、以降の要素はそのまま続けて読む)、ブロック以外の要素は読み飛ばす。
+// ヘッダ・Tracks・Cues の解析とシークは nestegg に任せ、reader の現在位置から読む。
+//
+// ブロック要素は 1 回の Read でバッファに読み、フレームはその中の範囲として返す。
+// バッファは使い回すので、定常状態ではフレームごとのヒープ確保は無い。
+// ただし大きなブロック (高解像度のキーフレーム等) のバッファはプールに入れず、
+// 参照が無くなった時点で解放する (プールが最大のブロックの大きさで埋まらないように)。
+// Packet::buffer を持っている間はそのバッファは再利用されない (FramePacket が
+// 参照している間はデータが有効)。
+// 暗号化 (ContentEncryption) は扱わないので、暗号化トラックがあれば nestegg を使うこと。
+class WebmBlockParser
+{
+public:
+  // 1 ブロックのレーシングの最大フレーム数
+  static constexpr unsigned int MAX_FRAMES = 256;
+
+  typedef std::shared_ptr<std::vector<uint8_t>> Buffer;
+
+  struct Frame
+  {
+    uint32_t offset; // buffer 内の位置
+    uint32_t size;
+  };
+
+  struct Packet
+  {
+    unsigned int track; // トラック index
+    uint64_t timeStampNs;
+    bool isKeyFrame;
+    int64_t discardPadding; // ns (無ければ 0)
+    unsigned int frameCount;
+    Frame frames[MAX_FRAMES];
+    bool hasAdditional; // BlockAddID 1 の BlockAdditional (アルファ)
+    Frame additional;
+    Buffer buffer;
+  };
+
+  WebmBlockParser();
+
+  // trackNumbers はトラック index → TrackNumber (nestegg と同じ TrackEntry の並び順)。
+  // stats には nestegg の I/O コールバックと同じく Read/Seek を記録する
+  void Init(IMkvFileReader *reader, MkvReaderCounter *stats,
+            const std::vector<uint64_t> &trackNumbers, uint64_t timecodeScale);
+  // 対象外のトラックのブロックは本体を読まずに飛ばす (既定は全トラック)
+  void SetTrackEnabled(unsigned int track, bool isEnabled);
+
+  // 次の対象トラックのブロックを読む。戻り値は nestegg_read_packet と同じ
+  // (1: 成功, 0: 終端, -1: エラー)
+  int ReadPacket();
+  const Packet &GetPacket() const { return mPacket; }
+  // 現在のパケットのバッファを手放す (参照が無くなれば次のブロックで再利用される)
+  void ReleasePacket() { mPacket.buffer.reset(); }
+
+  // 統計情報
+  uint64_t GetBlockCount() const { return mBlockCount; }
+  uint64_t GetSkippedBlocks() const { return mSkippedBlocks; }
+  size_t GetBufferCount() const { return mBuffers.size(); }
+
+private:
+  WebmBlockParser(const WebmBlockParser &);
+  WebmBlockParser &operator=(const WebmBlockParser &);
+
+  bool Read(void *buffer, uint64_t length);
+  int ReadElementHeader(uint32_t *id, uint64_t *size);
+  int ReadUInt(uint64_t size, uint64_t *value);
+  int Skip(uint64_t size);
+  int ReadSimpleBlock(uint64_t size);
+  int ReadBlockGroup(uint64_t size);
+  int ParseBlock(const uint8_t *data, size_t size, size_t offset, bool isSimpleBlock);
+  bool ParseBlockAdditions(const uint8_t *data, size_t size, size_t offset);
+  int FindTrackIndex(uint64_t trackNumber) const;
+  bool IsTrackEnabled(int track) const;
+  Buffer AcquireBuffer(size_t size);
+
+  // プールに持つバッファの数と、1 つのバッファの大きさの上限
+  static constexpr size_t MAX_POOLED_BUFFERS     = 128;
+  static constexpr size_t MAX_POOLED_BUFFER_SIZE = 256 * 1024;
+
+  IMkvFileReader *mReader;
+  MkvReaderCounter *mStats;
+  std::vector<uint64_t> mTrackNumbers;
+  std::vector<bool> mTrackEnabled;
+  uint64_t mTimecodeScale;
+  uint64_t mClusterTimecode;
+  bool mHasClusterTimecode;
+
+  Packet mPacket;
+
+  // ブロックの読み込みバッファ (使い回し)
+  std::vector<Buffer> mBuffers;
+  size_t mNextBuffer;
+
+  // 統計情報
+  uint64_t mBlockCount, mSkippedBlocks;
+};
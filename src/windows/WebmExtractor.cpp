@@ -7,18 +7,60 @@
 #include <algorithm>
 #include <stdarg.h>
 
-WebmExtractor::WebmExtractor()
-: mCtx(nullptr)
+void
+WebmExtractor::Config::Init()
+{
+  streamBufferSize   = 256 * 1024;
+  prefetchSize       = 0;
+  prefetchSeconds    = 0.0f;
+  loopCacheSize      = 0;
+  maxClusterReadSize = 0;
+  streamForwardOnly  = false;
+  followFile         = false;
+  followLatencyMs    = 100;
+  followTimeoutMs    = 0;
+  memoryMappedFile   = false;
+  metadataOnly       = false;
+  useBlockParser     = true;
+  contentKeyCallback = nullptr;
+}
+
+WebmExtractor::WebmExtractor(const Config &config)
+: mConfig(config)
+, mCtx(nullptr)
 , mTracks(0)
 , mVideoTrack(-1)
 , mAudioTrack(-1)
+, mSeekTrack(-1)
 , mPkt(nullptr)
+, mDecryptedFrameIndex(-1)
+, mBlockParser(nullptr)
+, mHasBlock(false)
 , mReader(nullptr)
+, mSeekIndex(nullptr)
+, mCache(nullptr)
+, mCacheState(CACHE_DISABLED)
+, mIsCacheReplaying(false)
+, mCacheIndex(0)
+, mCacheNext(0)
 {
+  mIsMemorySource   = false;
+  mIsForwardOnly    = false;
+  mIsFollowing      = false;
+  mIsSegmented      = false;
   mIsReachedEOS     = false;
   mIsFirstRead      = true;
+  mIsWaitingData    = false;
+  mWaitDataSize     = 0;
+  mWaitBeginUs      = -1;
+  mLastPollUs       = 0;
   mTimeStampNs      = -1;
   mDurationUs       = -1;
+
+  mLastVideoTimeStampNs = -1;
+  mVideoSkipUntilNs     = -1;
+  mAudioSkipBeforeNs    = -1;
+
   mFrames           = 0;
   mFrameIndex       = 0;
   mCurrentTrack     = -1;
@@ -26,18 +68,42 @@ WebmExtractor::WebmExtractor()
   mDiscardPadding   = 0;
   mIsKeyFrame       = false;
   mVideoAlphaMode   = false;
+
+  if (mConfig.loopCacheSize > 0) {
+    // 開いた直後は先頭から読むので、そのまま記録を始める
+    mCache      = new FramePacketCache(mConfig.loopCacheSize);
+    mCacheState = CACHE_RECORDING;
+  }
 }
 
 WebmExtractor::~WebmExtractor()
 {
-  if (mPkt) {
-    nestegg_free_packet(mPkt);
-    mPkt = nullptr;
+  if (mCache) {
+    LOGV("loop cache: state=%d packets=%zu size=%zu\n", mCacheState, mCache->GetCount(),
+         mCache->GetUsedSize());
+    delete mCache;
+    mCache = nullptr;
+  }
+  FreePacket();
+  if (mBlockParser) {
+    LOGV("block parser: blocks=%" PRIu64 " skipped=%" PRIu64 " buffers=%zu\n",
+         mBlockParser->GetBlockCount(), mBlockParser->GetSkippedBlocks(),
+         mBlockParser->GetBufferCount());
+    delete mBlockParser;
+    mBlockParser = nullptr;
   }
   if (mCtx) {
     nestegg_destroy(mCtx);
     mCtx = nullptr;
   }
+  if (mSeekIndex) {
+    delete mSeekIndex;
+    mSeekIndex = nullptr;
+  }
+  for (AesCtrDecryptor *decryptor : mDecryptors) {
+    delete decryptor;
+  }
+  mDecryptors.clear();
   if (mReader) {
     delete mReader;
     mReader = nullptr;
@@ -68,13 +134,23 @@ WebmExtractor::NestEggLogCallback(nestegg *ctx, unsigned int severity, char cons
 int
 WebmExtractor::MyRead(void *buffer, size_t length, void *userdata)
 {
-  return ((WebmExtractor *)userdata)->mReader->Read(buffer, length);
+  WebmExtractor *self = (WebmExtractor *)userdata;
+
+  int64_t begin = get_time_us();
+  int ret       = self->mReader->Read(buffer, length);
+  self->mDemuxStats.AddRead(length, get_time_us() - begin);
+  return ret;
 }
 
 int
 WebmExtractor::MySeek(int64_t offset, int whence, void *userdata)
 {
-  return ((WebmExtractor *)userdata)->mReader->Seek(offset, whence);
+  WebmExtractor *self = (WebmExtractor *)userdata;
+
+  int64_t from = self->mReader->Tell();
+  int ret      = self->mReader->Seek(offset, whence);
+  self->mDemuxStats.AddSeek(from, self->mReader->Tell());
+  return ret;
 }
 
 int64_t
@@ -91,10 +167,22 @@ WebmExtractor::Open(const std::string &filePath)
     return false;
   }
 
-  if (!(mReader = IMkvFileReader::Create(filePath.c_str()))) {
+  if (mConfig.followFile) {
+    mReader      = IMkvFileReader::CreateGrowing(filePath.c_str());
+    mIsFollowing = true;
+  } else {
+    if (mConfig.memoryMappedFile) {
+      mReader = IMkvFileReader::CreateMapped(filePath.c_str());
+    }
+    if (!mReader) {
+      mReader = IMkvFileReader::Create(filePath.c_str());
+    }
+  }
+  if (!mReader) {
     LOGV("fail to open movie file: %s\n", filePath.c_str());
     return false;
   }
+  mFilePath = filePath;
 
   return OpenSetup();
 }
@@ -108,7 +196,13 @@ WebmExtractor::Open(IMovieReadStream *stream)
     return false;
   }
 
-  if (!(mReader = IMkvFileReader::Create(stream))) {
+  if (mConfig.streamForwardOnly) {
+    mReader        = IMkvFileReader::CreateForwardOnly(stream, mConfig.streamBufferSize);
+    mIsForwardOnly = true;
+  } else {
+    mReader = IMkvFileReader::Create(stream, mConfig.streamBufferSize);
+  }
+  if (!mReader) {
     LOGV("fail to open movie stream\n");
     return false;
   }
@@ -116,11 +210,66 @@ WebmExtractor::Open(IMovieReadStream *stream)
   return OpenSetup();
 }
 
+bool
+WebmExtractor::Open(const void *data, size_t size)
+{
+  if (!data || size == 0) {
+    LOGE("invalid memory data.\n");
+    return false;
+  }
+
+  if (!(mReader = IMkvFileReader::Create(data, size))) {
+    LOGV("fail to open movie data\n");
+    return false;
+  }
+  mIsMemorySource = true;
+
+  return OpenSetup();
+}
+
+bool
+WebmExtractor::Open(int fd, int64_t offset, int64_t length)
+{
+  if (fd < 0) {
+    LOGE("invalid fd.\n");
+    return false;
+  }
+
+  if (mConfig.memoryMappedFile) {
+    mReader = IMkvFileReader::CreateMapped(fd, offset, length);
+  }
+  if (!mReader && !(mReader = IMkvFileReader::Create(fd, offset, length))) {
+    LOGV("fail to open movie fd: fd=%d offset=%" PRId64 "\n", fd, offset);
+    return false;
+  }
+
+  return OpenSetup();
+}
+
+bool
+WebmExtractor::Open(const std::vector<std::string> &segmentPaths)
+{
+  if (segmentPaths.empty()) {
+    LOGE("invalid segment list.\n");
+    return false;
+  }
+
+  if (!(mReader = IMkvFileReader::CreateSegmented(segmentPaths))) {
+    LOGV("fail to open movie segments: %s\n", segmentPaths[0].c_str());
+    return false;
+  }
+  mIsSegmented = true;
+
+  return OpenSetup();
+}
+
 bool
 WebmExtractor::OpenSetup()
 {
   int ret;
 
+  SetupClusterReader();
+
   nestegg_io io = { &MyRead, &MySeek, &MyTell, this };
   ret           = nestegg_init(&mCtx, io, &NestEggLogCallback, -1);
   if (ret < 0) {
@@ -128,13 +277,29 @@ WebmExtractor::OpenSetup()
     return false;
   }
 
+  LoadSeekIndexFile();
+  SetupSegmentIndex();
+
   uint64_t duration;
   ret = nestegg_duration(mCtx, &duration);
-  if (ret < 0) {
-    LOGE("unknown duration: using 10s default\n");
-    duration = (uint64_t)1e9 * 10;
+  if (ret < 0 && (mIsForwardOnly || mIsFollowing)) {
+    // 末尾を見に行けない (書き込み中はまだ無い) ので不明のまま再生する
+    LOGV("unknown duration\n");
+    mDurationUs = (uint64_t)-1;
+  } else {
+    if (ret < 0 && !(mSeekIndex && mSeekIndex->GetDurationNs(&duration))) {
+      // 索引ファイルも無ければ末尾の Cluster から求める
+      WebmSeekIndex tailIndex;
+      if (!tailIndex.ScanDuration(mReader, &duration)) {
+        LOGE("unknown duration: using 10s default\n");
+        duration = (uint64_t)1e9 * 10;
+      }
+    }
+    mDurationUs = (uint64_t)(duration / 1000);
   }
-  mDurationUs = (uint64_t)(duration / 1000);
+
+  SetupPrefetch();
+  SetupSeekIndex();
 
   ret = nestegg_track_count(mCtx, &mTracks);
   if (ret < 0) {
@@ -145,9 +310,200 @@ WebmExtractor::OpenSetup()
   }
   LOGV("tracks=%u\n", mTracks);
 
+  if (!SetupDecryption()) {
+    nestegg_destroy(mCtx);
+    mCtx = nullptr;
+    return false;
+  }
+
+  SetupBlockParser();
+
   return true;
 }
 
+void
+WebmExtractor::SetupBlockParser()
+{
+  // 書き込み中のファイルは nestegg_read_reset で読みかけのブロックを戻すので nestegg で読む
+  if (!mConfig.useBlockParser || mConfig.metadataOnly || mIsForwardOnly || mIsFollowing) {
+    return;
+  }
+  for (AesCtrDecryptor *decryptor : mDecryptors) {
+    if (decryptor) {
+      return;
+    }
+  }
+
+  // nestegg はトラック番号を返さないので、ヘッダを別に読んで TrackEntry の並びを取る
+  WebmSeekIndex header;
+  int64_t position = mReader->Tell();
+  if (!header.ReadHeader(mReader) || header.GetTrackNumbers().size() != mTracks) {
+    LOGV("block parser disabled: unsupported header\n");
+    mReader->Seek(position, SEEK_SET);
+    return;
+  }
+
+  mBlockParser = new WebmBlockParser();
+  mBlockParser->Init(mReader, &mDemuxStats, header.GetTrackNumbers(),
+                     header.GetTimecodeScale());
+  UpdateBlockParserTracks();
+  // nestegg_init は最初の Cluster のヘッダまで読んでいるので、Cluster の先頭から読み直す
+  mReader->Seek(header.GetFirstClusterOffset(), SEEK_SET);
+}
+
+void
+WebmExtractor::UpdateBlockParserTracks()
+{
+  if (!mBlockParser) {
+    return;
+  }
+  for (unsigned int i = 0; i < mTracks; i++) {
+    mBlockParser->SetTrackEnabled(i, (int)i == mVideoTrack || (int)i == mAudioTrack);
+  }
+}
+
+bool
+WebmExtractor::SetupDecryption()
+{
+  // 情報を取るだけなら鍵は要らない
+  if (mConfig.metadataOnly) {
+    return true;
+  }
+
+  mDecryptors.assign(mTracks, nullptr);
+  for (unsigned int i = 0; i < mTracks; i++) {
+    if (nestegg_track_encoding(mCtx, i) != NESTEGG_ENCODING_ENCRYPTION) {
+      continue;
+    }
+    const unsigned char *keyId = nullptr;
+    size_t keyIdLength         = 0;
+    nestegg_track_content_enc_key_id(mCtx, i, &keyId, &keyIdLength);
+
+    uint8_t key[AesCtrDecryptor::KEY_SIZE];
+    if (!mConfig.contentKeyCallback ||
+        !mConfig.contentKeyCallback(keyId, keyIdLength, key)) {
+      LOGE("no content key for encrypted track #%u\n", i);
+      return false;
+    }
+    AesCtrDecryptor *decryptor = new AesCtrDecryptor();
+    bool success               = decryptor->SetKey(key, sizeof(key));
+    memset(key, 0, sizeof(key));
+    if (!success) {
+      delete decryptor;
+      return false;
+    }
+    mDecryptors[i] = decryptor;
+    LOGV("track #%u is encrypted (aes: %s)\n", i, decryptor->IsHardware() ? "hardware" : "c");
+  }
+  return true;
+}
+
+void
+WebmExtractor::SetupClusterReader()
+{
+  // メモリ上のデータは読み込みコストが無く、先読み有効時は先読みスレッドがまとめて読む
+  bool isPrefetchEnabled = (mConfig.prefetchSize > 0 || mConfig.prefetchSeconds > 0.0f);
+  // セグメントファイルはファイルごとメモリに読み込まれる
+  if (mConfig.maxClusterReadSize == 0 || mConfig.metadataOnly || mIsMemorySource ||
+      mIsForwardOnly || mIsFollowing || mIsSegmented || isPrefetchEnabled) {
+    return;
+  }
+
+  IMkvFileReader *reader =
+    IMkvFileReader::CreateClusterReader(mReader, mConfig.maxClusterReadSize);
+  if (reader) {
+    mReader = reader;
+  }
+}
+
+void
+WebmExtractor::SetupPrefetch()
+{
+  size_t windowSize = mConfig.prefetchSize;
+  if (mConfig.prefetchSeconds > 0.0f) {
+    int64_t fileSize = mReader->Size();
+    if (fileSize > 0 && mDurationUs > 0) {
+      double bytesPerSec = (double)fileSize * 1000000.0 / (double)mDurationUs;
+      windowSize         = (size_t)(bytesPerSec * mConfig.prefetchSeconds);
+    }
+  }
+  // 先読みスレッドは ReadAt で読むので、前方読みのみの stream では使えない。
+  // 書き込み中のファイルは終端を越えて先読みできない。
+  // セグメントファイルは reader が次のセグメントを先読みする
+  if (windowSize == 0 || mConfig.metadataOnly || mIsMemorySource || mIsForwardOnly ||
+      mIsFollowing || mIsSegmented) {
+    return;
+  }
+
+  // nestegg_init 後 (ヘッダ読み込み済み) の位置から先読みを開始する
+  IMkvFileReader *prefetch = IMkvFileReader::CreatePrefetch(mReader, windowSize);
+  if (prefetch) {
+    LOGV("prefetch enabled: window=%zu\n", windowSize);
+    mReader = prefetch;
+  }
+}
+
+void
+WebmExtractor::LoadSeekIndexFile()
+{
+  if (mFilePath.empty() || mIsFollowing) {
+    return;
+  }
+
+  // 事前に作った索引ファイルがあれば、Cues の有無に関わらずそちらでシークする
+  std::string indexPath = WebmSeekIndex::GetIndexFilePath(mFilePath);
+  mSeekIndex            = new WebmSeekIndex();
+  if (!mSeekIndex->Load(indexPath, mFilePath, mReader)) {
+    delete mSeekIndex;
+    mSeekIndex = nullptr;
+  }
+}
+
+void
+WebmExtractor::SetupSegmentIndex()
+{
+  if (!mIsSegmented) {
+    return;
+  }
+
+  // セグメント先頭の Cluster から直接シークする。
+  // 初期化セグメントに尺が無ければ最後のセグメントから求める
+  uint64_t duration;
+  bool scanDuration = (nestegg_duration(mCtx, &duration) < 0);
+  mSeekIndex        = new WebmSeekIndex();
+  if (!mSeekIndex->StartSegments(mReader, scanDuration)) {
+    delete mSeekIndex;
+    mSeekIndex = nullptr;
+  }
+}
+
+void
+WebmExtractor::SetupSeekIndex()
+{
+  if (mSeekIndex || mConfig.metadataOnly || mIsForwardOnly || mIsFollowing ||
+      nestegg_has_cues(mCtx)) {
+    return;
+  }
+
+  // Cues が無いとシークできないので、裏で Cluster の索引を作る
+  mSeekIndex = new WebmSeekIndex();
+  if (!mSeekIndex->Start(mReader)) {
+    delete mSeekIndex;
+    mSeekIndex = nullptr;
+  }
+}
+
+void
+WebmExtractor::GetIOStats(MkvReaderStats *demux, MkvReaderStats *storage) const
+{
+  mDemuxStats.Get(demux);
+  if (mReader) {
+    mReader->GetStats(storage);
+  } else {
+    storage->Init();
+  }
+}
+
 size_t
 WebmExtractor::GetTrackCount()
 {
@@ -243,6 +599,15 @@ WebmExtractor::GetCodecPrivateData(int32_t trackIndex,
   return true;
 }
 
+bool
+WebmExtractor::CanSeekTo(long long positionUs) const
+{
+  if (IsSeekable()) {
+    return true;
+  }
+  return (positionUs <= 0 && mCache && mCacheState == CACHE_READY);
+}
+
 bool
 WebmExtractor::SeekTo(long long positionUs)
 {
@@ -250,32 +615,100 @@ WebmExtractor::SeekTo(long long positionUs)
     LOGE("data source is not opened.\n");
     return false;
   }
-
-  int64_t posNs = us_to_ns((int64_t)positionUs);
-  if (!nestegg_has_cues(mCtx)) {
-    posNs = 0;
+  if (!CanSeekTo(positionUs)) {
+    LOGV("seek is not supported: %lldus\n", positionUs);
+    return false;
   }
 
-  if (mVideoTrack >= 0) {
-    nestegg_track_seek(mCtx, mVideoTrack, posNs);
+  // 先頭へのシーク (ループ) はキャッシュがそろっていればそこから流す
+  mIsCacheReplaying = false;
+  if (mCache) {
+    if (positionUs <= 0 && mCacheState == CACHE_READY) {
+      mIsCacheReplaying = true;
+    } else if (positionUs <= 0 && mCacheState != CACHE_DISABLED) {
+      mCache->Clear();
+      mCacheState = CACHE_RECORDING;
+    } else if (mCacheState == CACHE_RECORDING) {
+      // 途中からの記録は使えないので次に先頭から読むまで止める
+      mCache->Clear();
+      mCacheState = CACHE_IDLE;
+    }
   }
-  if (mAudioTrack >= 0) {
-    nestegg_track_seek(mCtx, mAudioTrack, posNs);
+
+  int64_t posNs = us_to_ns((int64_t)positionUs);
+  if (mIsCacheReplaying) {
+    // nestegg の読み込み位置はそのままでよい
+  } else if (mSeekIndex) {
+    // Cues 無し (またはセグメントファイル群): 索引から直前のキーフレームの Cluster へ。
+    // 索引が間に合っていなければ先頭から
+    int trackIndex = (mSeekTrack >= 0)    ? mSeekTrack
+                     : (mVideoTrack >= 0) ? mVideoTrack
+                                          : mAudioTrack;
+    int64_t offset;
+    if (!mSeekIndex->Find(posNs, trackIndex, &offset)) {
+      LOGV("seek index not ready: pos=%" PRId64 "ns\n", posNs);
+      offset = mSeekIndex->GetFirstClusterOffset();
+    }
+    nestegg_offset_seek(mCtx, offset);
+  } else {
+    if (!nestegg_has_cues(mCtx)) {
+      posNs = 0;
+    }
+
+    if (mSeekTrack >= 0) {
+      nestegg_track_seek(mCtx, mSeekTrack, posNs);
+    } else {
+      if (mVideoTrack >= 0) {
+        nestegg_track_seek(mCtx, mVideoTrack, posNs);
+      }
+      if (mAudioTrack >= 0) {
+        nestegg_track_seek(mCtx, mAudioTrack, posNs);
+      }
+    }
   }
   // カーソル情報をリセット
-  if (mPkt) {
-    nestegg_free_packet(mPkt);
-    mPkt = nullptr;
-  }
+  FreePacket();
 
   mIsReachedEOS     = false;
   mIsFirstRead      = true;
+  mIsWaitingData    = false;
   mTimeStampNs      = -1;
   mCurrentTrack     = -1;
   mCurrentTrackType = TRACK_TYPE_UNKNOWN;
   mFrames           = 0;
   mFrameIndex       = 0;
+  mCacheIndex       = 0;
+  mCacheNext        = 0;
+
+  mLastVideoTimeStampNs = -1;
+  mVideoSkipUntilNs     = -1;
+  mAudioSkipBeforeNs    = -1;
+
+  return true;
+}
+
+bool
+WebmExtractor::SwitchAudioTrack(int32_t trackIndex, long long positionUs)
+{
+  if (!IsSeekable()) {
+    LOGV("audio track switch is not supported: stream is not seekable\n");
+    return false;
+  }
 
+  // 読み出し済みのビデオはデコーダ側に渡っているので、シーク後はその次から
+  int64_t lastVideoNs = (mVideoTrack >= 0) ? mLastVideoTimeStampNs : -1;
+  if (!SelectTrack(TRACK_TYPE_AUDIO, trackIndex) || !SeekTo(positionUs)) {
+    return false;
+  }
+  mVideoSkipUntilNs  = lastVideoNs;
+  mAudioSkipBeforeNs = us_to_ns((int64_t)positionUs);
+
+  // 先頭からでも、読み出し済みのビデオを飛ばすのでループ用の記録には使えない。
+  // 次に SeekTo で先頭から読むときに記録し直す
+  if (mCacheState == CACHE_RECORDING) {
+    mCache->Clear();
+    mCacheState = CACHE_IDLE;
+  }
   return true;
 }
 
@@ -284,6 +717,11 @@ WebmExtractor::SelectTrack(TrackType type, int32_t trackIndex)
 {
   switch (type) {
   case TRACK_TYPE_VIDEO: {
+    if (trackIndex < 0) {
+      mVideoTrack     = -1;
+      mVideoAlphaMode = false;
+      break;
+    }
     nestegg_video_params vparams;
     int ret = nestegg_track_video_params(mCtx, trackIndex, &vparams);
     if (ret < 0) {
@@ -294,9 +732,18 @@ WebmExtractor::SelectTrack(TrackType type, int32_t trackIndex)
     mVideoAlphaMode = vparams.alpha_mode;
   } break;
   case TRACK_TYPE_AUDIO:
+    trackIndex = (trackIndex < 0) ? -1 : trackIndex;
+    if (mAudioTrack != trackIndex && mCache && mCache->GetCount() > 0 &&
+        mCacheState != CACHE_DISABLED) {
+      // 記録済みのパケットは前のトラックのものなので、次に先頭から読むときに取り直す
+      mCache->Clear();
+      mCacheState       = CACHE_IDLE;
+      mIsCacheReplaying = false;
+    }
     mAudioTrack = trackIndex;
     break;
   }
+  UpdateBlockParserTracks();
   return true;
 }
 
@@ -313,11 +760,63 @@ TrackType
 WebmExtractor::NextFramePacketType()
 {
   CheckFirstTouch();
+  if (mIsWaitingData) {
+    PollData();
+  }
   return mCurrentTrackType;
 }
 
+bool
+WebmExtractor::WaitData()
+{
+  int64_t now = get_time_us();
+  if (mWaitBeginUs < 0) {
+    mWaitBeginUs = now;
+  } else if (mConfig.followTimeoutMs > 0 &&
+             now - mWaitBeginUs >= (int64_t)mConfig.followTimeoutMs * 1000) {
+    LOGV("follow: no data for %dms, end of stream\n", mConfig.followTimeoutMs);
+    return false;
+  }
+
+  // 書き込み途中のブロックを読みかけているかもしれないので、
+  // 最後に読み切ったブロックの後ろまで戻しておく
+  nestegg_read_reset(mCtx);
+  mIsWaitingData = true;
+  mWaitDataSize  = mReader->Size();
+  mLastPollUs    = now;
+  return true;
+}
+
+void
+WebmExtractor::PollData()
+{
+  int64_t now = get_time_us();
+  if (now - mLastPollUs < (int64_t)mConfig.followLatencyMs * 1000) {
+    return;
+  }
+  mLastPollUs = now;
+
+  // サイズが増えていたら続きを読む。増えていなくてもタイムアウト判定のために読みに行く
+  bool isTimedOut = (mConfig.followTimeoutMs > 0 &&
+                     now - mWaitBeginUs >= (int64_t)mConfig.followTimeoutMs * 1000);
+  if (mReader->Size() > mWaitDataSize || isTimedOut) {
+    mIsWaitingData = false;
+    Advance();
+  }
+}
+
 bool
 WebmExtractor::ReadSampleData(FramePacket *packet)
+{
+  bool success = ReadFrameData(packet);
+  if (success && packet->type == TRACK_TYPE_VIDEO) {
+    mLastVideoTimeStampNs = (int64_t)packet->timeStampNs;
+  }
+  return success;
+}
+
+bool
+WebmExtractor::ReadFrameData(FramePacket *packet)
 {
   ASSERT(packet != nullptr, "invalid packet addr\n");
 
@@ -328,12 +827,24 @@ WebmExtractor::ReadSampleData(FramePacket *packet)
     return false;
   }
 
-  if (!mPkt) {
+  // 前のフレームの参照が残っていれば返しておく
+  packet->ReturnBorrowed();
+
+  if (mIsCacheReplaying) {
+    mCache->Get(mCacheIndex, packet);
+    return true;
+  }
+
+  if (!HasPacket()) {
     LOGE("invalid packet.\n");
     packet->InitAsEOS();
     return false;
   }
 
+  if (mHasBlock) {
+    return ReadBlockData(packet);
+  }
+
   unsigned char *data;
   size_t length;
   int ret = nestegg_packet_data(mPkt, mFrameIndex, &data, &length);
@@ -343,14 +854,34 @@ WebmExtractor::ReadSampleData(FramePacket *packet)
     return false;
   }
 
-  packet->Resize(length);
-  if (packet->data == nullptr) {
-    LOGE("packet data allocation failed.\n");
-    return false;
+  // 暗号化されたブロックは nestegg_packet のバッファ上でその場で復号する
+  AesCtrDecryptor *decryptor =
+    (mCurrentTrack < mDecryptors.size()) ? mDecryptors[mCurrentTrack] : nullptr;
+  int encryption =
+    decryptor ? nestegg_packet_encryption(mPkt) : NESTEGG_PACKET_HAS_SIGNAL_BYTE_FALSE;
+  bool isEncrypted = (encryption == NESTEGG_PACKET_HAS_SIGNAL_BYTE_ENCRYPTED ||
+                      encryption == NESTEGG_PACKET_HAS_SIGNAL_BYTE_PARTITIONED);
+  bool isDecrypted = true;
+  if (isEncrypted && mDecryptedFrameIndex != (int)mFrameIndex) {
+    isDecrypted = DecryptPacket(decryptor, encryption, data, length);
+    if (isDecrypted) {
+      mDecryptedFrameIndex = mFrameIndex; // 同じフレームを読み直しても二重に復号しない
+    }
   }
 
-  memcpy(packet->data, data, length);
-  packet->dataSize    = length;
+  // reader のメモリ上にそのままあるデータならそこを、無ければ nestegg_packet の
+  // バッファを参照する (どちらもコピーしない)
+  const uint8_t *src = isEncrypted ? nullptr : mReader->FindReadSource(data, length);
+  if (src) {
+    packet->BorrowData(src, length);
+  } else {
+    packet->BorrowData(data, length);
+    packet->SetDataOwner(GetPacketOwner());
+  }
+  if (!isDecrypted) {
+    LOGE("packet decryption failed.\n");
+    packet->dataSize = 0;
+  }
   packet->trackNum    = mCurrentTrack;
   packet->isKeyFrame  = mIsKeyFrame;
   packet->arg         = mDiscardPadding;
@@ -365,10 +896,12 @@ WebmExtractor::ReadSampleData(FramePacket *packet)
       LOGE("packet additionaldata failed.\n");
       packet->ReleaseAdd();
     } else {
-      packet->ResizeAdd(add_length);
-      if (packet->adddata) {
-        packet->adddataSize = add_length;
-        memcpy(packet->adddata, add_data, add_length);
+      const uint8_t *add_src = mReader->FindReadSource(add_data, add_length);
+      if (add_src) {
+        packet->BorrowAddData(add_src, add_length);
+      } else {
+        packet->BorrowAddData(add_data, add_length);
+        packet->SetDataOwner(GetPacketOwner());
       }
     }
   }
@@ -377,15 +910,163 @@ WebmExtractor::ReadSampleData(FramePacket *packet)
   packet->PrintInfo(mFrameIndex);
 #endif
 
+  if (mCacheState == CACHE_RECORDING) {
+    AddToCache(*packet);
+  }
+
   return true;
 }
 
+bool
+WebmExtractor::ReadBlockData(FramePacket *packet)
+{
+  const WebmBlockParser::Packet &block = mBlockParser->GetPacket();
+  if (mFrameIndex >= block.frameCount) {
+    LOGV("end of packet frame\n");
+    mIsReachedEOS = true;
+    return false;
+  }
+
+  // nestegg_packet と同じく、reader のメモリ上にあればそこを、無ければ
+  // パーサのバッファを参照する
+  const WebmBlockParser::Frame &frame = block.frames[mFrameIndex];
+  const uint8_t *data                 = block.buffer->data() + frame.offset;
+  const uint8_t *src                  = mReader->FindReadSource(data, frame.size);
+  if (src) {
+    packet->BorrowData(src, frame.size);
+  } else {
+    packet->BorrowData(data, frame.size);
+    packet->SetDataOwner(block.buffer);
+  }
+  packet->trackNum    = mCurrentTrack;
+  packet->isKeyFrame  = mIsKeyFrame;
+  packet->arg         = mDiscardPadding;
+  packet->type        = mCurrentTrackType;
+  packet->timeStampNs = mTimeStampNs;
+
+  if (mCurrentTrackType == TRACK_TYPE_VIDEO && mVideoAlphaMode) {
+    if (!block.hasAdditional) {
+      LOGE("packet additionaldata failed.\n");
+      packet->ReleaseAdd();
+    } else {
+      const uint8_t *add_data = block.buffer->data() + block.additional.offset;
+      const uint8_t *add_src  = mReader->FindReadSource(add_data, block.additional.size);
+      if (add_src) {
+        packet->BorrowAddData(add_src, block.additional.size);
+      } else {
+        packet->BorrowAddData(add_data, block.additional.size);
+        packet->SetDataOwner(block.buffer);
+      }
+    }
+  }
+
+#if defined(DEBUG_INFO_PACKET)
+  packet->PrintInfo(mFrameIndex);
+#endif
+
+  if (mCacheState == CACHE_RECORDING) {
+    AddToCache(*packet);
+  }
+
+  return true;
+}
+
+bool
+WebmExtractor::DecryptPacket(AesCtrDecryptor *decryptor, int encryption, uint8_t *data,
+                             size_t size)
+{
+  const unsigned char *iv;
+  size_t ivLength;
+  if (nestegg_packet_iv(mPkt, &iv, &ivLength) < 0) {
+    return false;
+  }
+  decryptor->Start(iv, ivLength);
+  if (encryption == NESTEGG_PACKET_HAS_SIGNAL_BYTE_ENCRYPTED) {
+    decryptor->Apply(data, size);
+    return true;
+  }
+
+  // パーティション分割: オフセットで区切った範囲が平文・暗号文の順に交互に並び、
+  // 暗号文の範囲は 1 つの鍵ストリームで続けて暗号化されている
+  const uint32_t *offsets;
+  uint8_t count;
+  if (nestegg_packet_offsets(mPkt, &offsets, &count) < 0) {
+    return false;
+  }
+  size_t begin = 0;
+  for (unsigned int i = 0; i <= count; i++) {
+    size_t end = (i < count) ? offsets[i] : size;
+    if (end < begin || end > size) {
+      return false;
+    }
+    if (i & 1) {
+      decryptor->Apply(data + begin, end - begin);
+    }
+    begin = end;
+  }
+  return true;
+}
+
+void
+WebmExtractor::AddToCache(const FramePacket &packet)
+{
+  if (!mCache->Add(packet)) {
+    LOGV("loop cache disabled: exceeds %zu bytes\n", mConfig.loopCacheSize);
+    mCache->Clear();
+    mCacheState = CACHE_DISABLED;
+  }
+}
+
+bool
+WebmExtractor::AdvanceCache()
+{
+  if (mCacheNext >= mCache->GetCount()) {
+    mCurrentTrackType = TRACK_TYPE_UNKNOWN;
+    mIsReachedEOS     = true;
+    return true;
+  }
+  mCacheIndex       = mCacheNext++;
+  mCurrentTrackType = mCache->GetType(mCacheIndex);
+  return true;
+}
+
+std::shared_ptr<void>
+WebmExtractor::GetPacketOwner()
+{
+  // reader のメモリを参照できた packet では作らずに済ませる
+  if (!mPktOwner) {
+    mPktOwner.reset(mPkt, nestegg_free_packet);
+  }
+  return mPktOwner;
+}
+
+void
+WebmExtractor::FreePacket()
+{
+  // FramePacket が参照中なら、最後の参照が無くなった時点で解放される
+  if (mPktOwner) {
+    mPktOwner.reset();
+  } else if (mPkt) {
+    nestegg_free_packet(mPkt);
+  }
+  mPkt                 = nullptr;
+  mDecryptedFrameIndex = -1;
+  if (mBlockParser) {
+    mBlockParser->ReleasePacket();
+  }
+  mHasBlock = false;
+}
+
 bool
 WebmExtractor::Advance()
 {
   int ret;
 
-  if (mPkt && ++mFrameIndex < mFrames) {
+  if (mIsCacheReplaying) {
+    return mIsReachedEOS ? true : AdvanceCache();
+  }
+
+  if (HasPacket() && ++mFrameIndex < mFrames) {
     return true;
   }
 
@@ -395,10 +1076,7 @@ WebmExtractor::Advance()
 
   while (true) {
 
-    if (mPkt) {
-      nestegg_free_packet(mPkt);
-      mPkt = nullptr;
-    }
+    FreePacket();
 
     mFrames           = 0;
     mFrameIndex       = 0;
@@ -406,12 +1084,33 @@ WebmExtractor::Advance()
     mDiscardPadding   = 0;
     mIsKeyFrame       = false;
 
-    ret = nestegg_read_packet(mCtx, &mPkt);
+    // フレームデータの読み込み元を引けるように packet 単位で Read を記録する
+    mReader->BeginReadLog();
+    if (mBlockParser) {
+      ret       = mBlockParser->ReadPacket();
+      mHasBlock = (ret > 0);
+    } else {
+      ret = nestegg_read_packet(mCtx, &mPkt);
+    }
+    mReader->EndReadLog();
+    if (ret <= 0 && mIsFollowing) {
+      FreePacket();
+      // 書き込み中のファイルの終端 (途中で切れたブロックを含む)
+      if (WaitData()) {
+        return true;
+      }
+      ret = 0;
+    }
     if (ret == 0) {
 #if defined(DEBUG_INFO_NESTEGG)
       LOGV("End of Stream\n");
 #endif
       mIsReachedEOS = true;
+      if (mCacheState == CACHE_RECORDING) {
+        mCacheState = CACHE_READY;
+        LOGV("loop cache ready: packets=%zu size=%zu\n", mCache->GetCount(),
+             mCache->GetUsedSize());
+      }
       break;
     }
 
@@ -419,48 +1118,67 @@ WebmExtractor::Advance()
       LOGE("  failed: read packet\n");
       return false;
     }
-
-    mIsKeyFrame = (nestegg_packet_has_keyframe(mPkt) == NESTEGG_PACKET_HAS_KEYFRAME_TRUE);
-
-    // padding(DiscardPadding) は、負数ならブロック先頭、正数ならブロック末尾の
-    // 無音のデータ区間を示す。単位はナノ秒。再生側でドロップすること、となっている。
-    // AUDIOトラックのみ有効な情報で、とりあえず考えないでおく。
-
-    ret = nestegg_packet_discard_padding(mPkt, &mDiscardPadding);
-    if (ret < 0) {
-      // LOGE("  failed: packet: discard padding");
-      // nestegg_free_packet(mPkt);
-      // mPkt = nullptr;
-      // return false;
-    }
-    ret = nestegg_packet_track(mPkt, &mCurrentTrack);
-    if (ret < 0) {
-      LOGE("  failed: packet: track\n");
-      nestegg_free_packet(mPkt);
-      mPkt = nullptr;
-      return false;
-    }
-    ret = nestegg_packet_count(mPkt, &mFrames);
-    if (ret < 0) {
-      LOGE("  failed: packet: frame\n");
-      nestegg_free_packet(mPkt);
-      mPkt = nullptr;
-      return false;
-    }
-    ret = nestegg_packet_tstamp(mPkt, &mTimeStampNs);
-    if (ret < 0) {
-      LOGE("  failed: packet: time stamp\n");
-      nestegg_free_packet(mPkt);
-      mPkt = nullptr;
-      return false;
+    mWaitBeginUs = -1;
+
+    if (mHasBlock) {
+      const WebmBlockParser::Packet &block = mBlockParser->GetPacket();
+      mIsKeyFrame                          = block.isKeyFrame;
+      mDiscardPadding                      = block.discardPadding;
+      mCurrentTrack                        = block.track;
+      mFrames                              = block.frameCount;
+      mTimeStampNs                         = block.timeStampNs;
+    } else {
+      mIsKeyFrame = (nestegg_packet_has_keyframe(mPkt) == NESTEGG_PACKET_HAS_KEYFRAME_TRUE);
+
+      // padding(DiscardPadding) は、負数ならブロック先頭、正数ならブロック末尾の
+      // 無音のデータ区間を示す。単位はナノ秒。再生側でドロップすること、となっている。
+      // AUDIOトラックのみ有効な情報で、とりあえず考えないでおく。
+
+      ret = nestegg_packet_discard_padding(mPkt, &mDiscardPadding);
+      if (ret < 0) {
+        // LOGE("  failed: packet: discard padding");
+        // nestegg_free_packet(mPkt);
+        // mPkt = nullptr;
+        // return false;
+      }
+      ret = nestegg_packet_track(mPkt, &mCurrentTrack);
+      if (ret < 0) {
+        LOGE("  failed: packet: track\n");
+        FreePacket();
+        return false;
+      }
+      ret = nestegg_packet_count(mPkt, &mFrames);
+      if (ret < 0) {
+        LOGE("  failed: packet: frame\n");
+        FreePacket();
+        return false;
+      }
+      ret = nestegg_packet_tstamp(mPkt, &mTimeStampNs);
+      if (ret < 0) {
+        LOGE("  failed: packet: time stamp\n");
+        FreePacket();
+        return false;
+      }
     }
 
     if (mCurrentTrack == mVideoTrack) {
+      if (mVideoSkipUntilNs >= 0) {
+        if ((int64_t)mTimeStampNs <= mVideoSkipUntilNs) {
+          continue;
+        }
+        mVideoSkipUntilNs = -1;
+      }
       mCurrentTrackType = TRACK_TYPE_VIDEO;
       break;
     }
 
     if (mCurrentTrack == mAudioTrack) {
+      if (mAudioSkipBeforeNs >= 0) {
+        if ((int64_t)mTimeStampNs < mAudioSkipBeforeNs) {
+          continue;
+        }
+        mAudioSkipBeforeNs = -1;
+      }
       mCurrentTrackType = TRACK_TYPE_AUDIO;
       break;
     }
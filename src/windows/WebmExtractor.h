@@ -1,10 +1,16 @@
 #pragma once
 
+#include "AesCtrDecryptor.h"
 #include "CommonUtils.h"
 #include "Constants.h"
+#include "FramePacketCache.h"
 #include "MkvFileReader.h"
+#include "WebmBlockParser.h"
+#include "WebmSeekIndex.h"
 #include <nestegg/nestegg.h>
 
+#include <functional>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -40,30 +46,119 @@ struct FramePacket;
 class WebmExtractor
 {
 public:
-  WebmExtractor();
+  struct Config
+  {
+    void Init();
+
+    // IMovieReadStream から読む場合のまとめ読みサイズ(byte)。0 ならバッファ無し。
+    size_t streamBufferSize;
+    // I/O スレッドでの先読み窓。prefetchSeconds > 0 なら平均ビットレートから
+    // byte 数に換算し、そうでなければ prefetchSize(byte) を使う。両方 0 なら先読み無し。
+    size_t prefetchSize;
+    float prefetchSeconds;
+    // ループ再生用のパケットキャッシュの上限(byte)。0 なら無効。
+    // 1 周目に読んだパケットを保持し、先頭への SeekTo 以降はそこから流す。
+    // 上限を超えたらキャッシュを諦めて通常の読み込みを続ける。
+    // 上限はパケットのデータ + パケットごとの管理情報で数える (チャンク単位の端数は除く)。
+    size_t loopCacheSize;
+    // Cluster 単位のまとめ読みをする Cluster の最大サイズ(byte)。0 なら無効。
+    // Cluster 全体を 1 回で読んでメモリ上で解析する。先読み有効時は使わない。
+    size_t maxClusterReadSize;
+    // IMovieReadStream を先頭から順に読むだけで再生する (host の Seek/Size を呼ばない)。
+    // シークは先頭へのループをキャッシュから流せる場合を除いて失敗する。
+    // Cues・尺・索引は参照せず、サイズ不明の Segment/Cluster もそのまま読む。
+    bool streamForwardOnly;
+    // ファイルパスから開いた場合に、書き込み中のファイルを追いかけて再生する。
+    // 終端に達したら followLatencyMs 間隔でファイルサイズを確認し、増えていれば
+    // 最後に読み切ったブロックの後ろから解析を再開する。
+    // followTimeoutMs (> 0) の間サイズが増えなければ終端とする。シークはできない。
+    bool followFile;
+    int32_t followLatencyMs;
+    int32_t followTimeoutMs;
+    // ファイルパス/fd から開いた場合にメモリマップで読む (マップできなければ通常の読み込み)。
+    // 再生中にファイルが切り詰められる/置き換えられると SIGBUS になるので既定は無効。
+    // followFile とは併用できない (followFile が優先)。
+    bool memoryMappedFile;
+    // トラック情報と尺を取得するだけで再生はしない (Probe 用)。
+    // 索引スレッド・先読み・Cluster まとめ読みの準備をせず、読み込みを最小限にする。
+    bool metadataOnly;
+    // Cluster 内のブロックを nestegg_read_packet ではなく WebmBlockParser で読む
+    // (パケットごとのヒープ確保が無くなる)。暗号化トラックがある場合・書き込み中の
+    // ファイルの追いかけ・前方読みのみの stream では使わない。
+    bool useBlockParser;
+    // 暗号化トラック (ContentEncryption / AES-CTR) の鍵の取得。keyId はトラックの
+    // ContentEncKeyID で、key に AesCtrDecryptor::KEY_SIZE byte を書いて true を返す。
+    // 鍵が取得できない暗号化トラックがあれば Open は失敗する
+    std::function<bool(const uint8_t *keyId, size_t keyIdLength, uint8_t *key)>
+      contentKeyCallback;
+  };
+
+public:
+  WebmExtractor(const Config &config);
   ~WebmExtractor();
 
   bool Open(const std::string &filePath);
   bool Open(IMovieReadStream *stream);
+  // data は Extractor より長生きすること (フレームデータはコピーせず直接参照する)
+  bool Open(const void *data, size_t size);
+  // fd の [offset, offset+length) を読む (length <= 0 なら末尾まで)
+  bool Open(int fd, int64_t offset, int64_t length);
+  // 初期化セグメント + メディアセグメントのファイル群を連結して 1 つのムービーとして読む
+  bool Open(const std::vector<std::string> &segmentPaths);
+  // シークできない場合は何もせず false
   bool SeekTo(long long positionUs);
+  bool IsSeekable() const { return !mIsForwardOnly && !mIsFollowing; }
+  // 前方読みのみの stream でもループ用キャッシュがそろっていれば先頭へは戻れる
+  bool CanSeekTo(long long positionUs) const;
 
+  // 尺が分からない場合は -1
   uint64_t GetDurationUs() const { return mDurationUs; }
 
+  // I/O 統計。demux は nestegg からの Read/Seek 要求 (readUs は待たされた時間)、
+  // storage は実際のファイル/stream への I/O
+  void GetIOStats(MkvReaderStats *demux, MkvReaderStats *storage) const;
+
   size_t GetTrackCount();
   bool GetTrackInfo(int32_t trackIndex, TrackInfo *info);
   bool GetCodecPrivateData(int32_t trackIndex,
                            std::vector<std::vector<uint8_t>> &privateData);
 
+  // trackIndex < 0 ならその種類のトラックを読まない。
+  // 読み始めてから変える場合は SeekTo し直すこと (SwitchAudioTrack を参照)
   bool SelectTrack(TrackType type, int32_t trackIndex);
+  // SeekTo で位置を決めるトラック (選択していないトラックでもよい)。
+  // 既定 (-1) は選択中のビデオ、無ければオーディオ。同じファイルをトラックごとに
+  // 別の extractor で読む場合に、シーク先の Cluster をそろえるのに使う
+  void SetSeekTrack(int32_t trackIndex) { mSeekTrack = trackIndex; }
+  // 再生中にオーディオトラックを切り替え、positionUs から読み直す。選択中のビデオは
+  // 読み出し済みのパケットの続きから読む (読み直した分は飛ばす)。シークできなければ false
+  bool SwitchAudioTrack(int32_t trackIndex, long long positionUs);
 
   TrackType NextFramePacketType();
+  // packet のデータはコピーせずに reader のメモリ・nestegg_packet・WebmBlockParser の
+  // バッファのいずれかを参照する。
+  // 参照先は packet->ReturnBorrowed (または Init/Resize) まで有効
   bool ReadSampleData(FramePacket *packet);
   bool Advance();
 
   bool IsReachedEOS() const { return mIsReachedEOS; }
+  // 書き込み中のファイルの終端で続きを待っている (NextFramePacketType が UNKNOWN を返す)
+  bool IsWaitingData() const { return mIsWaitingData; }
 
 private:
   bool OpenSetup();
+  void SetupClusterReader();
+  void SetupPrefetch();
+  void LoadSeekIndexFile();
+  void SetupSegmentIndex();
+  void SetupSeekIndex();
+  bool SetupDecryption();
+  void SetupBlockParser();
+  void UpdateBlockParserTracks();
+  // mBlockParser の現在のパケットから ReadSampleData する
+  bool ReadBlockData(FramePacket *packet);
+  bool ReadFrameData(FramePacket *packet);
+  bool DecryptPacket(AesCtrDecryptor *decryptor, int encryption, uint8_t *data, size_t size);
 
   static void NestEggLogCallback(nestegg *ctx, unsigned int severity, char const *fmt,
                                  ...);
@@ -72,11 +167,33 @@ private:
   static int64_t MyTell(void *userdata);
 
   void CheckFirstTouch();
+  bool WaitData();
+  void PollData();
+  bool AdvanceCache();
+  std::shared_ptr<void> GetPacketOwner();
+  void FreePacket();
+  bool HasPacket() const { return mPkt || mHasBlock; }
+  void AddToCache(const FramePacket &packet);
 
 private:
+  Config mConfig;
+
+  std::string mFilePath; // ファイルパスから開いた場合のみ (索引ファイルの検索用)
+  bool mIsMemorySource;  // メモリ上のデータから開いた (先読み不要)
+  bool mIsForwardOnly;   // 先頭から順にしか読めない stream
+  bool mIsFollowing;     // 書き込み中のファイルを追いかける
+  bool mIsSegmented;     // セグメントファイル群から開いた
+  MkvReaderCounter mDemuxStats;
+
   bool mIsReachedEOS;
   bool mIsFirstRead;
 
+  // 書き込み中のファイルの続き待ち
+  bool mIsWaitingData;
+  int64_t mWaitDataSize; // 待ち始めたときのファイルサイズ
+  int64_t mWaitBeginUs;  // 最後にパケットを読めてから待ち始めた時刻 (待っていなければ -1)
+  int64_t mLastPollUs;
+
   uint64_t mDurationUs;
 
   nestegg *mCtx;
@@ -84,9 +201,16 @@ private:
 
   int mVideoTrack; //< 対象ビデオトラック
   int mAudioTrack; //< 対象オーディオトラック
+  int mSeekTrack;  //< シーク位置の基準トラック (-1: 自動)
   bool mVideoAlphaMode;
 
   nestegg_packet *mPkt;
+  // FramePacket が mPkt のデータを参照するときに作る。最後の参照が無くなったら解放される
+  std::shared_ptr<nestegg_packet> mPktOwner;
+  int mDecryptedFrameIndex; //< mPkt 内で復号済みのフレーム (-1: 無し)
+  // nestegg の代わりにブロックを読む (nullptr なら nestegg_read_packet)
+  WebmBlockParser *mBlockParser;
+  bool mHasBlock; //< mBlockParser の現在のパケットが有効
 
   unsigned int mCurrentTrack;
   TrackType mCurrentTrackType;
@@ -94,7 +218,30 @@ private:
   unsigned int mFrameIndex;
   uint64_t mTimeStampNs;
   int64_t mDiscardPadding;
+  // SwitchAudioTrack での読み直し用。この時刻まで (ビデオは以下、オーディオは未満) の
+  // パケットは飛ばす (-1: 飛ばさない)
+  int64_t mLastVideoTimeStampNs; //< 最後に ReadSampleData したビデオの時刻
+  int64_t mVideoSkipUntilNs;
+  int64_t mAudioSkipBeforeNs;
   bool mIsKeyFrame;
 
+  // トラック index → 復号器 (暗号化されていないトラックは nullptr)
+  std::vector<AesCtrDecryptor *> mDecryptors;
+
   IMkvFileReader *mReader;
+  WebmSeekIndex *mSeekIndex; // Cues が無い場合とセグメントファイル群の場合
+
+  // ループ再生用のパケットキャッシュ
+  enum CacheState
+  {
+    CACHE_IDLE,      // 記録していない (先頭からの再生で記録を始める)
+    CACHE_RECORDING, // 1 周目を記録中
+    CACHE_READY,     // 1 周分そろった
+    CACHE_DISABLED,  // 上限超過などで使わない
+  };
+  FramePacketCache *mCache;
+  CacheState mCacheState;
+  bool mIsCacheReplaying; // キャッシュから流している
+  size_t mCacheIndex;     // 現在のパケット (キャッシュ内)
+  size_t mCacheNext;
 };
@@ -0,0 +1,1058 @@
+#define MYLOG_TAG "WebmSeekIndex"
+#include "BasicLog.h"
+#include "WebmSeekIndex.h"
+#include "CommonUtils.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+#include <sys/stat.h>
+
+namespace {
+
+// Matroska 要素 ID
+const uint32_t ID_EBML            = 0x1A45DFA3;
+const uint32_t ID_SEGMENT         = 0x18538067;
+const uint32_t ID_SEEK_HEAD       = 0x114D9B74;
+const uint32_t ID_INFO            = 0x1549A966;
+const uint32_t ID_TIMECODE_SCALE  = 0x2AD7B1;
+const uint32_t ID_TRACKS          = 0x1654AE6B;
+const uint32_t ID_TRACK_ENTRY     = 0xAE;
+const uint32_t ID_TRACK_NUMBER    = 0xD7;
+const uint32_t ID_CLUSTER         = 0x1F43B675;
+const uint32_t ID_TIMECODE        = 0xE7;
+const uint32_t ID_SIMPLE_BLOCK    = 0xA3;
+const uint32_t ID_BLOCK_GROUP     = 0xA0;
+const uint32_t ID_BLOCK           = 0xA1;
+const uint32_t ID_REFERENCE_BLOCK = 0xFB;
+const uint32_t ID_CUES            = 0x1C53BB6B;
+const uint32_t ID_CHAPTERS        = 0x1043A770;
+const uint32_t ID_TAGS            = 0x1254C367;
+const uint32_t ID_ATTACHMENTS     = 0x1941A469;
+
+const uint64_t UNKNOWN_SIZE = UINT64_MAX;
+
+// 走査用の読み込み窓のサイズ。ブロック本体は読み飛ばすので小さめにしておく
+const size_t INDEX_BUFFER_SIZE = 4 * 1024;
+
+// 尺を求めるときに末尾から読む量。最後の Cluster が収まらなければ倍々で広げる
+const size_t TAIL_SCAN_SIZE     = 256 * 1024;
+const size_t TAIL_SCAN_MAX_SIZE = 4 * 1024 * 1024;
+
+// サイドカーファイル
+const char INDEX_FILE_MAGIC[4]     = { 'W', 'M', 'I', 'X' };
+const uint32_t INDEX_FILE_VERSION  = 1;
+const size_t INDEX_FILE_HASH_RANGE = 64 * 1024; // 先頭と末尾のこのサイズをハッシュする
+
+// vint の byte 数 (先頭 byte の最上位の 1 の位置)
+int
+vint_length(uint8_t c)
+{
+  for (int i = 0; i < 8; i++) {
+    if (c & (0x80 >> i)) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// サイズ不明の Cluster の終端判定用 (Segment 直下の要素)
+bool
+is_segment_child(uint32_t id)
+{
+  switch (id) {
+  case ID_CLUSTER:
+  case ID_CUES:
+  case ID_SEEK_HEAD:
+  case ID_INFO:
+  case ID_TRACKS:
+  case ID_CHAPTERS:
+  case ID_TAGS:
+  case ID_ATTACHMENTS:
+    return true;
+  }
+  return false;
+}
+
+FILE *
+open_file(const std::string &path, const char *mode)
+{
+#ifdef _MSC_VER
+  std::wstring wpath = utf8_decode(path);
+  std::wstring wmode = utf8_decode(mode);
+  FILE *fp           = nullptr;
+  if (_wfopen_s(&fp, wpath.c_str(), wmode.c_str()) != 0) {
+    return nullptr;
+  }
+  return fp;
+#else
+  return fopen(path.c_str(), mode);
+#endif
+}
+
+bool
+get_file_stat(const std::string &path, int64_t *size, int64_t *mtime)
+{
+#ifdef _MSC_VER
+  struct _stat64 st;
+  if (_wstat64(utf8_decode(path).c_str(), &st) != 0) {
+    return false;
+  }
+#else
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    return false;
+  }
+#endif
+  *size  = st.st_size;
+  *mtime = st.st_mtime;
+  return true;
+}
+
+bool
+remove_file(const std::string &path)
+{
+#ifdef _MSC_VER
+  return _wremove(utf8_decode(path).c_str()) == 0;
+#else
+  return remove(path.c_str()) == 0;
+#endif
+}
+
+bool
+rename_file(const std::string &from, const std::string &to)
+{
+#ifdef _MSC_VER
+  return _wrename(utf8_decode(from).c_str(), utf8_decode(to).c_str()) == 0;
+#else
+  return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+// FNV-1a (64bit)
+uint64_t
+hash_bytes(uint64_t hash, const uint8_t *data, size_t size)
+{
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ data[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+// ムービーの先頭と末尾をハッシュする (コピー等で更新時刻だけ変わった場合の判定用)
+bool
+hash_source(IMkvFileReader *reader, int64_t size, uint64_t *hash)
+{
+  std::vector<uint8_t> buf((size_t)std::min<int64_t>(INDEX_FILE_HASH_RANGE, size));
+  if (reader == nullptr || buf.empty() || reader->ReadAt(0, buf.data(), buf.size()) != 1) {
+    return false;
+  }
+  uint64_t h = hash_bytes(0xcbf29ce484222325ull, buf.data(), buf.size());
+  if (reader->ReadAt(size - (int64_t)buf.size(), buf.data(), buf.size()) != 1) {
+    return false;
+  }
+  *hash = hash_bytes(h, buf.data(), buf.size());
+  return true;
+}
+
+// 索引ファイルの固定長ヘッダ
+struct IndexFileHeader
+{
+  char magic[4];
+  uint32_t version;
+  int64_t sourceSize;
+  int64_t sourceMtime;
+  uint64_t sourceHash;
+  uint64_t timecodeScale;
+  int64_t segmentEnd;
+  int64_t firstClusterOffset;
+  uint64_t durationNs;
+  uint32_t trackCount;
+  uint32_t clusterCount;
+  uint32_t blockCount;
+  uint32_t reserved;
+};
+
+} // namespace
+
+WebmSeekIndex::WebmSeekIndex()
+: mReader(nullptr)
+, mFileSize(-1)
+, mBufferPos(0)
+, mBufferSize(0)
+, mSegmentEnd(-1)
+, mFirstClusterOffset(-1)
+, mTimecodeScale(1000000)
+, mDurationNs(0)
+, mIsCompleted(false)
+, mHasSegmentDuration(false)
+, mIsQuit(false)
+{}
+
+WebmSeekIndex::~WebmSeekIndex()
+{
+  Stop();
+}
+
+bool
+WebmSeekIndex::Start(IMkvFileReader *reader)
+{
+  if (reader == nullptr) {
+    return false;
+  }
+  mReader   = reader;
+  mFileSize = reader->Size();
+  mBuffer.resize(INDEX_BUFFER_SIZE);
+
+  // 最初の Cluster までは先に読んでおく (シーク時の最低限のフォールバック先)
+  if (!ParseHeader()) {
+    LOGV("seek index: header parse failed\n");
+    mReader = nullptr;
+    return false;
+  }
+
+  mThread = std::thread(&WebmSeekIndex::IndexThread, this);
+  return true;
+}
+
+void
+WebmSeekIndex::Stop()
+{
+  if (mThread.joinable()) {
+    mIsQuit = true;
+    mThread.join();
+    LOGV("seek index: clusters=%zu completed=%d\n", mEntries.size(), mIsCompleted);
+  }
+  mReader = nullptr;
+}
+
+bool
+WebmSeekIndex::Build(IMkvFileReader *reader)
+{
+  if (reader == nullptr) {
+    return false;
+  }
+  mReader   = reader;
+  mFileSize = reader->Size();
+  mBuffer.resize(INDEX_BUFFER_SIZE);
+
+  bool success = ParseHeader() && Scan();
+  mReader      = nullptr;
+  return success;
+}
+
+bool
+WebmSeekIndex::ReadHeader(IMkvFileReader *reader)
+{
+  if (reader == nullptr) {
+    return false;
+  }
+  mReader   = reader;
+  mFileSize = reader->Size();
+  mBuffer.resize(INDEX_BUFFER_SIZE);
+
+  bool success = ParseHeader();
+  mReader      = nullptr;
+  return success;
+}
+
+bool
+WebmSeekIndex::StartSegments(IMkvFileReader *reader, bool scanDuration)
+{
+  if (reader == nullptr || reader->GetSegmentCount() < 2) {
+    return false;
+  }
+  mReader   = reader;
+  mFileSize = reader->Size();
+  mBuffer.resize(INDEX_BUFFER_SIZE);
+  if (!ParseHeader()) {
+    LOGV("segment index: header parse failed\n");
+    mReader = nullptr;
+    return false;
+  }
+
+  size_t count = reader->GetSegmentCount();
+  mSegmentOffsets.resize(count + 1);
+  for (size_t i = 0; i < count; i++) {
+    mSegmentOffsets[i] = reader->GetSegmentOffset(i);
+  }
+  mSegmentOffsets[count] = mFileSize; // 終端
+  mSegmentClusters.assign(count, -1);
+  mSegmentTimesNs.assign(count, -1);
+
+  if (scanDuration && !ScanLastSegment()) {
+    LOGV("segment index: duration scan failed\n");
+  }
+  mIsCompleted = true;
+  return true;
+}
+
+bool
+WebmSeekIndex::ScanDuration(IMkvFileReader *reader, uint64_t *durationNs)
+{
+  if (reader == nullptr || reader->Size() <= 0) {
+    return false;
+  }
+  mReader   = reader;
+  mFileSize = reader->Size();
+  mBuffer.resize(INDEX_BUFFER_SIZE);
+
+  int64_t begin = get_time_us();
+  bool success  = ParseHeader() && ScanTail();
+  mReader       = nullptr;
+  if (!success) {
+    LOGV("duration scan: last cluster not found\n");
+    return false;
+  }
+  LOGV("duration scan: %.3fs in %" PRId64 "us\n", mDurationNs / 1e9, get_time_us() - begin);
+  *durationNs = mDurationNs;
+  return true;
+}
+
+bool
+WebmSeekIndex::ScanTail()
+{
+  int64_t end     = (mSegmentEnd >= 0) ? std::min(mSegmentEnd, mFileSize) : mFileSize;
+  int64_t tailPos = end;
+  for (size_t scanSize = TAIL_SCAN_SIZE; scanSize <= TAIL_SCAN_MAX_SIZE; scanSize *= 2) {
+    // 末尾をまとめて読み込み窓に載せる (以降の Peek はこの範囲なら読み直さない)。
+    // 広げる場合は読み込み済みの分を後ろにずらして、手前の増えた分だけを読む
+    int64_t newPos = std::max(mFirstClusterOffset, end - (int64_t)scanSize);
+    if (newPos >= tailPos) {
+      return false; // 全体を見ても無かった
+    }
+    size_t tailSize = (size_t)(end - newPos);
+    size_t addSize  = (size_t)(tailPos - newPos);
+    if (tailSize < 4) {
+      return false;
+    }
+    mBuffer.resize(std::max(tailSize, INDEX_BUFFER_SIZE));
+    memmove(mBuffer.data() + addSize, mBuffer.data(), tailSize - addSize);
+    if (mReader->ReadAt(newPos, mBuffer.data(), addSize) != 1) {
+      mBufferSize = 0;
+      return false;
+    }
+    tailPos     = newPos;
+    mBufferPos  = tailPos;
+    mBufferSize = tailSize;
+
+    // 後ろから Cluster ID を探す。ブロックのデータ中にも同じ並びが現れ得るので、
+    // サイズが範囲内で、最初の子要素が Timecode のものだけを Cluster とみなす。
+    // 広げた場合は増えた分だけを探す
+    size_t first = (addSize == tailSize) ? tailSize - 4 : addSize - 1;
+    for (size_t i = first; i != SIZE_MAX; i--) {
+      const uint8_t *p = mBuffer.data() + i;
+      if (p[0] != 0x1F || p[1] != 0x43 || p[2] != 0xB6 || p[3] != 0x75) {
+        continue;
+      }
+      int64_t pos = tailPos + (int64_t)i;
+      uint32_t id, childId;
+      uint64_t size, childSize;
+      int headerLength, childHeaderLength;
+      if (!ReadElementHeader(pos, &id, &size, &headerLength) ||
+          (size != UNKNOWN_SIZE && pos + headerLength + (int64_t)size > end) ||
+          !ReadElementHeader(pos + headerLength, &childId, &childSize, &childHeaderLength) ||
+          childId != ID_TIMECODE || childSize == 0 || childSize > 8) {
+        continue;
+      }
+
+      Entry entry = {};
+      std::vector<Block> blocks;
+      int64_t next;
+      if (ParseCluster(pos, &entry, &blocks, &next) && !blocks.empty()) {
+        UpdateDuration(entry, blocks);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+bool
+WebmSeekIndex::ReadSegmentTime(size_t index, int64_t *clusterOffset, int64_t *timeNs)
+{
+  if (mSegmentTimesNs[index] >= 0) {
+    *clusterOffset = mSegmentClusters[index];
+    *timeNs        = mSegmentTimesNs[index];
+    return true;
+  }
+
+  // セグメント内の最初の Cluster を探して、その Timecode を読む
+  int64_t pos = std::max(mSegmentOffsets[index], mFirstClusterOffset);
+  int64_t end = mSegmentOffsets[index + 1];
+  while (pos < end) {
+    uint32_t id;
+    uint64_t size;
+    int headerLength;
+    if (!ReadElementHeader(pos, &id, &size, &headerLength)) {
+      return false;
+    }
+    if (id == ID_CLUSTER) {
+      int64_t cur = pos + headerLength;
+      for (int i = 0; i < 4 && cur < end; i++) {
+        uint32_t childId;
+        uint64_t childSize;
+        int childHeaderLength;
+        if (!ReadElementHeader(cur, &childId, &childSize, &childHeaderLength) ||
+            childSize == UNKNOWN_SIZE) {
+          return false;
+        }
+        uint64_t timecode;
+        if (childId == ID_TIMECODE && ReadUInt(cur + childHeaderLength, childSize, &timecode)) {
+          mSegmentClusters[index] = pos;
+          mSegmentTimesNs[index]  = (int64_t)(timecode * mTimecodeScale);
+          *clusterOffset          = pos;
+          *timeNs                 = mSegmentTimesNs[index];
+          return true;
+        }
+        cur += childHeaderLength + (int64_t)childSize;
+      }
+      return false;
+    }
+    if (size == UNKNOWN_SIZE) {
+      return false;
+    }
+    pos += headerLength + (int64_t)size;
+  }
+  return false;
+}
+
+bool
+WebmSeekIndex::FindSegment(uint64_t timeNs, int64_t *offset)
+{
+  // 先頭の Cluster の時刻が timeNs 以下である最後のセグメントを二分探索する。
+  // Cluster を含まないセグメント (初期化セグメント等) は手前のものとして扱う
+  size_t lo = 0, hi = mSegmentTimesNs.size();
+  int64_t found = mFirstClusterOffset;
+  while (lo < hi) {
+    size_t mid = (lo + hi) / 2;
+    int64_t clusterOffset, clusterTimeNs;
+    bool hasCluster = ReadSegmentTime(mid, &clusterOffset, &clusterTimeNs);
+    if (hasCluster && (uint64_t)clusterTimeNs > timeNs) {
+      hi = mid;
+    } else {
+      if (hasCluster) {
+        found = clusterOffset;
+      }
+      lo = mid + 1;
+    }
+  }
+  *offset = found;
+  return true;
+}
+
+bool
+WebmSeekIndex::ScanLastSegment()
+{
+  // 最後の Cluster を含むセグメントを探す (末尾に空のセグメントがあっても良いように)
+  for (size_t index = mSegmentTimesNs.size(); index-- > 0;) {
+    int64_t pos, timeNs;
+    if (!ReadSegmentTime(index, &pos, &timeNs)) {
+      continue;
+    }
+    int64_t end = mSegmentOffsets[index + 1];
+    std::vector<Block> blocks;
+    while (pos < end) {
+      Entry entry = {};
+      int64_t next;
+      if (!ParseCluster(pos, &entry, &blocks, &next)) {
+        break;
+      }
+      UpdateDuration(entry, blocks);
+      mHasSegmentDuration = true;
+      pos                 = next;
+    }
+    return mHasSegmentDuration;
+  }
+  return false;
+}
+
+bool
+WebmSeekIndex::IsCompleted() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mIsCompleted;
+}
+
+bool
+WebmSeekIndex::GetDurationNs(uint64_t *durationNs) const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (mEntries.empty() && !mHasSegmentDuration) {
+    return false;
+  }
+  *durationNs = mDurationNs;
+  return true;
+}
+
+size_t
+WebmSeekIndex::GetClusterCount() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mEntries.size();
+}
+
+size_t
+WebmSeekIndex::GetBlockCount() const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  return mBlocks.size();
+}
+
+std::string
+WebmSeekIndex::GetIndexFilePath(const std::string &moviePath)
+{
+  return moviePath + ".idx";
+}
+
+bool
+WebmSeekIndex::Save(const std::string &indexPath, const std::string &moviePath,
+                    IMkvFileReader *reader) const
+{
+  std::lock_guard<std::mutex> lock(mMutex);
+  if (!mIsCompleted || mEntries.empty()) {
+    return false;
+  }
+
+  IndexFileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic));
+  header.version = INDEX_FILE_VERSION;
+  if (!get_file_stat(moviePath, &header.sourceSize, &header.sourceMtime) ||
+      !hash_source(reader, header.sourceSize, &header.sourceHash)) {
+    LOGE("failed to stat movie: %s\n", moviePath.c_str());
+    return false;
+  }
+  header.timecodeScale      = mTimecodeScale;
+  header.segmentEnd         = mSegmentEnd;
+  header.firstClusterOffset = mFirstClusterOffset;
+  header.durationNs         = mDurationNs;
+  header.trackCount         = (uint32_t)mTrackNumbers.size();
+  header.clusterCount       = (uint32_t)mEntries.size();
+  header.blockCount         = (uint32_t)mBlocks.size();
+
+  // 一時ファイルに書いてから差し替える (読み込み中のプレイヤーに半端なファイルを見せない)
+  std::string tmpPath = indexPath + ".tmp";
+  FILE *fp            = open_file(tmpPath, "wb");
+  if (fp == nullptr) {
+    LOGE("failed to create index file: %s\n", tmpPath.c_str());
+    return false;
+  }
+  bool success =
+    fwrite(&header, sizeof(header), 1, fp) == 1 &&
+    fwrite(mTrackNumbers.data(), sizeof(uint64_t), mTrackNumbers.size(), fp) ==
+      mTrackNumbers.size() &&
+    fwrite(mEntries.data(), sizeof(Entry), mEntries.size(), fp) == mEntries.size() &&
+    fwrite(mBlocks.data(), sizeof(Block), mBlocks.size(), fp) == mBlocks.size();
+  success = (fclose(fp) == 0) && success;
+
+  if (success) {
+    remove_file(indexPath);
+    success = rename_file(tmpPath, indexPath);
+  }
+  if (!success) {
+    LOGE("failed to write index file: %s\n", indexPath.c_str());
+    remove_file(tmpPath);
+  }
+  return success;
+}
+
+bool
+WebmSeekIndex::Load(const std::string &indexPath, const std::string &moviePath,
+                    IMkvFileReader *reader)
+{
+  FILE *fp = open_file(indexPath, "rb");
+  if (fp == nullptr) {
+    return false;
+  }
+
+  IndexFileHeader header;
+  bool success = (fread(&header, sizeof(header), 1, fp) == 1 &&
+                  memcmp(header.magic, INDEX_FILE_MAGIC, sizeof(header.magic)) == 0 &&
+                  header.version == INDEX_FILE_VERSION);
+
+  // ムービーが作成時と同じか確認する。更新時刻だけ違うならハッシュで判定
+  int64_t size, mtime;
+  uint64_t hash;
+  if (success) {
+    success = get_file_stat(moviePath, &size, &mtime) && size == header.sourceSize &&
+              (mtime == header.sourceMtime ||
+               (hash_source(reader, size, &hash) && hash == header.sourceHash));
+    if (!success) {
+      LOGV("index file is stale: %s\n", indexPath.c_str());
+    }
+  }
+
+  // 壊れた・途中で切れたファイルの件数で巨大な確保をしないよう、件数分のレコードが
+  // ファイルの大きさとちょうど合うか先に確かめる
+  int64_t indexSize, indexMtime;
+  if (success) {
+    uint64_t required = (uint64_t)sizeof(header) +
+                        (uint64_t)header.trackCount * sizeof(uint64_t) +
+                        (uint64_t)header.clusterCount * sizeof(Entry) +
+                        (uint64_t)header.blockCount * sizeof(Block);
+    success = get_file_stat(indexPath, &indexSize, &indexMtime) && indexSize >= 0 &&
+              required == (uint64_t)indexSize;
+    if (!success) {
+      LOGV("index file is broken: %s\n", indexPath.c_str());
+    }
+  }
+
+  std::vector<uint64_t> trackNumbers;
+  std::vector<Entry> entries;
+  std::vector<Block> blocks;
+  if (success) {
+    trackNumbers.resize(header.trackCount);
+    entries.resize(header.clusterCount);
+    blocks.resize(header.blockCount);
+    success =
+      fread(trackNumbers.data(), sizeof(uint64_t), trackNumbers.size(), fp) ==
+        trackNumbers.size() &&
+      fread(entries.data(), sizeof(Entry), entries.size(), fp) == entries.size() &&
+      fread(blocks.data(), sizeof(Block), blocks.size(), fp) == blocks.size() &&
+      !entries.empty();
+  }
+  fclose(fp);
+  if (!success) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+  mFileSize           = header.sourceSize;
+  mTimecodeScale      = header.timecodeScale;
+  mSegmentEnd         = header.segmentEnd;
+  mFirstClusterOffset = header.firstClusterOffset;
+  mDurationNs         = header.durationNs;
+  mTrackNumbers.swap(trackNumbers);
+  mEntries.swap(entries);
+  mBlocks.swap(blocks);
+  mIsCompleted = true;
+  LOGV("index file loaded: %s clusters=%zu blocks=%zu\n", indexPath.c_str(), mEntries.size(),
+       mBlocks.size());
+  return true;
+}
+
+bool
+WebmSeekIndex::Find(uint64_t timeNs, int trackIndex, int64_t *offset)
+{
+  if (!mSegmentOffsets.empty()) {
+    return FindSegment(timeNs, offset);
+  }
+
+  std::lock_guard<std::mutex> lock(mMutex);
+
+  // timeNs より後ろの Cluster が見つかるまでは、手前のキーフレームが確定しない
+  if (!mIsCompleted && (mEntries.empty() || mEntries.back().timeNs <= timeNs)) {
+    return false;
+  }
+
+  uint32_t mask = (trackIndex >= 0 && trackIndex < 32) ? (1u << trackIndex) : 0;
+  auto it       = std::upper_bound(mEntries.begin(), mEntries.end(), timeNs,
+                                   [](uint64_t t, const Entry &e) { return t < e.timeNs; });
+  while (it != mEntries.begin()) {
+    --it;
+    if (mask == 0 || (it->keyTracks & mask)) {
+      *offset = it->offset;
+      return true;
+    }
+  }
+  return false;
+}
+
+const uint8_t *
+WebmSeekIndex::Peek(int64_t pos, size_t length)
+{
+  if (pos < 0 || length > mBuffer.size()) {
+    return nullptr;
+  }
+  if (pos >= mBufferPos && pos + (int64_t)length <= mBufferPos + (int64_t)mBufferSize) {
+    return mBuffer.data() + (pos - mBufferPos);
+  }
+
+  // 窓を pos から読み直す (サイズ不明なら必要な分だけ)
+  size_t readSize = length;
+  if (mFileSize >= 0) {
+    if (pos + (int64_t)length > mFileSize) {
+      return nullptr;
+    }
+    readSize = (size_t)std::min<int64_t>(mBuffer.size(), mFileSize - pos);
+  }
+  if (mReader->ReadAt(pos, mBuffer.data(), readSize) != 1) {
+    mBufferSize = 0;
+    return nullptr;
+  }
+  mBufferPos  = pos;
+  mBufferSize = readSize;
+  return mBuffer.data();
+}
+
+bool
+WebmSeekIndex::ReadElementHeader(int64_t pos, uint32_t *id, uint64_t *size, int *headerLength)
+{
+  const uint8_t *p = Peek(pos, 1);
+  if (!p) {
+    return false;
+  }
+  int idLength = vint_length(p[0]);
+  if (idLength == 0 || idLength > 4 || !(p = Peek(pos, idLength + 1))) {
+    return false;
+  }
+  int sizeLength = vint_length(p[idLength]);
+  if (sizeLength == 0 || !(p = Peek(pos, idLength + sizeLength))) {
+    return false;
+  }
+
+  uint32_t elementId = 0;
+  for (int i = 0; i < idLength; i++) {
+    elementId = (elementId << 8) | p[i];
+  }
+
+  // サイズは先頭の長さビットを落とす。全ビット 1 はサイズ不明
+  uint64_t value = p[idLength] & (0xff >> sizeLength);
+  for (int i = 1; i < sizeLength; i++) {
+    value = (value << 8) | p[idLength + i];
+  }
+  uint64_t unknown = (1ull << (7 * sizeLength)) - 1;
+
+  *id           = elementId;
+  *size         = (value == unknown) ? UNKNOWN_SIZE : value;
+  *headerLength = idLength + sizeLength;
+  return true;
+}
+
+bool
+WebmSeekIndex::ReadUInt(int64_t pos, uint64_t size, uint64_t *value)
+{
+  if (size == 0 || size > 8) {
+    return false;
+  }
+  const uint8_t *p = Peek(pos, (size_t)size);
+  if (!p) {
+    return false;
+  }
+  uint64_t v = 0;
+  for (uint64_t i = 0; i < size; i++) {
+    v = (v << 8) | p[i];
+  }
+  *value = v;
+  return true;
+}
+
+int
+WebmSeekIndex::FindTrackIndex(uint64_t trackNumber) const
+{
+  for (size_t i = 0; i < mTrackNumbers.size(); i++) {
+    if (mTrackNumbers[i] == trackNumber) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+bool
+WebmSeekIndex::ParseHeader()
+{
+  uint32_t id;
+  uint64_t size;
+  int headerLength;
+
+  // EBML ヘッダ
+  if (!ReadElementHeader(0, &id, &size, &headerLength) || id != ID_EBML ||
+      size == UNKNOWN_SIZE) {
+    return false;
+  }
+  int64_t pos = headerLength + (int64_t)size;
+
+  // Segment を探す
+  while (true) {
+    if (!ReadElementHeader(pos, &id, &size, &headerLength)) {
+      return false;
+    }
+    if (id == ID_SEGMENT) {
+      break;
+    }
+    if (size == UNKNOWN_SIZE) {
+      return false;
+    }
+    pos += headerLength + (int64_t)size;
+  }
+  pos += headerLength;
+  mSegmentEnd = (size == UNKNOWN_SIZE) ? -1 : pos + (int64_t)size;
+
+  // 最初の Cluster までに Info と Tracks を拾う
+  while (mSegmentEnd < 0 || pos < mSegmentEnd) {
+    if (!ReadElementHeader(pos, &id, &size, &headerLength)) {
+      return false;
+    }
+    if (id == ID_CLUSTER) {
+      mFirstClusterOffset = pos;
+      return true;
+    }
+    if (size == UNKNOWN_SIZE) {
+      return false;
+    }
+    int64_t data = pos + headerLength;
+    int64_t end  = data + (int64_t)size;
+    if (id == ID_INFO) {
+      ParseInfo(data, end);
+    } else if (id == ID_TRACKS) {
+      ParseTracks(data, end);
+    }
+    pos = end;
+  }
+  return false;
+}
+
+bool
+WebmSeekIndex::ParseInfo(int64_t pos, int64_t end)
+{
+  uint32_t id;
+  uint64_t size;
+  int headerLength;
+  while (pos < end) {
+    if (!ReadElementHeader(pos, &id, &size, &headerLength) || size == UNKNOWN_SIZE) {
+      return false;
+    }
+    pos += headerLength;
+    if (id == ID_TIMECODE_SCALE) {
+      uint64_t scale;
+      if (ReadUInt(pos, size, &scale) && scale > 0) {
+        mTimecodeScale = scale;
+      }
+    }
+    pos += (int64_t)size;
+  }
+  return true;
+}
+
+bool
+WebmSeekIndex::ParseTracks(int64_t pos, int64_t end)
+{
+  uint32_t id;
+  uint64_t size;
+  int headerLength;
+  while (pos < end) {
+    if (!ReadElementHeader(pos, &id, &size, &headerLength) || size == UNKNOWN_SIZE) {
+      return false;
+    }
+    pos += headerLength;
+    if (id == ID_TRACK_ENTRY) {
+      // nestegg のトラック index は TrackEntry の並び順
+      uint64_t trackNumber = 0;
+      int64_t entryPos     = pos;
+      int64_t entryEnd     = pos + (int64_t)size;
+      while (entryPos < entryEnd) {
+        uint32_t childId;
+        uint64_t childSize;
+        int childHeaderLength;
+        if (!ReadElementHeader(entryPos, &childId, &childSize, &childHeaderLength) ||
+            childSize == UNKNOWN_SIZE) {
+          return false;
+        }
+        entryPos += childHeaderLength;
+        if (childId == ID_TRACK_NUMBER) {
+          ReadUInt(entryPos, childSize, &trackNumber);
+        }
+        entryPos += (int64_t)childSize;
+      }
+      mTrackNumbers.push_back(trackNumber);
+    }
+    pos += (int64_t)size;
+  }
+  return true;
+}
+
+bool
+WebmSeekIndex::ParseBlockHeader(int64_t pos, uint64_t size, Block *block)
+{
+  // トラック番号(vint) + 相対時刻(int16) + フラグ
+  const uint8_t *p = Peek(pos, 1);
+  int length       = p ? vint_length(p[0]) : 0;
+  if (length == 0 || (uint64_t)length + 3 > size || !(p = Peek(pos, length + 3))) {
+    return false;
+  }
+  uint64_t trackNumber = p[0] & (0xff >> length);
+  for (int i = 1; i < length; i++) {
+    trackNumber = (trackNumber << 8) | p[i];
+  }
+  int index       = FindTrackIndex(trackNumber);
+  block->size     = (uint32_t)size;
+  block->timecode = (int16_t)((p[length] << 8) | p[length + 1]);
+  block->track    = (index >= 0 && index < 0xff) ? (uint8_t)index : 0xff;
+  block->flags    = (p[length + 2] & 0x80) ? BLOCK_FLAG_KEY : 0;
+  return true;
+}
+
+bool
+WebmSeekIndex::ParseBlockGroup(int64_t pos, int64_t end, Block *block)
+{
+  uint32_t id;
+  uint64_t size;
+  int headerLength;
+  bool hasBlock  = false;
+  bool hasRefBlk = false;
+
+  while (pos < end) {
+    if (!ReadElementHeader(pos, &id, &size, &headerLength) || size == UNKNOWN_SIZE) {
+      return false;
+    }
+    pos += headerLength;
+    if (id == ID_BLOCK) {
+      hasBlock = ParseBlockHeader(pos, size, block);
+    } else if (id == ID_REFERENCE_BLOCK) {
+      hasRefBlk = true;
+    }
+    pos += (int64_t)size;
+  }
+
+  // Block のフラグにはキーフレーム情報が無いので、ReferenceBlock が無ければキーフレーム
+  if (hasBlock) {
+    block->flags = hasRefBlk ? 0 : BLOCK_FLAG_KEY;
+  }
+  return hasBlock;
+}
+
+bool
+WebmSeekIndex::ParseCluster(int64_t pos, Entry *entry, std::vector<Block> *blocks,
+                            int64_t *next)
+{
+  uint32_t id;
+  uint64_t size;
+  int headerLength;
+  if (!ReadElementHeader(pos, &id, &size, &headerLength)) {
+    return false;
+  }
+
+  // サイズ不明の Cluster は次の Segment 直下の要素までとする
+  int64_t end         = (size == UNKNOWN_SIZE) ? -1 : pos + headerLength + (int64_t)size;
+  int64_t cur         = pos + headerLength;
+  uint64_t timecode   = 0;
+  uint32_t seenTracks = 0;
+
+  entry->offset    = pos;
+  entry->keyTracks = 0;
+  blocks->clear();
+
+  while ((end < 0 || cur < end) && !mIsQuit) {
+    if (!ReadElementHeader(cur, &id, &size, &headerLength)) {
+      if (end < 0) {
+        break; // サイズ不明のまま末尾に達した
+      }
+      return false;
+    }
+    if (end < 0 && is_segment_child(id)) {
+      break;
+    }
+    if (size == UNKNOWN_SIZE) {
+      return false;
+    }
+
+    int64_t data = cur + headerLength;
+    Block block;
+    bool isBlock = false;
+    if (id == ID_TIMECODE) {
+      ReadUInt(data, size, &timecode);
+    } else if (id == ID_SIMPLE_BLOCK) {
+      isBlock = ParseBlockHeader(data, size, &block);
+    } else if (id == ID_BLOCK_GROUP) {
+      isBlock = ParseBlockGroup(data, data + (int64_t)size, &block);
+    }
+
+    if (isBlock) {
+      blocks->push_back(block);
+      uint32_t bit = (block.track < 32) ? (1u << block.track) : 0;
+      if (bit && !(seenTracks & bit)) {
+        seenTracks |= bit;
+        if (block.flags & BLOCK_FLAG_KEY) {
+          entry->keyTracks |= bit;
+        }
+      }
+    }
+    cur = data + (int64_t)size;
+  }
+
+  entry->timeNs     = timecode * mTimecodeScale;
+  entry->blockCount = (uint32_t)blocks->size();
+  *next             = cur;
+  return true;
+}
+
+void
+WebmSeekIndex::UpdateDuration(const Entry &entry, const std::vector<Block> &blocks)
+{
+  // トラックごとに最後のブロック時刻 + 直前との間隔を終端とみなし、その最大を尺とする
+  mTrackLastNs.resize(mTrackNumbers.size(), -1);
+  mTrackPrevNs.resize(mTrackNumbers.size(), -1);
+  for (const Block &block : blocks) {
+    if (block.track >= mTrackNumbers.size()) {
+      continue;
+    }
+    int64_t timeNs = (int64_t)entry.timeNs + (int64_t)block.timecode * (int64_t)mTimecodeScale;
+    if (timeNs != mTrackLastNs[block.track]) {
+      mTrackPrevNs[block.track] = mTrackLastNs[block.track];
+      mTrackLastNs[block.track] = timeNs;
+    }
+  }
+
+  uint64_t durationNs = 0;
+  for (size_t i = 0; i < mTrackLastNs.size(); i++) {
+    int64_t endNs = mTrackLastNs[i];
+    if (endNs >= 0 && mTrackPrevNs[i] >= 0) {
+      endNs += endNs - mTrackPrevNs[i];
+    }
+    durationNs = std::max<uint64_t>(durationNs, std::max<int64_t>(endNs, 0));
+  }
+  mDurationNs = durationNs;
+}
+
+bool
+WebmSeekIndex::Scan()
+{
+  int64_t pos   = mFirstClusterOffset;
+  int64_t begin = get_time_us();
+  std::vector<Block> blocks;
+  while (!mIsQuit && (mSegmentEnd < 0 || pos < mSegmentEnd)) {
+    uint32_t id;
+    uint64_t size;
+    int headerLength;
+    if (!ReadElementHeader(pos, &id, &size, &headerLength)) {
+      break;
+    }
+    if (id == ID_CLUSTER) {
+      Entry entry = {};
+      int64_t next;
+      if (!ParseCluster(pos, &entry, &blocks, &next) || mIsQuit) {
+        break;
+      }
+      std::lock_guard<std::mutex> lock(mMutex);
+      entry.firstBlock = (uint32_t)mBlocks.size();
+      mEntries.push_back(entry);
+      mBlocks.insert(mBlocks.end(), blocks.begin(), blocks.end());
+      UpdateDuration(entry, blocks);
+      pos = next;
+    } else {
+      if (size == UNKNOWN_SIZE) {
+        break;
+      }
+      pos += headerLength + (int64_t)size;
+    }
+  }
+
+  // 途中で読めなくなった場合も、そこまでの索引で確定とする
+  std::lock_guard<std::mutex> lock(mMutex);
+  mIsCompleted = !mIsQuit;
+  LOGV("seek index: %zu clusters, %zu blocks in %" PRId64 "us\n", mEntries.size(),
+       mBlocks.size(), get_time_us() - begin);
+  return mIsCompleted && !mEntries.empty();
+}
+
+void
+WebmSeekIndex::IndexThread()
+{
+  Scan();
+}
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "MkvFileReader.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Cues の無い WebM 用のシーク索引。
+// ヘッダ部分は Start 内で読み、以降の Cluster はスレッドで走査して
+// (Cluster の時刻 → ファイル位置) の表を作る。ブロックは先頭数 byte しか読まない。
+// reader は ReadAt だけを使うので、再生側の Read/Seek 位置には影響しない。
+//
+// 作った索引はサイドカーファイル (ムービーのパス + ".idx") に保存でき、
+// 次回 Open 時に読み込めば走査無しでシークと尺の取得ができる。
+//
+// 複数ファイルを連結した reader (IMkvFileReader::CreateSegmented) の場合は
+// StartSegments で開き、Cluster は走査せずにセグメント先頭の時刻だけでシークする。
+class WebmSeekIndex
+{
+public:
+  struct Entry
+  {
+    int64_t offset;      // Cluster 要素の先頭位置
+    uint64_t timeNs;     // Cluster の Timecode (ns)
+    uint32_t keyTracks;  // Cluster 内の最初のブロックがキーフレームだったトラック(index)のビット
+    uint32_t firstBlock; // mBlocks 内の先頭
+    uint32_t blockCount;
+  };
+
+  enum
+  {
+    BLOCK_FLAG_KEY = 0x01,
+  };
+
+  struct Block
+  {
+    uint32_t size;    // ブロック全体のサイズ (レーシング時は複数フレーム分)
+    int16_t timecode; // Cluster からの相対時刻 (TimecodeScale 単位)
+    uint8_t track;    // トラック index (不明なら 0xff)
+    uint8_t flags;    // BLOCK_FLAG_*
+  };
+
+  WebmSeekIndex();
+  ~WebmSeekIndex();
+
+  // reader は Stop (または破棄) まで生きていること
+  bool Start(IMkvFileReader *reader);
+  void Stop();
+  // 呼び出しスレッドで最後まで走査する (索引ファイル生成用)
+  bool Build(IMkvFileReader *reader);
+  // セグメント単位の索引。ヘッダだけ読み、各セグメント先頭の Cluster の時刻は
+  // Find で必要になった分だけ読む (スレッドは使わない)。
+  // scanDuration なら最後のセグメントだけ走査して尺を求める
+  bool StartSegments(IMkvFileReader *reader, bool scanDuration);
+  // 末尾の数百 KiB だけを読み、最後の Cluster から尺を求める (索引は作らない)。
+  // ヘッダに Duration が無いファイル用。reader のサイズが分かる必要がある
+  bool ScanDuration(IMkvFileReader *reader, uint64_t *durationNs);
+  // ヘッダ (最初の Cluster の手前まで) だけを読む (索引は作らない)。
+  // 成功すれば GetFirstClusterOffset/GetTimecodeScale/GetTrackNumbers が使える
+  bool ReadHeader(IMkvFileReader *reader);
+
+  // サイドカーファイル。moviePath のサイズと更新時刻 (違う場合は先頭/末尾のハッシュ)
+  // が作成時と一致しなければ Load は失敗する。reader はハッシュの計算に使う
+  static std::string GetIndexFilePath(const std::string &moviePath);
+  bool Save(const std::string &indexPath, const std::string &moviePath,
+            IMkvFileReader *reader) const;
+  bool Load(const std::string &indexPath, const std::string &moviePath,
+            IMkvFileReader *reader);
+
+  // timeNs 以前で、trackIndex のブロックがキーフレームから始まる最後の Cluster を探す。
+  // 索引がまだ timeNs まで届いていない場合は false (trackIndex < 0 ならトラックを問わない)。
+  // セグメント単位の索引では timeNs を含むセグメントの先頭の Cluster を返す
+  // (セグメントはキーフレームから始まるものとする)
+  bool Find(uint64_t timeNs, int trackIndex, int64_t *offset);
+
+  // 最初の Cluster の位置。Start が成功していれば常に有効
+  int64_t GetFirstClusterOffset() const { return mFirstClusterOffset; }
+  uint64_t GetTimecodeScale() const { return mTimecodeScale; }
+  // トラック index → TrackNumber
+  const std::vector<uint64_t> &GetTrackNumbers() const { return mTrackNumbers; }
+  bool IsCompleted() const;
+  // 走査済み範囲の尺。最後まで走査していれば全体の尺になる
+  bool GetDurationNs(uint64_t *durationNs) const;
+  size_t GetClusterCount() const;
+  size_t GetBlockCount() const;
+
+private:
+  WebmSeekIndex(const WebmSeekIndex &);
+  WebmSeekIndex &operator=(const WebmSeekIndex &);
+
+  bool ParseHeader();
+  bool ParseInfo(int64_t pos, int64_t end);
+  bool ParseTracks(int64_t pos, int64_t end);
+  bool ParseCluster(int64_t pos, Entry *entry, std::vector<Block> *blocks, int64_t *next);
+  bool ParseBlockGroup(int64_t pos, int64_t end, Block *block);
+  bool ParseBlockHeader(int64_t pos, uint64_t size, Block *block);
+  void UpdateDuration(const Entry &entry, const std::vector<Block> &blocks);
+  bool Scan();
+  bool FindSegment(uint64_t timeNs, int64_t *offset);
+  bool ReadSegmentTime(size_t index, int64_t *clusterOffset, int64_t *timeNs);
+  bool ScanLastSegment();
+  bool ScanTail();
+  void IndexThread();
+
+  const uint8_t *Peek(int64_t pos, size_t length);
+  bool ReadElementHeader(int64_t pos, uint32_t *id, uint64_t *size, int *headerLength);
+  bool ReadUInt(int64_t pos, uint64_t size, uint64_t *value);
+  int FindTrackIndex(uint64_t trackNumber) const;
+
+  IMkvFileReader *mReader;
+  int64_t mFileSize;
+
+  // 走査用の読み込み窓
+  std::vector<uint8_t> mBuffer;
+  int64_t mBufferPos;
+  size_t mBufferSize;
+
+  int64_t mSegmentEnd; // サイズ不明なら -1
+  int64_t mFirstClusterOffset;
+  uint64_t mTimecodeScale;
+  std::vector<uint64_t> mTrackNumbers; // トラック index → TrackNumber
+
+  std::vector<Entry> mEntries;
+  std::vector<Block> mBlocks;
+  uint64_t mDurationNs;
+  std::vector<int64_t> mTrackLastNs, mTrackPrevNs; // 尺の計算用
+  bool mIsCompleted;
+
+  // セグメント単位の索引 (空なら通常の索引)
+  std::vector<int64_t> mSegmentOffsets;
+  std::vector<int64_t> mSegmentClusters; // 先頭の Cluster の位置 (未読なら -1)
+  std::vector<int64_t> mSegmentTimesNs;  // 先頭の Cluster の時刻 (未読なら -1)
+  bool mHasSegmentDuration;
+  std::atomic<bool> mIsQuit;
+
+  std::thread mThread;
+  mutable std::mutex mMutex;
+};
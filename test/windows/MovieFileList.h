@@ -0,0 +1,66 @@
+// -----------------------------------------------------------------------------
+// MovieFileList
+//   ファイル/ディレクトリを引数に取るテスト用ツールの共通処理。
+//
+//   ・ParseArgs() でフラグ (例: "-f") とそれ以外の入力を分け、ディレクトリは
+//     再帰的に *.webm を探してファイルの一覧にする
+//   ・ForEach() で一覧を順に処理し、最後に "N files, M failed" を出力する
+// -----------------------------------------------------------------------------
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+
+#include <filesystem> // C++17
+#include <functional>
+#include <string>
+#include <vector>
+
+class MovieFileList
+{
+public:
+  // flag と一致する引数があれば *flagSet を立てる。入力が 1 つも無ければ false
+  bool ParseArgs(int argc, char *argv[], const char *flag, bool *flagSet)
+  {
+    *flagSet = false;
+    std::vector<std::string> inputs;
+    for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], flag) == 0) {
+        *flagSet = true;
+      } else {
+        inputs.push_back(argv[i]);
+      }
+    }
+
+    mFiles.clear();
+    for (const std::string &input : inputs) {
+      std::error_code ec;
+      if (std::filesystem::is_directory(input, ec)) {
+        for (const auto &entry : std::filesystem::recursive_directory_iterator(input, ec)) {
+          if (entry.is_regular_file() && entry.path().extension() == ".webm") {
+            mFiles.push_back(entry.path().string());
+          }
+        }
+      } else {
+        mFiles.push_back(input);
+      }
+    }
+    return !inputs.empty();
+  }
+
+  // func が false を返したファイルを失敗として数える。戻り値は失敗数
+  int ForEach(const std::function<bool(const std::string &)> &func) const
+  {
+    int failed = 0;
+    for (const std::string &path : mFiles) {
+      failed += func(path) ? 0 : 1;
+    }
+    printf("%zu files, %d failed\n", mFiles.size(), failed);
+    return failed;
+  }
+
+  const std::vector<std::string> &Files() const { return mFiles; }
+
+private:
+  std::vector<std::string> mFiles;
+};
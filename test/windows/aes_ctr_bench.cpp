@@ -0,0 +1,180 @@
+// 暗号化ブロックの復号 (AesCtrDecryptor) の速度計測ツール
+//
+//   aes_ctr_bench [seconds]
+//
+// 4K 動画のフレームを想定したサイズごとに、C 実装と AES 命令版 (使える場合) で
+// 1 フレームあたりの復号時間とスループットを表示する。
+// 計測の前に既知の答えと C 実装/AES 命令版の一致を確かめ、違えば失敗で終了する。
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#include "AesCtrDecryptor.h"
+
+// 4K VP9 の目安: インターフレーム 64KiB 〜 キーフレーム 1MiB 程度、4MiB は高ビットレートの上限
+static const size_t FRAME_SIZES[] = { 64 * 1024, 256 * 1024, 1024 * 1024, 4 * 1024 * 1024 };
+
+// RFC 3686 Test Vector #1。カウンタブロックは nonce(4) + IV(8) + カウンタ(4, 1 から) で、
+// IV(8) + ブロック番号(8) と同じ並びになる (ブロック番号 0 を読み飛ばしてから使う)
+static const uint8_t RFC3686_KEY[] = { 0xae, 0x68, 0x52, 0xf8, 0x12, 0x10, 0x67, 0xcc,
+                                       0x4b, 0xf7, 0xa5, 0x76, 0x55, 0x77, 0xf3, 0x9e };
+static const uint8_t RFC3686_IV[]  = { 0x00, 0x00, 0x00, 0x30, 0x00, 0x00, 0x00, 0x00 };
+static const uint8_t RFC3686_PLAIN[]  = { 'S', 'i', 'n', 'g', 'l', 'e', ' ', 'b',
+                                          'l', 'o', 'c', 'k', ' ', 'm', 's', 'g' };
+static const uint8_t RFC3686_CIPHER[] = { 0xe4, 0x09, 0x5d, 0x4f, 0xb7, 0xa7, 0xb3, 0x79,
+                                          0x2d, 0x61, 0x75, 0xa3, 0x26, 0x13, 0x11, 0xb8 };
+
+// SP 800-38A F.5.1 の鍵と平文を、IV f0..f7・ブロック番号 0 から暗号化したもの
+// (openssl enc -aes-128-ctr -iv f0f1f2f3f4f5f6f70000000000000000 と同じ)
+static const uint8_t SP800_KEY[] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6,
+                                     0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+static const uint8_t SP800_IV[]  = { 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7 };
+static const uint8_t SP800_PLAIN[] = {
+  0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+  0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+  0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+  0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10,
+};
+static const uint8_t SP800_CIPHER[] = {
+  0x67, 0xee, 0x05, 0x54, 0x74, 0x99, 0xf8, 0xbc, 0xf0, 0xc3, 0x83, 0x24, 0xe8, 0x60, 0x5c, 0x28,
+  0x01, 0x82, 0x16, 0xa5, 0xf4, 0xda, 0xc1, 0xaf, 0x7e, 0x12, 0xae, 0x7a, 0x0c, 0x2e, 0x3e, 0x9f,
+  0x13, 0xe8, 0xbc, 0x4a, 0x37, 0x57, 0xa5, 0x48, 0x13, 0x98, 0x05, 0xcf, 0x95, 0x63, 0x14, 0x0d,
+  0x2f, 0x88, 0x8d, 0x31, 0x4b, 0x55, 0x2b, 0x83, 0x96, 0x78, 0xe5, 0xf1, 0x2d, 0x56, 0xa9, 0x48,
+};
+
+static bool
+verify_known_answer(bool useHardware)
+{
+  AesCtrDecryptor decryptor;
+  decryptor.SetKey(RFC3686_KEY, sizeof(RFC3686_KEY), useHardware);
+  const char *name = decryptor.IsHardware() ? "hardware" : "c";
+
+  uint8_t data[sizeof(SP800_PLAIN)] = {};
+  decryptor.Start(RFC3686_IV, sizeof(RFC3686_IV));
+  decryptor.Apply(data, AesCtrDecryptor::BLOCK_SIZE);
+  memcpy(data, RFC3686_PLAIN, sizeof(RFC3686_PLAIN));
+  decryptor.Apply(data, sizeof(RFC3686_PLAIN));
+  if (memcmp(data, RFC3686_CIPHER, sizeof(RFC3686_CIPHER)) != 0) {
+    printf("%s: RFC 3686 known answer mismatch\n", name);
+    return false;
+  }
+
+  // ブロック境界をまたぐ端数の Apply を続けても鍵ストリームが続きから使われること
+  decryptor.SetKey(SP800_KEY, sizeof(SP800_KEY), useHardware);
+  decryptor.Start(SP800_IV, sizeof(SP800_IV));
+  memcpy(data, SP800_PLAIN, sizeof(SP800_PLAIN));
+  static const size_t SPLITS[] = { 5, 20, 7, 32 };
+  size_t offset = 0;
+  for (size_t split : SPLITS) {
+    decryptor.Apply(data + offset, split);
+    offset += split;
+  }
+  if (memcmp(data, SP800_CIPHER, sizeof(SP800_CIPHER)) != 0) {
+    printf("%s: SP 800-38A key known answer mismatch\n", name);
+    return false;
+  }
+  return true;
+}
+
+// AES 命令版が C 実装と同じ結果になること (大きなフレーム・端数・分割を含めて)
+static bool
+verify_hardware_matches_c()
+{
+  uint8_t key[AesCtrDecryptor::KEY_SIZE];
+  uint8_t iv[AesCtrDecryptor::IV_SIZE];
+  for (size_t i = 0; i < sizeof(key); i++) {
+    key[i] = (uint8_t)(i * 29 + 3);
+  }
+  for (size_t i = 0; i < sizeof(iv); i++) {
+    iv[i] = (uint8_t)(0xff - i);
+  }
+  std::vector<uint8_t> expected(1024 * 1024 + 7);
+  for (size_t i = 0; i < expected.size(); i++) {
+    expected[i] = (uint8_t)(i * 7 + (i >> 8));
+  }
+  std::vector<uint8_t> actual = expected;
+
+  AesCtrDecryptor soft, hard;
+  soft.SetKey(key, sizeof(key), false);
+  hard.SetKey(key, sizeof(key), true);
+  soft.Start(iv, sizeof(iv));
+  hard.Start(iv, sizeof(iv));
+  soft.Apply(expected.data(), expected.size());
+  size_t offset = 0;
+  for (size_t split = 1; offset < actual.size(); split = split * 3 + 1) {
+    size_t size = std::min(split, actual.size() - offset);
+    hard.Apply(actual.data() + offset, size);
+    offset += size;
+  }
+  if (expected != actual) {
+    printf("hardware: result differs from c\n");
+    return false;
+  }
+  return true;
+}
+
+static void
+bench(bool useHardware, size_t frameSize, double seconds)
+{
+  uint8_t key[AesCtrDecryptor::KEY_SIZE];
+  uint8_t iv[AesCtrDecryptor::IV_SIZE];
+  for (size_t i = 0; i < sizeof(key); i++) {
+    key[i] = (uint8_t)(i * 17 + 1);
+  }
+  for (size_t i = 0; i < sizeof(iv); i++) {
+    iv[i] = (uint8_t)(i * 31 + 7);
+  }
+
+  AesCtrDecryptor decryptor;
+  decryptor.SetKey(key, sizeof(key), useHardware);
+  std::vector<uint8_t> frame(frameSize, 0x5a);
+
+  auto begin     = std::chrono::steady_clock::now();
+  auto limit     = begin + std::chrono::duration<double>(seconds);
+  uint64_t count = 0;
+  while (std::chrono::steady_clock::now() < limit) {
+    // フレームごとに IV が変わるのと同じく毎回 Start からやり直す
+    iv[0] = (uint8_t)count;
+    decryptor.Start(iv, sizeof(iv));
+    decryptor.Apply(frame.data(), frame.size());
+    count++;
+  }
+  double elapsed =
+    std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+  printf("%-8s %8zuKiB %10.1fus/frame %9.1fMB/s (%" PRIu64 " frames)\n",
+         decryptor.IsHardware() ? "hardware" : "c", frameSize / 1024, elapsed * 1e6 / count,
+         (double)frameSize * count / elapsed / 1e6, count);
+}
+
+int
+main(int argc, char *argv[])
+{
+  double seconds = (argc > 1) ? atof(argv[1]) : 1.0;
+  if (seconds <= 0.0) {
+    printf("  Usage: %s [seconds]\n", argv[0]);
+    return -1;
+  }
+
+  bool hardware = AesCtrDecryptor::IsHardwareSupported();
+  printf("aes hardware: %s\n", hardware ? "yes" : "no");
+  if (!verify_known_answer(false) ||
+      (hardware && (!verify_known_answer(true) || !verify_hardware_matches_c()))) {
+    printf("FAILED\n");
+    return 1;
+  }
+  printf("known answer: ok\n");
+
+  for (size_t frameSize : FRAME_SIZES) {
+    bench(false, frameSize, seconds);
+    if (hardware) {
+      bench(true, frameSize, seconds);
+    }
+  }
+  return 0;
+}
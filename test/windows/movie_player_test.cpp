@@ -1,5 +1,6 @@
 #define NOMINMAX
 
+#include <cinttypes>
 #include <cstdio>
 #include <cstring>
 #include <string>
@@ -41,6 +42,17 @@ key_callback(GLFWwindow *window, int key, int scancode, int action, int mods)
       player->Seek(0);
     } else if (key == GLFW_KEY_ESCAPE) {
       player->Stop();
+    } else if (key == GLFW_KEY_I) {
+      IMoviePlayer::IOStats stats;
+      player->GetIOStats(&stats);
+      printf("I/O demux: read=%" PRIu64 " (%" PRIu64 " bytes) seek=%" PRIu64
+             " (back %" PRIu64 ") blocked=%" PRId64 "us\n",
+             stats.readCalls, stats.readBytes, stats.seekCalls, stats.backwardSeeks,
+             stats.blockedUs);
+      printf("I/O storage: read=%" PRIu64 " (%" PRIu64 " bytes) seek=%" PRIu64
+             " (back %" PRIu64 ") time=%" PRId64 "us\n",
+             stats.storageReadCalls, stats.storageReadBytes, stats.storageSeekCalls,
+             stats.storageBackwardSeeks, stats.storageReadUs);
     }
   }
 }
@@ -0,0 +1,95 @@
+// IMoviePlayer::Probe の速度計測ツール
+//
+//   movie_probe_bench [-c] <file or directory>...
+//
+// ディレクトリは再帰的に *.webm を探し、各ファイルを Probe して情報と所要時間を表示する。
+// -c を付けると比較用に CreateMoviePlayer (デコーダ生成・プリロード込み) の時間も計る。
+#include <cstdio>
+#include <cinttypes>
+
+#include <chrono>
+#include <string>
+
+#include "IMoviePlayer.h"
+#include "MovieFileList.h"
+
+struct BenchTotal
+{
+  int64_t probeUs;
+  int64_t openUs;
+};
+
+static int64_t
+elapsed_us(std::chrono::steady_clock::time_point begin)
+{
+  return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() -
+                                                               begin)
+    .count();
+}
+
+static bool
+bench_file(const std::string &moviePath, bool compare, BenchTotal *total)
+{
+  auto begin = std::chrono::steady_clock::now();
+  IMoviePlayer::ProbeInfo info;
+  bool success    = IMoviePlayer::Probe(moviePath.c_str(), &info);
+  int64_t probeUs = elapsed_us(begin);
+  if (!success) {
+    printf("%s: probe failed\n", moviePath.c_str());
+    return false;
+  }
+  total->probeUs += probeUs;
+
+  printf("%s: %.3fs", moviePath.c_str(), info.durationUs / 1e6);
+  if (info.hasVideo) {
+    printf(" video=%s %dx%d %.2ffps", info.videoCodec, info.video.width, info.video.height,
+           info.video.frameRate);
+  }
+  if (info.hasAudio) {
+    printf(" audio=%s %dHz %dch", info.audioCodec, info.audio.sampleRate, info.audio.channels);
+  }
+  printf(" probe=%" PRId64 "us", probeUs);
+
+  if (compare) {
+    IMoviePlayer::InitParam param;
+    param.Init();
+    param.videoColorFormat = IMoviePlayer::COLOR_RGBA;
+
+    begin                = std::chrono::steady_clock::now();
+    IMoviePlayer *player = IMoviePlayer::CreateMoviePlayer(moviePath.c_str(), param);
+    delete player;
+    int64_t openUs = elapsed_us(begin);
+    total->openUs += openUs;
+    printf(" open=%" PRId64 "us", openUs);
+  }
+  printf("\n");
+  return true;
+}
+
+int
+main(int argc, char *argv[])
+{
+  bool compare = false;
+  MovieFileList files;
+  if (!files.ParseArgs(argc, argv, "-c", &compare)) {
+    printf("  Usage: %s [-c] <file or directory>...\n", argv[0]);
+    return -1;
+  }
+
+  BenchTotal total = {};
+  auto begin       = std::chrono::steady_clock::now();
+  int failed       = files.ForEach(
+    [compare, &total](const std::string &path) { return bench_file(path, compare, &total); });
+  int64_t wallUs = elapsed_us(begin);
+
+  int probed = (int)files.Files().size() - failed;
+  printf("total: %.3fs\n", wallUs / 1e6);
+  if (probed > 0) {
+    printf("probe: %.1fus/file", (double)total.probeUs / probed);
+    if (compare) {
+      printf(", open: %.1fus/file", (double)total.openUs / probed);
+    }
+    printf("\n");
+  }
+  return (failed == 0) ? 0 : 1;
+}
@@ -0,0 +1,165 @@
+// WebmExtractor のパケット読み出し (Advance/ReadSampleData) の速度計測ツール
+//
+//   webm_demux_bench [-r] [-s seconds] <file>...
+//
+// 全トラックを選択して先頭から終端までの読み出しを seconds 秒 (既定 1 秒) 繰り返し、
+// nestegg_read_packet で読む場合と WebmBlockParser で読む場合のパケット/秒と
+// フレームデータの MB/s を表示する。両者のフレームデータのチェックサムも比較する。
+// -r を付けるとファイルをマップせずに IMovieReadStream 経由で読む (フレームデータが
+// 読み込み先のバッファを参照する場合の計測)。
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cinttypes>
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "FramePacket.h"
+#include "IMoviePlayer.h"
+#include "WebmExtractor.h"
+
+// stdio で読むだけの stream
+class FileReadStream : public IMovieReadStream
+{
+public:
+  FileReadStream(const char *path)
+  : mFile(fopen(path, "rb"))
+  , mSize(0)
+  {
+    if (mFile) {
+      fseek(mFile, 0, SEEK_END);
+      mSize = (size_t)ftell(mFile);
+      fseek(mFile, 0, SEEK_SET);
+    }
+  }
+  virtual ~FileReadStream()
+  {
+    if (mFile) {
+      fclose(mFile);
+    }
+  }
+
+  bool IsOpened() const { return mFile != nullptr; }
+
+  virtual int AddRef(void) { return 1; }
+  virtual int Release(void) { return 1; }
+  virtual size_t Read(void *buf, size_t size) { return fread(buf, 1, size, mFile); }
+  virtual int64_t Tell() const { return ftell(mFile); }
+  virtual void Seek(int64_t offset, int origin) { fseek(mFile, (long)offset, origin); }
+  virtual size_t Size() const { return mSize; }
+
+private:
+  FILE *mFile;
+  size_t mSize;
+};
+
+struct BenchResult
+{
+  bool success;
+  uint64_t packets;
+  uint64_t bytes;
+  uint32_t checksum; // 1 周目のフレームデータ
+  double seconds;
+};
+
+static BenchResult
+bench(const std::string &moviePath, bool useBlockParser, bool useStream, double seconds)
+{
+  BenchResult result = {};
+
+  WebmExtractor::Config config;
+  config.Init();
+  config.useBlockParser   = useBlockParser;
+  config.memoryMappedFile = true;
+
+  // stream は extractor より長生きさせる
+  FileReadStream stream(moviePath.c_str());
+  WebmExtractor *extractor = new WebmExtractor(config);
+  bool isOpened            = useStream ? (stream.IsOpened() && extractor->Open(&stream))
+                                       : extractor->Open(moviePath);
+  if (isOpened) {
+    for (size_t i = 0; i < extractor->GetTrackCount(); i++) {
+      TrackInfo info;
+      if (extractor->GetTrackInfo((int32_t)i, &info)) {
+        extractor->SelectTrack(info.type, (int32_t)i);
+      }
+    }
+
+    FramePacket packet;
+    auto begin = std::chrono::steady_clock::now();
+    auto limit = begin + std::chrono::duration<double>(seconds);
+    bool first = true;
+    do {
+      while (extractor->NextFramePacketType() != TRACK_TYPE_UNKNOWN &&
+             extractor->ReadSampleData(&packet)) {
+        if (first) {
+          for (size_t i = 0; i < packet.dataSize; i++) {
+            result.checksum = result.checksum * 31 + packet.data[i];
+          }
+        }
+        result.packets++;
+        result.bytes += packet.dataSize;
+        packet.ReturnBorrowed();
+        extractor->Advance();
+      }
+      first = false;
+    } while (std::chrono::steady_clock::now() < limit && extractor->SeekTo(0));
+    result.seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    result.success = (result.packets > 0);
+  }
+  delete extractor;
+  return result;
+}
+
+static void
+print_result(const char *name, const BenchResult &result)
+{
+  printf("  %-8s %10.0f packets/s %9.1fMB/s (%" PRIu64 " packets, check=%08x)\n", name,
+         result.packets / result.seconds, result.bytes / result.seconds / 1e6, result.packets,
+         result.checksum);
+}
+
+int
+main(int argc, char *argv[])
+{
+  bool useStream = false;
+  double seconds = 1.0;
+  std::vector<std::string> inputs;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-r") == 0) {
+      useStream = true;
+    } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+      seconds = atof(argv[++i]);
+    } else {
+      inputs.push_back(argv[i]);
+    }
+  }
+  if (inputs.empty() || seconds <= 0.0) {
+    printf("  Usage: %s [-r] [-s seconds] <file>...\n", argv[0]);
+    return -1;
+  }
+
+  int failed = 0;
+  for (const std::string &input : inputs) {
+    BenchResult nestegg = bench(input, false, useStream, seconds);
+    BenchResult parser  = bench(input, true, useStream, seconds);
+    if (!nestegg.success || !parser.success) {
+      printf("%s: open failed\n", input.c_str());
+      failed++;
+      continue;
+    }
+    printf("%s:\n", input.c_str());
+    print_result("nestegg", nestegg);
+    print_result("parser", parser);
+    printf("  speedup  %.2fx%s\n",
+           (parser.packets / parser.seconds) / (nestegg.packets / nestegg.seconds),
+           (parser.checksum == nestegg.checksum) ? "" : " (checksum mismatch)");
+    if (parser.checksum != nestegg.checksum) {
+      failed++;
+    }
+  }
+  return (failed == 0) ? 0 : 1;
+}
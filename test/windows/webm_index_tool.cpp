@@ -0,0 +1,69 @@
+// WebM のシーク索引ファイル (サイドカー) を事前生成するツール
+//
+//   webm_index_tool [-f] <file or directory>...
+//
+// ディレクトリは再帰的に *.webm を探す。索引ファイルはムービーと同じ場所に
+// "<ムービー名>.idx" として置かれ、プレイヤーのファイルパス指定 Open で読み込まれる。
+// 既存の索引ファイルがムービーと一致していれば作り直さない (-f で強制再生成)。
+#include <cstdio>
+#include <cinttypes>
+
+#include <chrono>
+#include <string>
+
+#include "MkvFileReader.h"
+#include "MovieFileList.h"
+#include "WebmSeekIndex.h"
+
+static bool
+generate_index(const std::string &moviePath, bool force)
+{
+  IMkvFileReader *reader = IMkvFileReader::Create(moviePath.c_str());
+  if (reader == nullptr) {
+    printf("%s: open failed\n", moviePath.c_str());
+    return false;
+  }
+
+  std::string indexPath = WebmSeekIndex::GetIndexFilePath(moviePath);
+  if (!force) {
+    WebmSeekIndex current;
+    if (current.Load(indexPath, moviePath, reader)) {
+      printf("%s: up to date\n", moviePath.c_str());
+      delete reader;
+      return true;
+    }
+  }
+
+  auto begin = std::chrono::steady_clock::now();
+  WebmSeekIndex index;
+  bool success = index.Build(reader) && index.Save(indexPath, moviePath, reader);
+  auto elapsed =
+    std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - begin);
+
+  uint64_t durationNs = 0;
+  index.GetDurationNs(&durationNs);
+  if (success) {
+    printf("%s: clusters=%zu blocks=%zu duration=%.3fs (%" PRId64 "ms)\n", moviePath.c_str(),
+           index.GetClusterCount(), index.GetBlockCount(), durationNs / 1e9,
+           (int64_t)elapsed.count());
+  } else {
+    printf("%s: failed\n", moviePath.c_str());
+  }
+  delete reader;
+  return success;
+}
+
+int
+main(int argc, char *argv[])
+{
+  bool force = false;
+  MovieFileList files;
+  if (!files.ParseArgs(argc, argv, "-f", &force)) {
+    printf("  Usage: %s [-f] <file or directory>...\n", argv[0]);
+    return -1;
+  }
+
+  int failed =
+    files.ForEach([force](const std::string &path) { return generate_index(path, force); });
+  return (failed == 0) ? 0 : 1;
+}